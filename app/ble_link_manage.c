@@ -0,0 +1,545 @@
+// own headers
+#include "ble_link_manage.h"
+
+// std library
+#include <string.h>
+
+// sdk
+#include "app_error.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "ble_conn_params.h"
+#include "ble_gap.h"
+#include "ble_hci.h"
+#include "nrf_atomic.h"
+#include "nrf_sdh_ble.h"
+#include "peer_manager.h"
+#define NRF_LOG_MODULE_NAME BleLink
+#include "nrf_log.h"
+#include "nrf_log_ctrl.h"
+NRF_LOG_MODULE_REGISTER();
+
+#define LINK_PHY_REQUEST_DELAY    APP_TIMER_TICKS(1000) // let MTU and data length exchange go first
+#define LINK_DL_RETRY_DELAY       APP_TIMER_TICKS(200)  // data length procedure busy, try again
+#define LINK_DL_RETRY_MAX         10
+#define LINK_SETTLE_TIMEOUT       APP_TIMER_TICKS(5000) // link has to survive this long to keep the profile
+#define LINK_PROFILE_RECORD_MAGIC 0x4C4B5000U           // "LKP" + profile in the low byte
+
+#define LINK_MODE_SAMPLE_INTERVAL_MS 500
+#define LINK_MODE_BULK_ENTER_BYTES   512 // per sample, about 1 KB/s
+#define LINK_MODE_BULK_EXIT_BYTES    128 // per sample
+#define LINK_MODE_BULK_EXIT_SAMPLES  4   // below exit rate this long before slowing down
+#define LINK_MODE_IDLE_BYTES         64  // per sample, anything above wakes the link
+#define LINK_MODE_IDLE_ENTER_SAMPLES 60  // quiet this long before going idle
+#define LINK_MODE_HOLD_SAMPLES       4   // minimum spacing between requests
+
+enum
+{
+    LINK_STEP_IDLE,
+    LINK_STEP_DATA_LENGTH,
+    LINK_STEP_PHY,
+    LINK_STEP_SETTLE,
+};
+
+APP_TIMER_DEF(m_link_timer_id);
+
+static nrf_ble_gatt_t* m_gatt_p = NULL;
+static uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;
+static pm_peer_id_t m_peer_id = PM_PEER_ID_INVALID;
+static uint8_t m_link_step = LINK_STEP_IDLE;
+static uint8_t m_link_dl_retries;
+static link_profile_info_t m_link;
+
+// flash write is asynchronous, record must stay valid
+static uint32_t m_profile_record;
+
+APP_TIMER_DEF(m_mode_timer_id);
+
+static ble_gap_conn_params_t m_mode_params[LINK_MODE_COUNT] = {
+    [LINK_MODE_BULK] =
+        {
+            .min_conn_interval = MSEC_TO_UNITS(7.5, UNIT_1_25_MS),
+            .max_conn_interval = MSEC_TO_UNITS(15, UNIT_1_25_MS),
+            .slave_latency = 0,
+        },
+    [LINK_MODE_IDLE] =
+        {
+            .min_conn_interval = MSEC_TO_UNITS(100, UNIT_1_25_MS),
+            .max_conn_interval = MSEC_TO_UNITS(200, UNIT_1_25_MS),
+            .slave_latency = 4,
+            .conn_sup_timeout = MSEC_TO_UNITS(4000, UNIT_10_MS),
+        },
+};
+static nrf_atomic_u32_t m_traffic_bytes;
+static link_mode_t m_mode_target = LINK_MODE_NORMAL; // last requested
+static link_mode_t m_mode_active = LINK_MODE_NORMAL; // from the interval in use
+static uint8_t m_mode_rejected;                      // modes refused on this connection
+static uint16_t m_quiet_samples, m_slow_samples, m_hold_samples;
+static link_mode_stats_t m_mode_stats;
+
+// ================================
+// functions private
+
+static link_profile_t link_profile_measure(void)
+{
+    if ( m_link.data_length <= BLE_GAP_DATA_LENGTH_DEFAULT )
+        return LINK_PROFILE_LEGACY;
+
+    if ( m_link.tx_phy == BLE_GAP_PHY_2MBPS && m_link.rx_phy == BLE_GAP_PHY_2MBPS )
+        return LINK_PROFILE_FAST;
+
+    return LINK_PROFILE_DLE;
+}
+
+static bool link_profile_load(pm_peer_id_t peer_id, link_profile_t* p_profile)
+{
+    uint32_t record = 0;
+    uint32_t len = sizeof(record);
+
+    if ( peer_id == PM_PEER_ID_INVALID )
+        return false;
+
+    if ( pm_peer_data_app_data_load(peer_id, &record, &len) != NRF_SUCCESS || len != sizeof(record) )
+        return false;
+
+    if ( (record & 0xFFFFFF00U) != LINK_PROFILE_RECORD_MAGIC || (record & 0xFFU) > LINK_PROFILE_FAST )
+        return false;
+
+    *p_profile = (link_profile_t)(record & 0xFFU);
+    return true;
+}
+
+static void link_profile_store(link_profile_t profile)
+{
+    ret_code_t err_code;
+    link_profile_t stored;
+
+    if ( m_peer_id == PM_PEER_ID_INVALID )
+        return;
+
+    if ( link_profile_load(m_peer_id, &stored) && stored == profile )
+        return;
+
+    m_profile_record = LINK_PROFILE_RECORD_MAGIC | profile;
+    err_code = pm_peer_data_app_data_store(m_peer_id, &m_profile_record, sizeof(m_profile_record), NULL);
+    if ( err_code != NRF_SUCCESS )
+    {
+        NRF_LOG_WARNING("peer %d profile store failed 0x%x", m_peer_id, err_code);
+        return;
+    }
+    NRF_LOG_INFO("peer %d profile stored %d", m_peer_id, profile);
+}
+
+static void link_peer_id_refresh(void)
+{
+    pm_peer_id_t peer_id;
+
+    // peer id only exists once bonded, pick it up whenever possible
+    if ( pm_peer_id_get(m_conn_handle, &peer_id) == NRF_SUCCESS && peer_id != PM_PEER_ID_INVALID )
+    {
+        m_peer_id = peer_id;
+    }
+}
+
+// Returns false while the request has to wait for another procedure, the timer comes back for it.
+static bool link_data_length_request(void)
+{
+    ret_code_t err_code;
+    // nrf_ble_gatt already asked for NRF_SDH_BLE_GAP_DATA_LENGTH, legacy pulls it back
+    uint8_t data_length =
+        (m_link.target == LINK_PROFILE_LEGACY) ? BLE_GAP_DATA_LENGTH_DEFAULT : BLE_GAP_DATA_LENGTH_MAX;
+
+    err_code = nrf_ble_gatt_data_length_set(m_gatt_p, m_conn_handle, data_length);
+    if ( (err_code == NRF_ERROR_BUSY || err_code == NRF_ERROR_INVALID_STATE) && m_link_dl_retries < LINK_DL_RETRY_MAX )
+    {
+        m_link_dl_retries++;
+        m_link_step = LINK_STEP_DATA_LENGTH;
+        err_code = app_timer_start(m_link_timer_id, LINK_DL_RETRY_DELAY, NULL);
+        APP_ERROR_CHECK(err_code);
+        return false;
+    }
+    if ( err_code != NRF_SUCCESS )
+    {
+        // settle measures what the link ended up with
+        NRF_LOG_WARNING("data length %d request failed 0x%x", data_length, err_code);
+    }
+    return true;
+}
+
+static void link_profile_continue(void)
+{
+    ret_code_t err_code;
+
+    if ( m_link.target == LINK_PROFILE_FAST )
+    {
+        m_link_step = LINK_STEP_PHY;
+        err_code = app_timer_start(m_link_timer_id, LINK_PHY_REQUEST_DELAY, NULL);
+    }
+    else
+    {
+        m_link_step = LINK_STEP_SETTLE;
+        err_code = app_timer_start(m_link_timer_id, LINK_SETTLE_TIMEOUT, NULL);
+    }
+    APP_ERROR_CHECK(err_code);
+}
+
+static void link_profile_apply(void)
+{
+    ret_code_t err_code;
+    ble_opt_t opt;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = (m_link.target == LINK_PROFILE_FAST) ? 1 : 0;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    APP_ERROR_CHECK(err_code);
+
+    m_link_dl_retries = 0;
+    if ( link_data_length_request() )
+    {
+        link_profile_continue();
+    }
+}
+
+static void link_phy_request(void)
+{
+    ret_code_t err_code;
+    const ble_gap_phys_t phys = {
+        .tx_phys = BLE_GAP_PHY_2MBPS,
+        .rx_phys = BLE_GAP_PHY_2MBPS,
+    };
+
+    err_code = sd_ble_gap_phy_update(m_conn_handle, &phys);
+    if ( err_code == NRF_ERROR_BUSY )
+    {
+        // another procedure in progress, try again later
+        err_code = app_timer_start(m_link_timer_id, LINK_PHY_REQUEST_DELAY, NULL);
+        APP_ERROR_CHECK(err_code);
+        return;
+    }
+    if ( err_code != NRF_SUCCESS )
+    {
+        NRF_LOG_WARNING("phy request failed 0x%x", err_code);
+    }
+
+    m_link_step = LINK_STEP_SETTLE;
+    err_code = app_timer_start(m_link_timer_id, LINK_SETTLE_TIMEOUT, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void link_settle(void)
+{
+    link_peer_id_refresh();
+
+    m_link.active = link_profile_measure();
+    m_link.settled = true;
+    m_link_step = LINK_STEP_IDLE;
+
+    NRF_LOG_INFO(
+        "link settled, profile %d (target %d) dl %d phy %d/%d", m_link.active, m_link.target, m_link.data_length,
+        m_link.tx_phy, m_link.rx_phy
+    );
+
+    link_profile_store(m_link.active);
+}
+
+static void link_timer_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    if ( m_conn_handle == BLE_CONN_HANDLE_INVALID )
+        return;
+
+    switch ( m_link_step )
+    {
+    case LINK_STEP_DATA_LENGTH:
+        if ( link_data_length_request() )
+        {
+            link_profile_continue();
+        }
+        break;
+    case LINK_STEP_PHY:
+        link_phy_request();
+        break;
+    case LINK_STEP_SETTLE:
+        link_settle();
+        break;
+    default:
+        break;
+    }
+}
+
+static link_mode_t link_mode_classify(const ble_gap_conn_params_t* p_params)
+{
+    if ( p_params->max_conn_interval <= m_mode_params[LINK_MODE_BULK].max_conn_interval )
+        return LINK_MODE_BULK;
+
+    if ( p_params->slave_latency > 0 || p_params->max_conn_interval >= m_mode_params[LINK_MODE_IDLE].min_conn_interval )
+        return LINK_MODE_IDLE;
+
+    return LINK_MODE_NORMAL;
+}
+
+static void link_mode_request(link_mode_t mode)
+{
+    ret_code_t err_code;
+
+    if ( mode == m_mode_target || (m_mode_rejected & (1 << mode)) )
+        return;
+
+    err_code = ble_conn_params_change_conn_params(m_conn_handle, &m_mode_params[mode]);
+    if ( err_code != NRF_SUCCESS )
+    {
+        // procedure in progress, retried on next sample
+        NRF_LOG_DEBUG("mode %d request failed 0x%x", mode, err_code);
+        return;
+    }
+
+    NRF_LOG_INFO("connection mode %d -> %d", m_mode_target, mode);
+    m_mode_target = mode;
+    m_hold_samples = LINK_MODE_HOLD_SAMPLES;
+    m_mode_stats.requests++;
+}
+
+static void link_mode_timer_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    uint32_t bytes = nrf_atomic_u32_fetch_store(&m_traffic_bytes, 0);
+    link_mode_t next = m_mode_target;
+
+    if ( m_conn_handle == BLE_CONN_HANDLE_INVALID )
+        return;
+
+    m_mode_stats.time_ms[m_mode_active] += LINK_MODE_SAMPLE_INTERVAL_MS;
+
+    if ( m_hold_samples > 0 )
+        m_hold_samples--;
+    m_quiet_samples = (bytes < LINK_MODE_IDLE_BYTES) ? m_quiet_samples + 1 : 0;
+    m_slow_samples = (bytes < LINK_MODE_BULK_EXIT_BYTES) ? m_slow_samples + 1 : 0;
+
+    if ( bytes >= LINK_MODE_BULK_ENTER_BYTES )
+        next = LINK_MODE_BULK;
+    else if ( m_mode_target == LINK_MODE_IDLE && m_quiet_samples == 0 )
+        next = LINK_MODE_NORMAL;
+    else if ( m_mode_target == LINK_MODE_BULK && m_slow_samples >= LINK_MODE_BULK_EXIT_SAMPLES )
+        next = LINK_MODE_NORMAL;
+    else if ( m_mode_target == LINK_MODE_NORMAL && m_quiet_samples >= LINK_MODE_IDLE_ENTER_SAMPLES )
+        next = LINK_MODE_IDLE;
+
+    if ( next == m_mode_target )
+        return;
+
+    // speeding up is latency critical, slowing down waits for the hold time
+    if ( m_hold_samples > 0 && next != LINK_MODE_BULK && m_mode_target != LINK_MODE_IDLE )
+        return;
+
+    link_mode_request(next);
+}
+
+static void link_mode_start(const ble_gap_conn_params_t* p_params)
+{
+    ret_code_t err_code;
+
+    nrf_atomic_u32_store(&m_traffic_bytes, 0);
+    m_mode_target = LINK_MODE_NORMAL;
+    m_mode_active = link_mode_classify(p_params);
+    m_mode_rejected = 0;
+    m_quiet_samples = 0;
+    m_slow_samples = 0;
+    m_hold_samples = LINK_MODE_HOLD_SAMPLES;
+
+    err_code = app_timer_start(m_mode_timer_id, APP_TIMER_TICKS(LINK_MODE_SAMPLE_INTERVAL_MS), NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void link_mode_stop(void)
+{
+    app_timer_stop(m_mode_timer_id);
+
+    NRF_LOG_INFO(
+        "mode time normal %d bulk %d idle %d ms, %d requests, %d rejects", m_mode_stats.time_ms[LINK_MODE_NORMAL],
+        m_mode_stats.time_ms[LINK_MODE_BULK], m_mode_stats.time_ms[LINK_MODE_IDLE], m_mode_stats.requests,
+        m_mode_stats.rejects
+    );
+}
+
+static bool link_disconnect_is_clean(uint8_t reason)
+{
+    switch ( reason )
+    {
+    case BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION:
+    case BLE_HCI_REMOTE_DEV_TERMINATION_DUE_TO_LOW_RESOURCES:
+    case BLE_HCI_REMOTE_DEV_TERMINATION_DUE_TO_POWER_OFF:
+    case BLE_HCI_LOCAL_HOST_TERMINATED_CONNECTION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void on_connected(const ble_gap_evt_t* p_gap_evt)
+{
+    link_profile_t stored;
+
+    m_conn_handle = p_gap_evt->conn_handle;
+    m_peer_id = PM_PEER_ID_INVALID;
+    link_peer_id_refresh();
+
+    memset(&m_link, 0, sizeof(m_link));
+    m_link.target = link_profile_load(m_peer_id, &stored) ? stored : LINK_PROFILE_FAST;
+    m_link.active = LINK_PROFILE_LEGACY;
+    m_link.data_length = BLE_GAP_DATA_LENGTH_DEFAULT;
+    m_link.tx_phy = BLE_GAP_PHY_1MBPS;
+    m_link.rx_phy = BLE_GAP_PHY_1MBPS;
+
+    NRF_LOG_INFO("peer %d, negotiating profile %d", m_peer_id, m_link.target);
+    link_profile_apply();
+    link_mode_start(&p_gap_evt->params.connected.conn_params);
+}
+
+static void on_disconnected(const ble_gap_evt_t* p_gap_evt)
+{
+    uint8_t reason = p_gap_evt->params.disconnected.reason;
+
+    app_timer_stop(m_link_timer_id);
+    link_mode_stop();
+
+    // dropped while negotiating, step down for this peer next time
+    if ( m_link_step != LINK_STEP_IDLE && !link_disconnect_is_clean(reason) && m_link.target > LINK_PROFILE_LEGACY )
+    {
+        NRF_LOG_WARNING("link lost (0x%x) during profile %d, falling back", reason, m_link.target);
+        link_profile_store((link_profile_t)(m_link.target - 1));
+    }
+
+    m_conn_handle = BLE_CONN_HANDLE_INVALID;
+    m_link_step = LINK_STEP_IDLE;
+    memset(&m_link, 0, sizeof(m_link));
+}
+
+static void ble_link_evt_handler(const ble_evt_t* p_ble_evt, void* p_context)
+{
+    const ble_gap_evt_t* p_gap_evt = &p_ble_evt->evt.gap_evt;
+
+    switch ( p_ble_evt->header.evt_id )
+    {
+    case BLE_GAP_EVT_CONNECTED:
+        on_connected(p_gap_evt);
+        break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+        if ( p_gap_evt->conn_handle == m_conn_handle )
+            on_disconnected(p_gap_evt);
+        break;
+
+    case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+        if ( p_gap_evt->conn_handle != m_conn_handle )
+            break;
+        m_link.data_length = p_gap_evt->params.data_length_update.effective_params.max_tx_octets;
+        m_link.active = link_profile_measure();
+        NRF_LOG_INFO("data length %d", m_link.data_length);
+        break;
+
+    case BLE_GAP_EVT_PHY_UPDATE:
+        if ( p_gap_evt->conn_handle != m_conn_handle )
+            break;
+        if ( p_gap_evt->params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS )
+        {
+            m_link.tx_phy = p_gap_evt->params.phy_update.tx_phy;
+            m_link.rx_phy = p_gap_evt->params.phy_update.rx_phy;
+        }
+        else
+        {
+            NRF_LOG_WARNING("phy update rejected 0x%x", p_gap_evt->params.phy_update.status);
+        }
+        m_link.active = link_profile_measure();
+        break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+        if ( p_gap_evt->conn_handle != m_conn_handle )
+            break;
+        m_mode_active = link_mode_classify(&p_gap_evt->params.conn_param_update.conn_params);
+        NRF_LOG_INFO(
+            "conn interval %d latency %d, mode %d", p_gap_evt->params.conn_param_update.conn_params.max_conn_interval,
+            p_gap_evt->params.conn_param_update.conn_params.slave_latency, m_mode_active
+        );
+        break;
+
+    case BLE_GAP_EVT_CONN_SEC_UPDATE:
+        if ( p_gap_evt->conn_handle == m_conn_handle )
+            link_peer_id_refresh();
+        break;
+
+    default:
+        break;
+    }
+}
+
+NRF_SDH_BLE_OBSERVER(m_ble_link_observer, BLE_LINK_OBSERVER_PRIO, ble_link_evt_handler, NULL);
+
+// ================================
+// functions public
+
+void ble_link_manage_init(nrf_ble_gatt_t* p_gatt)
+{
+    ret_code_t err_code;
+
+    m_gatt_p = p_gatt;
+    err_code = app_timer_create(&m_link_timer_id, APP_TIMER_MODE_SINGLE_SHOT, link_timer_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+link_profile_t ble_link_profile_get(void)
+{
+    return m_link.active;
+}
+
+void ble_link_profile_info_get(link_profile_info_t* p_info)
+{
+    CRITICAL_REGION_ENTER();
+    *p_info = m_link;
+    CRITICAL_REGION_EXIT();
+}
+
+void ble_link_mode_init(const ble_gap_conn_params_t* p_normal_params)
+{
+    ret_code_t err_code;
+
+    m_mode_params[LINK_MODE_NORMAL] = *p_normal_params;
+    m_mode_params[LINK_MODE_BULK].conn_sup_timeout = p_normal_params->conn_sup_timeout;
+
+    err_code = app_timer_create(&m_mode_timer_id, APP_TIMER_MODE_REPEATED, link_mode_timer_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+void ble_link_traffic_add(uint32_t bytes)
+{
+    nrf_atomic_u32_add(&m_traffic_bytes, bytes);
+}
+
+bool ble_link_mode_conn_params_failed(void)
+{
+    // only the normal parameters are mandatory, a refused traffic mode is not fatal
+    if ( m_conn_handle == BLE_CONN_HANDLE_INVALID || m_mode_target == LINK_MODE_NORMAL )
+        return false;
+
+    NRF_LOG_WARNING("central refused mode %d", m_mode_target);
+    m_mode_rejected |= (1 << m_mode_target);
+    m_mode_stats.rejects++;
+    m_mode_target = LINK_MODE_NORMAL;
+    m_hold_samples = LINK_MODE_HOLD_SAMPLES;
+    if ( ble_conn_params_change_conn_params(m_conn_handle, &m_mode_params[LINK_MODE_NORMAL]) == NRF_SUCCESS )
+        m_mode_stats.requests++;
+    return true;
+}
+
+link_mode_t ble_link_mode_get(void)
+{
+    return m_mode_active;
+}
+
+void ble_link_mode_stats_get(link_mode_stats_t* p_stats)
+{
+    CRITICAL_REGION_ENTER();
+    *p_stats = m_mode_stats;
+    CRITICAL_REGION_EXIT();
+}
@@ -0,0 +1,58 @@
+#ifndef _BLE_LINK_MANAGE_H_
+#define _BLE_LINK_MANAGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nrf_ble_gatt.h"
+
+// defines
+#define BLE_LINK_OBSERVER_PRIO      2   // after peer manager, before application
+#define BLE_GAP_DATA_LENGTH_DEFAULT 27  //!< The stack's default data length.
+#define BLE_GAP_DATA_LENGTH_MAX     251 //!< Maximum data length.
+
+// link profiles, ordered from least to most demanding
+typedef enum
+{
+    LINK_PROFILE_LEGACY = 0, // 27 bytes data length, 1M PHY
+    LINK_PROFILE_DLE = 1,    // 251 bytes data length, 1M PHY
+    LINK_PROFILE_FAST = 2,   // 251 bytes data length, 2M PHY, connection event extension
+} link_profile_t;
+
+typedef struct
+{
+    link_profile_t target; // profile negotiated for this peer
+    link_profile_t active; // profile the link is running now
+    uint8_t data_length;   // effective link layer payload (tx)
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    bool settled; // negotiation finished and the link survived it
+} link_profile_info_t;
+
+// connection interval modes, picked from traffic load
+typedef enum
+{
+    LINK_MODE_NORMAL = 0, // application default parameters
+    LINK_MODE_BULK,       // short interval for large transfers
+    LINK_MODE_IDLE,       // long interval with slave latency
+    LINK_MODE_COUNT,
+} link_mode_t;
+
+typedef struct
+{
+    uint32_t time_ms[LINK_MODE_COUNT]; // time spent in each mode, by actual interval
+    uint32_t requests;                 // parameter update requests sent
+    uint32_t rejects;                  // modes the central refused
+} link_mode_stats_t;
+
+void ble_link_manage_init(nrf_ble_gatt_t* p_gatt);
+link_profile_t ble_link_profile_get(void);
+void ble_link_profile_info_get(link_profile_info_t* p_info);
+
+void ble_link_mode_init(const ble_gap_conn_params_t* p_normal_params);
+void ble_link_traffic_add(uint32_t bytes);
+bool ble_link_mode_conn_params_failed(void);
+link_mode_t ble_link_mode_get(void);
+void ble_link_mode_stats_get(link_mode_stats_t* p_stats);
+
+#endif //_BLE_LINK_MANAGE_H_
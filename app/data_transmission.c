@@ -1,19 +1,83 @@
 #include "data_transmission.h"
 #include "app_error.h"
 #include "app_fifo.h"
-#include "app_uart.h"
+#include "app_scheduler.h"
+#include "app_util_platform.h"
+#include "crc16.h"
+#include "crc32.h"
+#include "nrf_balloc.h"
 #include "nrf_delay.h"
+#include "nrf_queue.h"
 #include "nrf_drv_gpiote.h"
 #include "nrf_drv_spi.h"
 #include "nrf_drv_twi.h"
+#include "nrfx_gpiote.h"
+#include "nrfx_ppi.h"
 #include "sdk_config.h"
 
-static volatile bool spi_xfer_done = true;
 static const nrfx_spim_t m_spim_master = NRFX_SPIM_INSTANCE(SPI_INSTANCE);
-static nrfx_spim_xfer_desc_t driver_spim_xfer;
+
+NRF_BALLOC_DEF(m_spi_pkt_pool, sizeof(spi_pkt_t), SPI_PKT_POOL_SIZE);
+STATIC_ASSERT(SPI_PKT_DATA_SIZE % SPI_FRAME_SIZE == 0);
+STATIC_ASSERT(SPI_PKT_DATA_SIZE >= NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3); // ATT opcode + handle
+STATIC_ASSERT(SPI_XFER_QUEUE_SIZE > SPI_PKT_POOL_SIZE);                // a packet is never refused a slot
+static uint32_t spi_pkt_dropped = 0;
+
+// async engine, one queued transfer is one CS assertion
+NRF_QUEUE_DEF(spi_xfer_t, m_spi_xfer_queue, SPI_XFER_QUEUE_SIZE, NRF_QUEUE_MODE_NO_OVERFLOW);
+NRF_QUEUE_DEF(spi_xfer_t, m_spi_done_queue, SPI_XFER_QUEUE_SIZE + 1, NRF_QUEUE_MODE_NO_OVERFLOW);
+
+static spi_xfer_t spi_xfer_cur;       // transfer on the wire
+static uint16_t spi_xfer_offset;      // bytes of spi_xfer_cur already handed to the SPIM
+static volatile bool spi_xfer_busy = false;
+static spi_xfer_t spi_xfer_read_slot; // reads go ahead of queued writes
+static volatile bool spi_xfer_read_pending = false;
+static volatile bool spi_xfer_read_session = false; // reader owns the bus between its steps
+static volatile bool spi_xfer_done_posted = false;
+static volatile bool spi_xfer_done_stalled = false; // spi_xfer_cur finished with the done queue full
+
+// padding is clocked from here, EasyDMA can not read flash
+static uint8_t spi_pad_buf[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// link layer, CRC is off until the STM32 turns it on
+#define SPI_CLK_WINDOW        32 // frames per error rate sample
+#define SPI_CLK_DOWN_ERRORS   2  // errors in a window that step the clock down
+#define SPI_CLK_UP_WINDOWS    4  // clean windows in a row before stepping up
+
+static const uint32_t spi_clk_levels[] = {NRF_SPIM_FREQ_2M, NRF_SPIM_FREQ_4M, NRF_SPIM_FREQ_8M};
+#define SPI_CLK_LEVEL_BASE 1 // 4M, what the link always ran at
+
+static uint8_t spi_crc_mode = SPI_CRC_NONE;
+static volatile uint8_t spi_frame_mode = SPI_FRAME_PADDED;
+static uint8_t spi_clk_level = SPI_CLK_LEVEL_BASE;
+static uint8_t spi_clk_applied = SPI_CLK_LEVEL_BASE;
+static uint8_t spi_clk_window_frames = 0;
+static uint8_t spi_clk_window_errors = 0;
+static uint8_t spi_clk_clean_windows = 0;
+static spi_link_stats_t spi_link_stats = {0};
+
+// recent writes in CRC mode, oldest first, their handlers are held back so a NAK can resend them
+static spi_xfer_t spi_xfer_retained[SPI_XFER_RETAIN_COUNT];
+static uint8_t spi_xfer_retained_count = 0;
+static uint8_t spi_xfer_seq = 0;
+static uint8_t spi_nak_frame[5] = {'n', 'a', 'k', 0, 0}; // + data type + sequence of the bad bulk read
+static uint8_t read_nak_seq;
+static uint8_t read_bulk_head[4]; // type, len16, sequence in CRC mode
+
+// ready line falling edge starts the header read through PPI, CS is dropped by a fork of the same channel
+static nrf_ppi_channel_t spi_read_ppi_channel;
+static bool spi_read_hw_available = false;
+static volatile bool spi_read_hw_armed = false;
+static volatile bool spi_read_hw_claimed = false;   // ready line interrupt already saw the edge
+static volatile bool spi_read_hw_unclaimed = false; // hardware took an edge the interrupt has not seen yet
+static bool spi_read_hw_disarm(void);
+static void spi_xfer_kick(void);
 
 void start_data_wait_timer(void);
-void ble_nus_send(uint8_t* data, uint16_t len);
+
+// set when the STM32 signalled data while BLE was still sending the previous message
+static volatile bool spi_read_deferred = false;
 
 enum
 {
@@ -31,9 +95,329 @@ enum
 
 bool spi_dir_out = false;
 
+static void spi_clk_account(bool error);
+
+static void spi_xfer_release(spi_xfer_t const* p_xfer)
+{
+    if ( p_xfer->handler != NULL )
+    {
+        p_xfer->handler(p_xfer->p_context);
+    }
+}
+
+static void spi_xfer_retained_remove(uint8_t index)
+{
+    spi_xfer_retained_count--;
+    memmove(
+        &spi_xfer_retained[index], &spi_xfer_retained[index + 1],
+        (spi_xfer_retained_count - index) * sizeof(spi_xfer_t)
+    );
+}
+
+// the STM32 NAKs a bad write before it sends anything else, a message read from it clears the window
+static void spi_xfer_retained_release_all(void)
+{
+    spi_xfer_t retained[SPI_XFER_RETAIN_COUNT];
+    uint8_t count;
+
+    CRITICAL_REGION_ENTER();
+    count = spi_xfer_retained_count;
+    memcpy(retained, spi_xfer_retained, count * sizeof(spi_xfer_t));
+    spi_xfer_retained_count = 0;
+    CRITICAL_REGION_EXIT();
+
+    for ( uint8_t i = 0; i < count; i++ )
+    {
+        spi_xfer_release(&retained[i]);
+    }
+}
+
+static void spi_xfer_done_handler(void* data, uint16_t len)
+{
+    spi_xfer_t xfer;
+    spi_xfer_t oldest;
+
+    spi_xfer_done_posted = false;
+    for ( ;; )
+    {
+        // room again for a completion the SPIM IRQ had to hold back, the bus waited for it
+        CRITICAL_REGION_ENTER();
+        if ( spi_xfer_done_stalled && nrf_queue_push(&m_spi_done_queue, &spi_xfer_cur) == NRF_SUCCESS )
+        {
+            spi_xfer_done_stalled = false;
+            spi_xfer_busy = false;
+            spi_xfer_kick();
+        }
+        CRITICAL_REGION_EXIT();
+
+        if ( nrf_queue_pop(&m_spi_done_queue, &xfer) != NRF_SUCCESS )
+        {
+            break;
+        }
+
+        if ( xfer.p_tx == NULL )
+        {
+            spi_xfer_release(&xfer);
+            continue;
+        }
+
+        spi_link_stats.frames_tx++;
+        if ( xfer.crc_len != 0 )
+        {
+            // a bad one comes back as a NAK and is accounted then
+            spi_clk_account(false);
+        }
+        if ( xfer.crc_len == 0 || xfer.p_tx == spi_nak_frame )
+        {
+            spi_xfer_release(&xfer);
+            continue;
+        }
+
+        // keep the newest writes, the oldest one drops out of the window
+        if ( spi_xfer_retained_count == SPI_XFER_RETAIN_COUNT )
+        {
+            oldest = spi_xfer_retained[0];
+            spi_xfer_retained_remove(0);
+            spi_xfer_release(&oldest);
+        }
+        spi_xfer_retained[spi_xfer_retained_count++] = xfer;
+    }
+}
+
+// Trailer is the sequence byte, then the CRC over everything clocked before it, length header included.
+static void spi_crc_fill(spi_xfer_t* p_xfer)
+{
+    uint32_t crc32;
+    uint16_t crc16;
+
+    if ( spi_crc_mode == SPI_CRC_NONE )
+    {
+        return;
+    }
+    p_xfer->crc[0] = spi_xfer_seq++;
+
+    if ( spi_crc_mode == SPI_CRC_16 )
+    {
+        crc16 = crc16_compute(p_xfer->hdr, p_xfer->hdr_len, NULL);
+        crc16 = crc16_compute(p_xfer->p_tx, p_xfer->len, &crc16);
+        crc16 = crc16_compute(spi_pad_buf, p_xfer->pad, &crc16);
+        crc16 = crc16_compute(p_xfer->crc, 1, &crc16);
+        uint16_encode(crc16, p_xfer->crc + 1);
+        p_xfer->crc_len = 3;
+    }
+    else
+    {
+        crc32 = crc32_compute(p_xfer->hdr, p_xfer->hdr_len, NULL);
+        crc32 = crc32_compute(p_xfer->p_tx, p_xfer->len, &crc32);
+        crc32 = crc32_compute(spi_pad_buf, p_xfer->pad, &crc32);
+        crc32 = crc32_compute(p_xfer->crc, 1, &crc32);
+        uint32_encode(crc32, p_xfer->crc + 1);
+        p_xfer->crc_len = 5;
+    }
+}
+
+// bulk reads, the CRC covers the head and the message and follows the message
+static bool spi_crc_check(uint8_t const* p_head, uint32_t head_len, uint8_t const* p_data, uint32_t len)
+{
+    uint32_t crc32;
+    uint16_t crc16;
+
+    if ( spi_crc_mode == SPI_CRC_16 )
+    {
+        crc16 = crc16_compute(p_head, head_len, NULL);
+        return crc16_compute(p_data, len, &crc16) == uint16_decode(p_data + len);
+    }
+    else if ( spi_crc_mode == SPI_CRC_32 )
+    {
+        crc32 = crc32_compute(p_head, head_len, NULL);
+        return crc32_compute(p_data, len, &crc32) == uint32_decode(p_data + len);
+    }
+    return true;
+}
+
+static uint8_t spi_crc_len(void)
+{
+    return spi_crc_mode == SPI_CRC_16 ? 2 : (spi_crc_mode == SPI_CRC_32 ? 4 : 0);
+}
+
+// Error rate sampling, the new clock is picked up by the next transfer.
+static void spi_clk_account(bool error)
+{
+    spi_clk_window_frames++;
+    if ( error )
+    {
+        spi_clk_window_errors++;
+    }
+
+    if ( spi_clk_window_errors >= SPI_CLK_DOWN_ERRORS )
+    {
+        if ( spi_clk_level > 0 )
+        {
+            spi_clk_level--;
+            spi_link_stats.clock_downs++;
+        }
+        spi_clk_clean_windows = 0;
+    }
+    else if ( spi_clk_window_frames < SPI_CLK_WINDOW )
+    {
+        return;
+    }
+    else if ( spi_clk_window_errors == 0 && ++spi_clk_clean_windows >= SPI_CLK_UP_WINDOWS )
+    {
+        if ( spi_clk_level < ARRAY_SIZE(spi_clk_levels) - 1 )
+        {
+            spi_clk_level++;
+            spi_link_stats.clock_ups++;
+        }
+        spi_clk_clean_windows = 0;
+    }
+    spi_clk_window_frames = 0;
+    spi_clk_window_errors = 0;
+}
+
+static uint16_t spi_xfer_total(spi_xfer_t const* p_xfer)
+{
+    return p_xfer->hdr_len + p_xfer->len + p_xfer->pad + p_xfer->crc_len;
+}
+
+// Hand the next <= 255 byte segment of the current transfer to the SPIM,
+// in wire order: length header, payload, 0xFF padding, CRC trailer.
+static void spi_xfer_segment_start(void)
+{
+    nrfx_spim_xfer_desc_t desc = {0};
+    uint16_t pos = spi_xfer_offset;
+    uint16_t seg_len;
+
+    if ( pos < spi_xfer_cur.hdr_len )
+    {
+        seg_len = spi_xfer_cur.hdr_len - pos;
+        desc.p_tx_buffer = spi_xfer_cur.hdr + pos;
+        desc.tx_length = seg_len;
+    }
+    else if ( (pos -= spi_xfer_cur.hdr_len) < spi_xfer_cur.len )
+    {
+        seg_len = spi_xfer_cur.len - pos;
+        seg_len = seg_len > SPI_XFER_MAX_SEGMENT ? SPI_XFER_MAX_SEGMENT : seg_len;
+        if ( spi_xfer_cur.frame_len != 0 && seg_len > spi_xfer_cur.frame_len - pos % spi_xfer_cur.frame_len )
+        {
+            seg_len = spi_xfer_cur.frame_len - pos % spi_xfer_cur.frame_len;
+        }
+        if ( spi_xfer_cur.p_tx != NULL )
+        {
+            desc.p_tx_buffer = spi_xfer_cur.p_tx + pos;
+            desc.tx_length = seg_len;
+        }
+        else
+        {
+            desc.p_rx_buffer = spi_xfer_cur.p_rx + pos;
+            desc.rx_length = seg_len;
+        }
+    }
+    else if ( (pos -= spi_xfer_cur.len) < spi_xfer_cur.pad )
+    {
+        seg_len = spi_xfer_cur.pad - pos;
+        desc.p_tx_buffer = spi_pad_buf;
+        desc.tx_length = seg_len;
+    }
+    else
+    {
+        pos -= spi_xfer_cur.pad;
+        seg_len = spi_xfer_cur.crc_len - pos;
+        desc.p_tx_buffer = spi_xfer_cur.crc + pos;
+        desc.tx_length = seg_len;
+    }
+    spi_xfer_offset += seg_len;
+
+    APP_ERROR_CHECK(nrfx_spim_xfer(&m_spim_master, &desc, 0));
+}
+
+static void spi_clk_apply(void)
+{
+    if ( spi_clk_applied != spi_clk_level )
+    {
+        spi_clk_applied = spi_clk_level;
+        nrf_spim_frequency_set(m_spim_master.p_reg, (nrf_spim_frequency_t)spi_clk_levels[spi_clk_applied]);
+    }
+}
+
+// Start the next transfer if the bus is free, called with interrupts masked or from the SPIM IRQ.
+static void spi_xfer_kick(void)
+{
+    if ( spi_xfer_busy || spi_read_hw_disarm() )
+    {
+        return;
+    }
+
+    if ( spi_xfer_read_pending )
+    {
+        spi_xfer_cur = spi_xfer_read_slot;
+        spi_xfer_read_pending = false;
+    }
+    else if ( spi_xfer_read_session || nrf_queue_pop(&m_spi_xfer_queue, &spi_xfer_cur) != NRF_SUCCESS )
+    {
+        return;
+    }
+
+    spi_xfer_busy = true;
+    spi_xfer_offset = 0;
+    spi_clk_apply();
+    if ( spi_xfer_cur.p_tx != NULL )
+    {
+        // the STM32 answers a write with an edge on the ready line, gpiote skips it
+        spi_dir_out = true;
+    }
+    nrfx_gpiote_clr_task_trigger(STM32_SPI2_CSN_IO);
+    spi_xfer_segment_start();
+}
+
+// Completions are handled from the scheduler. With its queue full they stay in the done queue
+// and spi_xfer_process() posts them from the main loop instead.
+static void spi_xfer_done_post(void)
+{
+    if ( !spi_xfer_done_posted && app_sched_event_put(NULL, 0, spi_xfer_done_handler) == NRF_SUCCESS )
+    {
+        spi_xfer_done_posted = true;
+    }
+}
+
 void spi_event_handler(const nrfx_spim_evt_t* p_event, void* p_context)
 {
-    spi_xfer_done = true;
+    if ( spi_read_hw_armed )
+    {
+        // header read started by the ready line, the rest of the sequence follows from the scheduler
+        nrfx_ppi_channel_disable(spi_read_ppi_channel);
+        spi_read_hw_armed = false;
+        spi_read_hw_unclaimed = !spi_read_hw_claimed;
+        spi_xfer_read_session = true;
+    }
+
+    if ( spi_xfer_offset < spi_xfer_total(&spi_xfer_cur) )
+    {
+        if ( spi_xfer_cur.frame_len != 0 && spi_xfer_offset < spi_xfer_cur.len &&
+             spi_xfer_offset % spi_xfer_cur.frame_len == 0 )
+        {
+            // frame boundary, the STM32 sees every frame as its own CS assertion
+            nrfx_gpiote_set_task_trigger(STM32_SPI2_CSN_IO);
+            nrf_delay_us(SPI_FRAME_CS_GAP_US);
+            nrfx_gpiote_clr_task_trigger(STM32_SPI2_CSN_IO);
+        }
+        // chain the next segment straight from the END event
+        spi_xfer_segment_start();
+        return;
+    }
+
+    nrfx_gpiote_set_task_trigger(STM32_SPI2_CSN_IO);
+    if ( nrf_queue_push(&m_spi_done_queue, &spi_xfer_cur) != NRF_SUCCESS )
+    {
+        // the bus stays busy with this one until spi_xfer_done_handler has made room
+        spi_xfer_done_stalled = true;
+        spi_xfer_done_post();
+        return;
+    }
+    spi_xfer_done_post();
+
+    spi_xfer_busy = false;
+    spi_xfer_kick();
 }
 
 void usr_spim_init(void)
@@ -48,99 +432,152 @@ void usr_spim_init(void)
     err_code = nrfx_spim_init(&m_spim_master, &driver_spi_config, spi_event_handler, NULL);
     APP_ERROR_CHECK(err_code);
 
-    nrf_gpio_cfg_output(STM32_SPI2_CSN_IO);
-    nrf_gpio_pin_set(STM32_SPI2_CSN_IO);
-}
+    // CS is a GPIOTE task pin so PPI can drop it, gpiote must be initialized already
+    nrfx_gpiote_out_config_t cs_config = NRFX_GPIOTE_CONFIG_OUT_TASK_TOGGLE(true);
+    err_code = nrfx_gpiote_out_init(STM32_SPI2_CSN_IO, &cs_config);
+    APP_ERROR_CHECK(err_code);
+    nrfx_gpiote_out_task_enable(STM32_SPI2_CSN_IO);
 
-void usr_spi_write(uint8_t* p_buffer, uint32_t size)
-{
-    spi_dir_out = true;
+    err_code = nrfx_ppi_channel_alloc(&spi_read_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_assign(spi_read_ppi_channel, nrfx_gpiote_in_event_addr_get(SLAVE_SPI_RSP_IO),
+                                       nrfx_spim_start_task_get(&m_spim_master));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_fork_assign(spi_read_ppi_channel, nrfx_gpiote_clr_task_addr_get(STM32_SPI2_CSN_IO));
+    APP_ERROR_CHECK(err_code);
+    spi_read_hw_available = true;
 
-    uint8_t buffer[256] = {0};
+    err_code = nrf_balloc_init(&m_spi_pkt_pool);
+    APP_ERROR_CHECK(err_code);
+
+    spi_read_hw_arm();
+}
 
-    uint32_t padding_len = 0;
+static void spi_xfer_prepare(
+    spi_xfer_t* p_xfer, uint8_t* p_buffer, uint32_t size, spi_xfer_handler_t handler, void* p_context
+)
+{
+    // EasyDMA reads RAM only and the buffer is used after this returns
+    ASSERT(nrfx_is_in_ram(p_buffer));
 
-    if ( size % 16 != 0 )
+    memset(p_xfer, 0, sizeof(spi_xfer_t));
+    p_xfer->p_tx = p_buffer;
+    p_xfer->len = size;
+    if ( spi_frame_mode == SPI_FRAME_VARIABLE )
+    {
+        // explicit length, only real payload goes on the wire
+        uint16_big_encode(size, p_xfer->hdr);
+        p_xfer->hdr_len = 2;
+    }
+    else if ( size % 16 != 0 )
     {
-        padding_len = 16 - (size % 16);
-        size += padding_len;
+        p_xfer->pad = 16 - (size % 16);
     }
+    p_xfer->handler = handler;
+    p_xfer->p_context = p_context;
+    spi_crc_fill(p_xfer);
+}
+
+bool spi_xfer_write(uint8_t* p_buffer, uint32_t size, spi_xfer_handler_t handler, void* p_context)
+{
+    spi_xfer_t xfer;
+    bool queued;
 
-    nrf_gpio_pin_clear(STM32_SPI2_CSN_IO);
+    spi_xfer_prepare(&xfer, p_buffer, size, handler, p_context);
 
-    while ( size > 0 )
+    CRITICAL_REGION_ENTER();
+    queued = nrf_queue_push(&m_spi_xfer_queue, &xfer) == NRF_SUCCESS;
+    if ( queued )
     {
-        uint32_t send_len = size > 255 ? 255 : size;
-        memcpy(buffer, p_buffer, send_len);
+        spi_xfer_kick();
+    }
+    CRITICAL_REGION_EXIT();
 
-        if ( size == send_len )
-        {
-            memset(buffer + send_len, 0xFF, padding_len);
-        }
+    return queued;
+}
 
-        spi_xfer_done = false;
-
-        driver_spim_xfer.tx_length = send_len;
-        driver_spim_xfer.p_tx_buffer = buffer;
-        driver_spim_xfer.rx_length = 0;
-        driver_spim_xfer.p_rx_buffer = NULL;
-        ret_code_t err_code = nrfx_spim_xfer(&m_spim_master, &driver_spim_xfer, 0);
-        APP_ERROR_CHECK(err_code);
-        p_buffer += send_len;
-        size -= send_len;
-        while ( !spi_xfer_done )
-        {
-            nrf_delay_us(1);
-        }
+void usr_spi_write(uint8_t* p_buffer, uint32_t size)
+{
+    if ( !spi_xfer_write(p_buffer, size, NULL, NULL) )
+    {
+        NRF_LOG_WARNING("spi transfer queue full");
     }
-    nrf_gpio_pin_set(STM32_SPI2_CSN_IO);
-
-    // uint32_t timeout = 5000;
-    // while ( spi_dir_out )
-    // {
-    //     timeout--;
-    //     if ( timeout == 0 )
-    //     {
-    //         break;
-    //     }
-    //     nrf_delay_us(1);
-    // }
-    // spi_dir_out = false;
 }
 
-bool usr_spi_read(uint8_t* p_buffer, uint32_t size)
+// Reads belong to a reader session, queued writes wait until spi_xfer_read_end().
+static void spi_xfer_read(uint8_t* p_buffer, uint32_t size, spi_xfer_handler_t handler)
 {
+    CRITICAL_REGION_ENTER();
+    memset(&spi_xfer_read_slot, 0, sizeof(spi_xfer_read_slot));
+    spi_xfer_read_slot.p_rx = p_buffer;
+    spi_xfer_read_slot.len = size;
+    spi_xfer_read_slot.handler = handler;
+    spi_xfer_read_pending = true;
+    spi_xfer_read_session = true;
+    spi_xfer_kick();
+    CRITICAL_REGION_EXIT();
+}
 
-    nrf_gpio_pin_clear(STM32_SPI2_CSN_IO);
+// resend the write the STM32 NAKed, its handler runs once that copy is clocked out
+static void spi_xfer_retransmit(uint8_t seq)
+{
+    uint8_t i;
+    bool found;
+    bool queued = false;
 
-    while ( size > 0 )
+    CRITICAL_REGION_ENTER();
+    for ( i = 0; i < spi_xfer_retained_count; i++ )
     {
-        spi_xfer_done = false;
-        uint32_t read_len = size > 255 ? 255 : size;
-        driver_spim_xfer.tx_length = 0;
-        driver_spim_xfer.p_tx_buffer = NULL;
-        driver_spim_xfer.rx_length = read_len;
-        driver_spim_xfer.p_rx_buffer = p_buffer;
-        APP_ERROR_CHECK(nrfx_spim_xfer(&m_spim_master, &driver_spim_xfer, 0));
-        p_buffer += read_len;
-        size -= read_len;
-        while ( !spi_xfer_done )
+        if ( spi_xfer_retained[i].crc[0] == seq )
         {
-            nrf_delay_us(1);
+            break;
         }
     }
-    nrf_gpio_pin_set(STM32_SPI2_CSN_IO);
+    found = i < spi_xfer_retained_count;
+    if ( found && nrf_queue_push(&m_spi_xfer_queue, &spi_xfer_retained[i]) == NRF_SUCCESS )
+    {
+        spi_xfer_retained_remove(i);
+        spi_link_stats.retransmits++;
+        spi_xfer_kick();
+        queued = true;
+    }
+    CRITICAL_REGION_EXIT();
 
-    return true;
+    if ( !queued )
+    {
+        NRF_LOG_WARNING("spi nak for write %d not resent, %s", seq, found ? "queue full" : "not retained");
+    }
+}
+
+static void spi_xfer_read_end(void)
+{
+    CRITICAL_REGION_ENTER();
+    spi_xfer_read_session = false;
+    spi_xfer_kick();
+    CRITICAL_REGION_EXIT();
 }
 
 // Disable spi mode to enter low power mode
 void usr_spi_disable(void)
 {
+    CRITICAL_REGION_ENTER();
+    spi_read_hw_disarm();
+    spi_read_hw_available = false;
+    CRITICAL_REGION_EXIT();
     nrfx_spim_uninit(&m_spim_master);
 }
 
-uint8_t data_recived_buf[DATA_RECV_BUF_SIZE];
+// A message read from the STM32 stays in its buffer until BLE sent it, with a second one the next
+// message can be read while the first is still going out. data_recived_buf is the one reads go
+// into, NULL while BLE holds both. NUS may only hold SPI_RECV_NUS_MAX of them so a long NUS transfer
+// never keeps a FIDO reply waiting for a buffer.
+#define SPI_RECV_BUF_COUNT 2
+#define SPI_RECV_NUS_MAX   1
+
+static uint8_t spi_recv_bufs[SPI_RECV_BUF_COUNT][DATA_RECV_BUF_SIZE];
+static uint8_t spi_recv_bufs_used = 0; // bit per buffer handed to BLE
+static uint8_t spi_recv_bufs_nus = 0;  // the ones of those holding a NUS message
+static uint8_t* data_recived_buf = spi_recv_bufs[0];
 uint16_t data_recived_len = 0;
 uint16_t data_recived_offset = 0;
 uint8_t spi_data_type = 0;
@@ -150,154 +587,591 @@ uint8_t spi_data_type = 0;
 #define HEAD2_LENTH        1
 #define PACKAGE_DATA_LENTH 63
 
-static uint8_t read_state = READSTATE_IDLE;
+static volatile uint8_t read_state = READSTATE_IDLE;
 
-static bool spi_read_data(void)
+// step of the read sequence currently on the wire
+enum
 {
-    static uint32_t data_len = 0;
-    if ( read_state == READSTATE_IDLE )
+    READPHASE_NONE,
+    READPHASE_MAGIC,
+    READPHASE_INFO,
+    READPHASE_DATA_HEAD,
+    READPHASE_DATA_BODY,
+    READPHASE_FIDO_LEN,
+    READPHASE_FIDO_DATA,
+    READPHASE_BULK_HEAD,
+    READPHASE_BULK_DATA,
+    READPHASE_NAK_SEQ,
+    READPHASE_NUS_WAIT,
+};
+
+static volatile uint8_t read_phase = READPHASE_NONE;
+static uint8_t read_phase_resume = READPHASE_NONE; // phase to pick up again once NUS frees a buffer
+static uint32_t read_data_len = 0;
+static uint8_t read_header = 0;
+
+static void spi_read_next(void* p_context);
+
+static void spi_read_start(uint8_t phase, uint8_t* p_buffer, uint32_t size)
+{
+    read_phase = phase;
+    spi_xfer_read(p_buffer, size, spi_read_next);
+}
+
+// hand the buffer with the finished message to BLE, reads move on to the free one if there is one
+static uint8_t* spi_recv_buf_take(void)
+{
+    uint8_t* p_buf;
+    uint8_t i;
+
+    CRITICAL_REGION_ENTER();
+    p_buf = data_recived_buf;
+    i = (p_buf - spi_recv_bufs[0]) / DATA_RECV_BUF_SIZE;
+    spi_recv_bufs_used |= 1 << i;
+    if ( spi_data_type == DATA_TYPE_NUS )
+    {
+        spi_recv_bufs_nus |= 1 << i;
+    }
+    data_recived_buf = NULL;
+    for ( i = 0; i < SPI_RECV_BUF_COUNT; i++ )
+    {
+        if ( !(spi_recv_bufs_used & (1 << i)) )
+        {
+            data_recived_buf = spi_recv_bufs[i];
+            break;
+        }
+    }
+    CRITICAL_REGION_EXIT();
+    return p_buf;
+}
+
+static uint8_t spi_recv_nus_held(void)
+{
+    uint8_t i;
+    uint8_t count = 0;
+
+    for ( i = 0; i < SPI_RECV_BUF_COUNT; i++ )
     {
-        if ( !usr_spi_read(data_recived_buf, 3) )
+        if ( spi_recv_bufs_nus & (1 << i) )
         {
-            return false;
+            count++;
         }
+    }
+    return count;
+}
+
+// Another NUS message while NUS already holds its share: the ST is mid-message, so the read
+// session stays open (no writes can be clocked into it) until BLE sent the older one.
+static bool spi_read_nus_wait(uint8_t phase)
+{
+    bool wait;
+
+    CRITICAL_REGION_ENTER();
+    wait = spi_recv_nus_held() >= SPI_RECV_NUS_MAX;
+    if ( wait )
+    {
+        read_phase_resume = phase;
+        read_phase = READPHASE_NUS_WAIT;
+    }
+    CRITICAL_REGION_EXIT();
+    return wait;
+}
+
+// posted on release and polled from the main loop, whichever gets here first resumes
+static void spi_read_nus_resume_handler(void* data, uint16_t len)
+{
+    bool resume;
+
+    CRITICAL_REGION_ENTER();
+    resume = read_phase == READPHASE_NUS_WAIT && spi_recv_nus_held() < SPI_RECV_NUS_MAX;
+    if ( resume )
+    {
+        read_phase = read_phase_resume;
+    }
+    CRITICAL_REGION_EXIT();
+
+    if ( resume )
+    {
+        spi_read_next(NULL);
+    }
+}
+
+static void spi_read_hw_arm_handler(void* data, uint16_t len)
+{
+    spi_read_hw_arm();
+}
+
+// BLE is done with a buffer, anything that is not one of ours (keepalives) is ignored
+void spi_recv_buf_release(uint8_t* p_buf)
+{
+    uint8_t i;
+    bool rearm;
+    bool resume;
+
+    for ( i = 0; i < SPI_RECV_BUF_COUNT; i++ )
+    {
+        if ( p_buf == spi_recv_bufs[i] )
+        {
+            break;
+        }
+    }
+    if ( i == SPI_RECV_BUF_COUNT )
+    {
+        return;
+    }
+
+    CRITICAL_REGION_ENTER();
+    spi_recv_bufs_used &= ~(1 << i);
+    spi_recv_bufs_nus &= ~(1 << i);
+    rearm = data_recived_buf == NULL;
+    if ( rearm )
+    {
+        data_recived_buf = p_buf;
+    }
+    resume = read_phase == READPHASE_NUS_WAIT;
+    CRITICAL_REGION_EXIT();
+
+    if ( resume )
+    {
+        // a failed post is picked up by spi_xfer_process on the next main loop pass
+        UNUSED_RETURN_VALUE(app_sched_event_put(NULL, 0, spi_read_nus_resume_handler));
+    }
+    if ( rearm )
+    {
+        // arming was skipped while BLE held both buffers, a failed post leaves the next edge to the interrupt
+        UNUSED_RETURN_VALUE(app_sched_event_put(NULL, 0, spi_read_hw_arm_handler));
+    }
+}
+
+static void spi_read_finish(bool complete)
+{
+    read_phase = READPHASE_NONE;
+    spi_xfer_read_end();
+
+    if ( complete && (spi_data_type == DATA_TYPE_NUS || spi_data_type == DATA_TYPE_FIDO) )
+    {
+        uint8_t* p_buf = spi_recv_buf_take();
+
+        spi_xfer_retained_release_all();
+
+        if ( spi_data_type == DATA_TYPE_NUS )
+        {
+            ble_nus_send(p_buf, data_recived_len);
+        }
+        else
+        {
+            ble_fido_send(p_buf, data_recived_len);
+        }
+    }
+    spi_read_hw_arm();
+}
+
+// Scheduler continuation after each read, same framing as before:
+// "?##" + 61 bytes head, then '?' + 63 bytes per packet; or "fid" + len16 + data.
+// Bulk mode: "blk" + type + len16, then the whole message in one transfer.
+static void spi_read_next(void* p_context)
+{
+    switch ( read_phase )
+    {
+    case READPHASE_MAGIC:
         if ( data_recived_buf[0] == '?' && data_recived_buf[1] == '#' && data_recived_buf[2] == '#' )
         {
             spi_data_type = DATA_TYPE_NUS;
-            if ( !usr_spi_read(data_recived_buf + 3, PACKAGE_LENTH - 3) )
-            {
-                goto failed;
-            }
-            data_len = (data_recived_buf[5] << 24) + (data_recived_buf[6] << 16) + (data_recived_buf[7] << 8) +
-                       data_recived_buf[8];
-            if ( data_len <= (PACKAGE_LENTH - HEAD_LENTH) )
-            {
-                data_recived_len = data_len + HEAD_LENTH;
-                data_len = 0;
-                data_recived_offset = 0;
-                return true;
-            }
-            else
+            if ( spi_read_nus_wait(READPHASE_MAGIC) )
             {
-                if ( data_len > sizeof(data_recived_buf) - 3 )
-                {
-                    return false;
-                }
-                data_recived_len = PACKAGE_LENTH;
-                data_len -= (PACKAGE_LENTH - HEAD_LENTH);
-                read_state = READSTATE_READ_DATA;
-                return false;
+                return;
             }
+            spi_read_start(READPHASE_INFO, data_recived_buf + 3, PACKAGE_LENTH - 3);
+            return;
         }
         else if ( data_recived_buf[0] == 'f' && data_recived_buf[1] == 'i' && data_recived_buf[2] == 'd' )
         {
             spi_data_type = DATA_TYPE_FIDO;
+            spi_read_start(READPHASE_FIDO_LEN, data_recived_buf, 2);
+            return;
+        }
+        else if ( data_recived_buf[0] == 'b' && data_recived_buf[1] == 'l' && data_recived_buf[2] == 'k' )
+        {
+            spi_read_start(READPHASE_BULK_HEAD, read_bulk_head, spi_crc_mode != SPI_CRC_NONE ? 4 : 3);
+            return;
+        }
+        else if ( data_recived_buf[0] == 'n' && data_recived_buf[1] == 'a' && data_recived_buf[2] == 'k' )
+        {
+            spi_read_start(READPHASE_NAK_SEQ, &read_nak_seq, 1);
+            return;
+        }
+        break;
 
-            // read len
-            if ( !usr_spi_read(data_recived_buf, 2) )
-            {
-                return false;
-            }
-            data_len = (data_recived_buf[0] << 8) + data_recived_buf[1];
-            if ( data_len > sizeof(data_recived_buf) )
-            {
-                return false;
-            }
-            if ( data_len > 0 )
-            {
-                if ( !usr_spi_read(data_recived_buf, data_len) )
-                {
-                    return false;
-                }
-            }
-            data_recived_len = data_len;
-            return true;
+    case READPHASE_NAK_SEQ:
+        spi_link_stats.naks_received++;
+        spi_clk_account(true);
+        spi_xfer_retransmit(read_nak_seq);
+        break;
+
+    case READPHASE_BULK_HEAD:
+        spi_data_type = read_bulk_head[0];
+        read_data_len = (read_bulk_head[1] << 8) + read_bulk_head[2];
+        if ( (spi_data_type != DATA_TYPE_NUS && spi_data_type != DATA_TYPE_FIDO) || read_data_len == 0 ||
+             read_data_len > DATA_RECV_BUF_SIZE - spi_crc_len() )
+        {
+            break;
         }
-        else
+        if ( spi_data_type == DATA_TYPE_NUS && spi_read_nus_wait(READPHASE_BULK_HEAD) )
         {
-            return false;
+            return;
         }
-    }
-    else if ( read_state == READSTATE_READ_DATA )
-    {
-        uint8_t header = 0;
-        if ( data_len > PACKAGE_DATA_LENTH )
+        spi_read_start(READPHASE_BULK_DATA, data_recived_buf, read_data_len + spi_crc_len());
+        return;
+
+    case READPHASE_BULK_DATA:
+        if ( spi_crc_mode != SPI_CRC_NONE )
         {
-            if ( !usr_spi_read(&header, 1) )
-            {
-                goto failed;
-            }
-            if ( header != '?' )
+            bool crc_ok = spi_crc_check(read_bulk_head, sizeof(read_bulk_head), data_recived_buf, read_data_len);
+            spi_clk_account(!crc_ok);
+            if ( !crc_ok )
             {
-                goto failed;
-            }
-            if ( !usr_spi_read(data_recived_buf + data_recived_len, PACKAGE_DATA_LENTH) )
-            {
-                goto failed;
+                spi_link_stats.crc_errors++;
+                spi_link_stats.naks_sent++;
+                spi_nak_frame[3] = spi_data_type;
+                spi_nak_frame[4] = read_bulk_head[3];
+                usr_spi_write(spi_nak_frame, sizeof(spi_nak_frame));
+                break;
             }
+            spi_link_stats.frames_rx++;
+        }
+        data_recived_len = read_data_len;
+        read_data_len = 0;
+        spi_read_finish(true);
+        return;
+
+    case READPHASE_INFO:
+        read_data_len = (data_recived_buf[5] << 24) + (data_recived_buf[6] << 16) + (data_recived_buf[7] << 8) +
+                        data_recived_buf[8];
+        if ( read_data_len <= (PACKAGE_LENTH - HEAD_LENTH) )
+        {
+            data_recived_len = read_data_len + HEAD_LENTH;
+            read_data_len = 0;
+            data_recived_offset = 0;
+            spi_read_finish(true);
+            return;
+        }
+        if ( read_data_len <= DATA_RECV_BUF_SIZE - 3 )
+        {
+            // the rest comes one packet per ready edge
+            data_recived_len = PACKAGE_LENTH;
+            read_data_len -= (PACKAGE_LENTH - HEAD_LENTH);
+            read_state = READSTATE_READ_DATA;
+        }
+        break;
+
+    case READPHASE_DATA_HEAD:
+        if ( read_header == '?' )
+        {
+            spi_read_start(READPHASE_DATA_BODY, data_recived_buf + data_recived_len, PACKAGE_DATA_LENTH);
+            return;
+        }
+        read_state = READSTATE_IDLE;
+        break;
+
+    case READPHASE_DATA_BODY:
+        if ( read_data_len > PACKAGE_DATA_LENTH )
+        {
             data_recived_len += PACKAGE_DATA_LENTH;
-            data_len -= PACKAGE_DATA_LENTH;
-            return false;
+            read_data_len -= PACKAGE_DATA_LENTH;
+            break;
         }
-        else
+        data_recived_len += read_data_len;
+        read_data_len = 0;
+        read_state = READSTATE_IDLE;
+        spi_read_finish(true);
+        return;
+
+    case READPHASE_FIDO_LEN:
+        read_data_len = (data_recived_buf[0] << 8) + data_recived_buf[1];
+        if ( read_data_len > DATA_RECV_BUF_SIZE )
         {
-            if ( !usr_spi_read(&header, 1) )
-            {
-                goto failed;
-            }
-            if ( header != '?' )
-            {
-                goto failed;
-            }
-            if ( !usr_spi_read(data_recived_buf + data_recived_len, PACKAGE_DATA_LENTH) )
-            {
-                goto failed;
-            }
-            data_recived_len += data_len;
-            data_len = 0;
-            read_state = READSTATE_IDLE;
-            return true;
+            break;
         }
+        if ( read_data_len > 0 )
+        {
+            spi_read_start(READPHASE_FIDO_DATA, data_recived_buf, read_data_len);
+            return;
+        }
+        data_recived_len = 0;
+        spi_read_finish(true);
+        return;
+
+    case READPHASE_FIDO_DATA:
+        data_recived_len = read_data_len;
+        spi_read_finish(true);
+        return;
+
+    default:
+        break;
     }
-failed:
-    read_state = READSTATE_IDLE;
+    spi_read_finish(false);
+}
+
+spi_pkt_t* spi_pkt_alloc(void)
+{
+    spi_pkt_t* p_pkt = nrf_balloc_alloc(&m_spi_pkt_pool);
+    if ( p_pkt == NULL )
+    {
+        spi_pkt_dropped++;
+        NRF_LOG_WARNING("spi packet pool empty, dropped %d", spi_pkt_dropped);
+    }
+    return p_pkt;
+}
+
+void spi_pkt_free(spi_pkt_t* p_pkt)
+{
+    nrf_balloc_free(&m_spi_pkt_pool, p_pkt);
+}
+
+static void spi_pkt_release(void* p_context)
+{
+    spi_pkt_free((spi_pkt_t*)p_context);
+    fido_stream_pkt_freed();
+}
+
+// The packet is clocked out of the pool by DMA and released from the completion callback.
+// Without CRC and variable framing the STM32 runs the legacy protocol and gets every 64 byte
+// frame in its own CS assertion, the whole packet goes in one only once it switched either on.
+bool spi_pkt_submit(spi_pkt_t* p_pkt)
+{
+    spi_xfer_t xfer;
+    uint16_t frames_len = p_pkt->len;
+    bool queued;
+
+    if ( spi_frame_mode == SPI_FRAME_PADDED )
+    {
+        // the STM32 always clocks whole frames, zero the tail of the last one in place
+        frames_len = (p_pkt->len + SPI_FRAME_SIZE - 1) / SPI_FRAME_SIZE * SPI_FRAME_SIZE;
+        memset(p_pkt->data + p_pkt->len, 0x00, frames_len - p_pkt->len);
+    }
+    spi_xfer_prepare(&xfer, p_pkt->data, frames_len, spi_pkt_release, p_pkt);
+    if ( spi_frame_mode == SPI_FRAME_PADDED && xfer.crc_len == 0 )
+    {
+        xfer.frame_len = SPI_FRAME_SIZE;
+    }
+
+    CRITICAL_REGION_ENTER();
+    queued = nrf_queue_push(&m_spi_xfer_queue, &xfer) == NRF_SUCCESS;
+    if ( queued )
+    {
+        spi_xfer_kick();
+    }
+    CRITICAL_REGION_EXIT();
+
+    if ( !queued )
+    {
+        spi_pkt_dropped++;
+        spi_pkt_free(p_pkt);
+        return false;
+    }
+    return true;
+}
+
+void spi_read_st_data(void* data, uint16_t len)
+{
+    bool deferred = false;
+    bool hw_started;
+
+    CRITICAL_REGION_ENTER();
+    hw_started = spi_read_hw_disarm();
+    CRITICAL_REGION_EXIT();
+    if ( hw_started || read_phase != READPHASE_NONE )
+    {
+        // a read sequence is already running
+        return;
+    }
+
+    // BLE is still sending from both receive buffers, leave the STM32 waiting
+    // with its ready line asserted until a TX complete event frees one
+    CRITICAL_REGION_ENTER();
+    if ( read_state == READSTATE_IDLE && data_recived_buf == NULL )
+    {
+        spi_read_deferred = true;
+        deferred = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    if ( deferred )
+    {
+        ble_tx_stats_spi_deferred();
+        return;
+    }
+
+    if ( read_state == READSTATE_IDLE )
+    {
+        spi_read_start(READPHASE_MAGIC, data_recived_buf, 3);
+    }
+    else if ( read_state == READSTATE_READ_DATA )
+    {
+        spi_read_start(READPHASE_DATA_HEAD, &read_header, 1);
+    }
+    else
+    {
+        // previous message timed out half way
+        read_state = READSTATE_IDLE;
+    }
+}
+
+// Prepare the header read and let the next ready line edge start it without the CPU.
+// Only armed when the next edge can only mean a new message. The CPU may be asleep when PPI starts
+// it (anomaly 109), so the driver holds a zero length transfer and its STARTED interrupt starts the
+// real one, see NRFX_SPIM_NRF52_ANOMALY_109_WORKAROUND_ENABLED.
+void spi_read_hw_arm(void)
+{
+    nrfx_spim_xfer_desc_t desc;
+
+    CRITICAL_REGION_ENTER();
+    if ( spi_read_hw_available && !spi_read_hw_armed && !spi_xfer_busy && !spi_xfer_read_pending &&
+         !spi_xfer_read_session && nrf_queue_is_empty(&m_spi_xfer_queue) && read_state == READSTATE_IDLE &&
+         read_phase == READPHASE_NONE && !spi_dir_out && !spi_read_deferred && data_recived_buf != NULL )
+    {
+        desc = (nrfx_spim_xfer_desc_t)NRFX_SPIM_XFER_RX(data_recived_buf, 3);
+        memset(&spi_xfer_cur, 0, sizeof(spi_xfer_cur));
+        spi_xfer_cur.p_rx = data_recived_buf;
+        spi_xfer_cur.len = 3;
+        spi_xfer_cur.handler = spi_read_next;
+        spi_xfer_offset = spi_xfer_cur.len;
+        read_phase = READPHASE_MAGIC;
+        spi_clk_apply();
+
+        // not marked in progress in the driver, dropping it again needs no STOP on the idle peripheral;
+        // the END interrupt still hands a started read to spi_event_handler
+        nrf_spim_event_clear(m_spim_master.p_reg, NRF_SPIM_EVENT_STARTED);
+        APP_ERROR_CHECK(nrfx_spim_xfer(
+            &m_spim_master, &desc, NRFX_SPIM_FLAG_HOLD_XFER | NRFX_SPIM_FLAG_NO_XFER_EVT_HANDLER
+        ));
+        nrf_spim_int_enable(m_spim_master.p_reg, NRF_SPIM_INT_END_MASK);
+        spi_read_hw_claimed = false;
+        spi_read_hw_unclaimed = false;
+        spi_read_hw_armed = true;
+        APP_ERROR_CHECK(nrfx_ppi_channel_enable(spi_read_ppi_channel));
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+// Take the bus back from PPI, called with interrupts masked.
+// Returns true when the edge already started the read, which then completes normally.
+static bool spi_read_hw_disarm(void)
+{
+    if ( !spi_read_hw_armed )
+    {
+        return false;
+    }
+
+    nrfx_ppi_channel_disable(spi_read_ppi_channel);
+    spi_read_hw_armed = false;
+    // STARTED still pending means the zero length transfer ran and the driver starts the real one
+    // once interrupts are back, a length already set means it did so
+    if ( nrf_spim_event_check(m_spim_master.p_reg, NRF_SPIM_EVENT_STARTED) || m_spim_master.p_reg->RXD.MAXCNT != 0 )
+    {
+        spi_read_hw_unclaimed = !spi_read_hw_claimed;
+        spi_xfer_busy = true;
+        spi_xfer_read_session = true;
+        return true;
+    }
+
+    // never started, the next transfer simply reprograms the buffers; the STARTED interrupt goes
+    // so that transfer is not taken for the zero length one
+    nrf_spim_int_disable(m_spim_master.p_reg, NRF_SPIM_INT_STARTED_MASK | NRF_SPIM_INT_END_MASK);
+    nrf_spim_event_clear(m_spim_master.p_reg, NRF_SPIM_EVENT_STARTED);
+    nrf_spim_event_clear(m_spim_master.p_reg, NRF_SPIM_EVENT_END);
+    read_phase = READPHASE_NONE;
     return false;
 }
 
-void spi_write_st_data(void* data, uint16_t len)
+// Called from the ready line interrupt, true when PPI already started the read for this edge.
+bool spi_read_hw_edge_taken(void)
+{
+    bool taken;
+
+    CRITICAL_REGION_ENTER();
+    taken = spi_read_hw_armed || spi_read_hw_unclaimed;
+    spi_read_hw_claimed = spi_read_hw_armed;
+    spi_read_hw_unclaimed = false;
+    CRITICAL_REGION_EXIT();
+
+    return taken;
+}
+
+uint8_t spi_link_caps_get(void)
 {
-    uint16_t send_spi_offset = 0;
+    return SPI_CAP_BULK_READ | SPI_CAP_CRC16 | SPI_CAP_CRC32 | SPI_CAP_VAR_FRAME | SPI_CAP_FIDO_STREAM |
+           SPI_CAP_FIDO_KEEPALIVE;
+}
 
-    while ( len > 0 )
+// applies to writes queued from now on, queued ones keep the framing they were built with
+bool spi_link_frame_set(uint8_t mode)
+{
+    if ( mode > SPI_FRAME_VARIABLE )
     {
-        uint32_t send_len = len > 64 ? 64 : len;
-        if ( send_len < 64 )
-        {
-            usr_spi_write((uint8_t*)(data + send_spi_offset), 64);
-        }
-        else
-        {
-            usr_spi_write((uint8_t*)(data + send_spi_offset), send_len);
-        }
-        send_spi_offset += send_len;
-        len -= send_len;
+        return false;
     }
+    spi_frame_mode = mode;
+    return true;
 }
 
-extern void ble_fido_send(uint8_t* data, uint16_t data_len);
+bool spi_link_crc_set(uint8_t mode)
+{
+    if ( mode > SPI_CRC_32 )
+    {
+        return false;
+    }
 
-void spi_read_st_data(void* data, uint16_t len)
+    CRITICAL_REGION_ENTER();
+    spi_crc_mode = mode;
+    if ( mode == SPI_CRC_NONE )
+    {
+        // nothing to detect errors with, go back to the known good clock
+        spi_clk_level = SPI_CLK_LEVEL_BASE;
+    }
+    spi_clk_window_frames = 0;
+    spi_clk_window_errors = 0;
+    spi_clk_clean_windows = 0;
+    CRITICAL_REGION_EXIT();
+
+    if ( mode == SPI_CRC_NONE )
+    {
+        spi_xfer_retained_release_all();
+    }
+    return true;
+}
+
+void spi_link_stats_get(spi_link_stats_t* p_stats)
+{
+    *p_stats = spi_link_stats;
+    p_stats->frequency = spi_clk_levels[spi_clk_level];
+    p_stats->crc_mode = spi_crc_mode;
+    p_stats->frame_mode = spi_frame_mode;
+}
+
+// main loop pass: completions whose post failed, NUS reads waiting for a buffer
+void spi_xfer_process(void)
 {
-    if ( spi_read_data() )
+    CRITICAL_REGION_ENTER();
+    if ( !nrf_queue_is_empty(&m_spi_done_queue) )
     {
-        if ( spi_data_type == DATA_TYPE_NUS )
-        {
-            ble_nus_send(data_recived_buf, data_recived_len);
-        }
-        else if ( spi_data_type == DATA_TYPE_FIDO )
-        {
-            ble_fido_send(data_recived_buf, data_recived_len);
-        }
+        spi_xfer_done_post();
+    }
+    CRITICAL_REGION_EXIT();
+
+    if ( read_phase == READPHASE_NUS_WAIT )
+    {
+        spi_read_nus_resume_handler(NULL, 0);
+    }
+}
+
+// called from SoftDevice event context once the BLE side went idle
+void spi_read_resume(void)
+{
+    if ( spi_read_deferred )
+    {
+        spi_read_deferred = false;
+        app_sched_event_put(NULL, 0, spi_read_st_data);
     }
 }
 
@@ -308,6 +1182,10 @@ void spi_state_reset(void)
 
 void spi_state_update(void)
 {
+    if ( read_phase != READPHASE_NONE )
+    {
+        return;
+    }
     if (read_state == READSTATE_READ_DATA)
     {
         read_state = READSTATE_READ_DATA_WAIT;
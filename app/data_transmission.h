@@ -28,9 +28,35 @@ void usr_spim_init(void);
 
 void spi_cs_set(bool pinState);
 
-void usr_spi_write(uint8_t* p_buffer, uint32_t size);
+// Async SPIM engine. Each transfer is one CS assertion (one per frame_len bytes if set), split into
+// <= 255 byte DMA segments that are chained from the SPIM END event. Buffers must stay valid
+// until the handler runs, which happens from the scheduler after CS is released.
+#define SPI_XFER_MAX_SEGMENT  255
+#define SPI_XFER_QUEUE_SIZE   (SPI_PKT_POOL_SIZE + 4) // every packet plus replies and FIDO writes
+#define SPI_FRAME_CS_GAP_US   2                       // CS high between the frames of a padded write
+#define SPI_XFER_RETAIN_COUNT 4                       // CRC writes kept for a NAK until the STM32 sends a message
+
+typedef void (*spi_xfer_handler_t)(void* p_context);
+
+typedef struct
+{
+    uint8_t const* p_tx; // write transfer, or NULL
+    uint8_t* p_rx;       // read transfer, or NULL
+    uint8_t hdr_len;     // length header clocked before a write
+    uint8_t hdr[2];
+    uint16_t len;
+    uint8_t frame_len; // payload bytes per CS assertion, 0 for one assertion
+    uint16_t pad;      // 0xFF bytes clocked after a write
+    uint8_t crc_len;   // trailer clocked after the padding
+    uint8_t crc[5];    // sequence byte, then the CRC
+    spi_xfer_handler_t handler;
+    void* p_context;
+} spi_xfer_t;
 
-bool usr_spi_read(uint8_t* p_buffer, uint32_t size);
+bool spi_xfer_write(uint8_t* p_buffer, uint32_t size, spi_xfer_handler_t handler, void* p_context);
+
+void usr_spi_write(uint8_t* p_buffer, uint32_t size);
+void spi_xfer_process(void);
 
 void usr_spi_enable(void);
 
@@ -38,9 +64,112 @@ void usr_spi_disable(void);
 
 #define DATA_RECV_BUF_SIZE (3 * 1024)
 
+// link features the STM32 may use, reported through ST_CMD_BLE_INFO
+#define SPI_CAP_BULK_READ      0x01 // "blk" + type + len16 + message, read in one transfer
+#define SPI_CAP_CRC16          0x02
+#define SPI_CAP_CRC32          0x04
+#define SPI_CAP_VAR_FRAME      0x08
+#define SPI_CAP_FIDO_STREAM    0x10 // FIDO fragments forwarded as they arrive, see fido.h
+#define SPI_CAP_FIDO_KEEPALIVE 0x20 // FIDO keepalives generated here while a request is pending
+
+// write framing
+#define SPI_FRAME_PADDED   0 // legacy, 64 byte frames for NUS packets, 16 byte alignment for the rest
+#define SPI_FRAME_VARIABLE 1 // big endian len16 header + payload, no padding
+
+// optional integrity trailer, little endian, after every write and every bulk read.
+// Writes end in a sequence byte and the CRC over the whole write, length header included.
+// Bulk reads carry the sequence byte after len16, the CRC after the message covers type, len16,
+// sequence and message. A NAK is "nak" + sequence from the STM32, "nak" + type + sequence from here.
+#define SPI_CRC_NONE       0
+#define SPI_CRC_16         1 // CRC-16/CCITT, crc16_compute()
+#define SPI_CRC_32         2 // CRC-32, crc32_compute()
+
+// BLE -> STM32 packets, written once by the BLE handler and released after the SPI write
+#define SPI_FRAME_SIZE     64
+#define SPI_PKT_DATA_SIZE  256 // largest NUS write (244) rounded up to whole SPI frames
+// Worst case is a whole connection event of 244 byte writes while the link is resending: the
+// packets of the event, the retained window and the one on the wire.
+#define SPI_PKT_AIR_US     1400 // 251 byte packet, empty ack and both inter frame spaces at 2M PHY
+#define SPI_PKT_PER_EVENT  ((NRF_SDH_BLE_GAP_EVENT_LENGTH * 1250 + SPI_PKT_AIR_US - 1) / SPI_PKT_AIR_US)
+#define SPI_PKT_POOL_SIZE  (SPI_PKT_PER_EVENT + SPI_XFER_RETAIN_COUNT + 1)
+
+typedef struct
+{
+    uint16_t len;
+    uint8_t data[SPI_PKT_DATA_SIZE];
+} spi_pkt_t;
+
 int twi_master_init(void);
-void spi_write_st_data(void* data, uint16_t len);
+spi_pkt_t* spi_pkt_alloc(void);
+void spi_pkt_free(spi_pkt_t* p_pkt);
+bool spi_pkt_submit(spi_pkt_t* p_pkt);
 void spi_read_st_data(void* data, uint16_t len);
 void spi_state_reset(void);
 void spi_state_update(void);
+void spi_read_resume(void);
+void spi_read_hw_arm(void);
+void spi_recv_buf_release(uint8_t* p_buf);
+bool spi_read_hw_edge_taken(void);
+uint8_t spi_link_caps_get(void);
+
+typedef struct
+{
+    uint32_t frames_tx;     // writes completed
+    uint32_t frames_rx;     // bulk reads that passed the CRC
+    uint32_t crc_errors;    // bulk reads that failed the CRC
+    uint32_t naks_sent;     // retransmissions asked from the STM32
+    uint32_t naks_received; // writes the STM32 rejected
+    uint32_t retransmits;   // writes sent again after a NAK
+    uint32_t clock_ups;
+    uint32_t clock_downs;
+    uint32_t frequency; // NRF_SPIM_FREQ_* in use
+    uint8_t crc_mode;
+    uint8_t frame_mode;
+} spi_link_stats_t;
+
+bool spi_link_crc_set(uint8_t mode);
+bool spi_link_frame_set(uint8_t mode);
+void spi_link_stats_get(spi_link_stats_t* p_stats);
+
+// BLE TX side, implemented in main.c
+typedef struct
+{
+    uint8_t hvn_pending;         // notifications queued in SoftDevice now
+    uint8_t hvn_pending_max;     // queue depth high watermark
+    uint32_t resources_hits;     // sends that hit NRF_ERROR_RESOURCES and resumed later
+    uint32_t spi_reads_deferred; // STM32 reads held back while BLE was busy
+} ble_tx_stats_t;
+
+typedef struct
+{
+    uint32_t messages;     // responses whose last fragment left the SoftDevice
+    uint32_t fragments;
+    uint32_t aborted;      // link or notifications gone mid message
+    uint16_t fragment_len; // in use for the last message
+    uint16_t last_ms;      // first fragment queued to last fragment sent
+    uint16_t max_ms;
+    uint8_t burst_max;     // fragments queued in one go
+} ble_fido_tx_stats_t;
+
+// BLE TX channels, FIDO fragments go first and interleave with NUS by weight
+#define BLE_TX_CH_NUS       0
+#define BLE_TX_CH_FIDO      1
+#define BLE_TX_CH_COUNT     2
+#define BLE_TX_HIST_BUCKETS 8 // <10, <20, <50, <100, <200, <500, <1000, more ms
+
+typedef struct
+{
+    uint32_t messages;                  // messages whose last fragment left the SoftDevice
+    uint16_t hist[BLE_TX_HIST_BUCKETS]; // handed to BLE until sent, queueing included
+    uint16_t max_ms;
+    uint8_t queued_max; // messages held by the channel at once
+} ble_tx_chan_stats_t;
+
+void ble_nus_send(uint8_t* data, uint16_t len);
+void ble_fido_send(uint8_t* data, uint16_t data_len);
+void fido_stream_pkt_freed(void);
+void ble_tx_stats_spi_deferred(void);
+void ble_tx_stats_get(ble_tx_stats_t* p_stats);
+void ble_fido_tx_stats_get(ble_fido_tx_stats_t* p_stats);
+void ble_tx_chan_stats_get(uint8_t ch, ble_tx_chan_stats_t* p_stats);
 #endif
@@ -244,6 +244,22 @@ void deviceCfg_settings_setup(deviceCfg_settings_t* settings)
     }
 }
 
+// *** pmu ***
+
+bool deviceCfg_pmu_brom_verified(deviceCfg_pmu_t* pmu, uint32_t* brom_hash)
+{
+    EC_E_BOOL_R_BOOL(pmu->flag_brom_verified == DEVICE_CONFIG_FLAG_MAGIC);
+
+    *brom_hash = pmu->brom_hash;
+    return true;
+}
+
+void deviceCfg_pmu_brom_mark(deviceCfg_pmu_t* pmu, uint32_t brom_hash)
+{
+    pmu->flag_brom_verified = DEVICE_CONFIG_FLAG_MAGIC;
+    pmu->brom_hash = brom_hash;
+}
+
 // ======================
 // Device Configs
 
@@ -37,6 +37,15 @@ typedef struct
 bool deviceCfg_settings_validate(deviceCfg_settings_t* settings);
 void deviceCfg_settings_setup(deviceCfg_settings_t* settings);
 
+// *** pmu ***
+typedef struct
+{
+    uint32_t flag_brom_verified; // DEVICE_CONFIG_FLAG_MAGIC once brom_hash is valid
+    uint32_t brom_hash;          // battery table the fuel gauge BROM last passed verification with
+} deviceCfg_pmu_t;
+bool deviceCfg_pmu_brom_verified(deviceCfg_pmu_t* pmu, uint32_t* brom_hash);
+void deviceCfg_pmu_brom_mark(deviceCfg_pmu_t* pmu, uint32_t brom_hash);
+
 // ======================
 // Device Configs
 #define DEVICE_CONFIG_HANDLE_LEGACY 1
@@ -54,6 +63,7 @@ typedef struct
 
     deviceCfg_keystore_t keystore;
     deviceCfg_settings_t settings;
+    deviceCfg_pmu_t pmu; // appended, configs written before it read back as erased flash
 
 } deviceCfg_t; // version 1 layout
 
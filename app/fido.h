@@ -1,36 +1,361 @@
-#define FIDO_DATA_STATE_IDLE 0
-#define FIDO_DATA_STATE_RECV 1
+#define FIDO_DATA_STATE_IDLE   0
+#define FIDO_DATA_STATE_RECV   1
+#define FIDO_DATA_STATE_STREAM 2
+
+// streaming, every BLE fragment goes to the ST as it arrives:
+// "fid" + len16 of the whole message + first fragment, then "fic" + len16 + continuation fragment,
+// "fia" + 0x0000 tells the ST to drop what it has of the message
+#define FIDO_STREAM_OFF      0 // whole message collected here first, 1024 bytes at most
+#define FIDO_STREAM_ON       1
+#define FIDO_STREAM_HEAD_LEN 5
+#define FIDO_SEQ_MASK        0x7F // continuation sequence wraps after 0x7F
+
+// keepalives go out from here while the ST works on a request, the first frame the ST
+// sends back ends them, a keepalive from the ST only updates the status we repeat
+#define FIDO_CMD_KEEPALIVE        0x82
+#define FIDO_STATUS_PROCESSING    0x01
+#define FIDO_STATUS_UPNEEDED      0x02
+#define FIDO_KEEPALIVE_INTERVAL   APP_TIMER_TICKS(500)
+#define FIDO_KEEPALIVE_MAX        120 // one minute, the ST answers with an error long before
 
 static uint8_t* ble_fido_send_buf;
-static uint16_t ble_fido_send_len, ble_fido_send_offset;
+static volatile uint16_t ble_fido_send_len, ble_fido_send_offset;
 static uint8_t fido_sequence_number;
+static ble_fido_tx_stats_t fido_tx_stats = {0};
 
 static uint8_t fido_recv_buf[1024 + 5];
+static volatile bool fido_recv_buf_busy = false; // complete message waiting for or on the SPI, DMA reads it in place
 static uint8_t fido_data_state = FIDO_DATA_STATE_IDLE;
 static uint16_t fido_recv_len, fido_recv_offset;
 
+static uint8_t fido_stream_mode = FIDO_STREAM_OFF;
+static uint8_t fido_stream_seq;
+static uint32_t fido_stream_left; // message bytes still to come
+static volatile bool fido_stream_abort_pending = false; // "fia" found the packet pool empty
+
+APP_TIMER_DEF(m_fido_keepalive_timer);
+static uint8_t fido_keepalive_frame[4] = {FIDO_CMD_KEEPALIVE, 0x00, 0x01, FIDO_STATUS_PROCESSING};
+static volatile bool fido_keepalive_active = false;
+static uint8_t fido_keepalive_count;
+
+static void fido_keepalive_start(void)
+{
+    ret_code_t err_code;
+
+    fido_keepalive_frame[3] = FIDO_STATUS_PROCESSING;
+    fido_keepalive_count = 0;
+    fido_keepalive_active = true;
+    err_code = app_timer_start(m_fido_keepalive_timer, FIDO_KEEPALIVE_INTERVAL, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void fido_keepalive_stop(void)
+{
+    if ( fido_keepalive_active )
+    {
+        fido_keepalive_active = false;
+        UNUSED_RETURN_VALUE(app_timer_stop(m_fido_keepalive_timer));
+    }
+}
+
+static void fido_keepalive_timeout_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    if ( !fido_keepalive_active )
+    {
+        return;
+    }
+    if ( ++fido_keepalive_count > FIDO_KEEPALIVE_MAX )
+    {
+        fido_keepalive_stop();
+        return;
+    }
+    // a response already on its way needs no keepalive in front of it
+    if ( ble_fido_send_len == 0 )
+    {
+        ble_fido_send(fido_keepalive_frame, sizeof(fido_keepalive_frame));
+    }
+}
+
+static void fido_keepalive_init(void)
+{
+    ret_code_t err_code;
+
+    err_code = app_timer_create(&m_fido_keepalive_timer, APP_TIMER_MODE_REPEATED, fido_keepalive_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void fido_write_data_done(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    fido_recv_buf_busy = false;
+}
+
 void fido_write_data_to_st(void* data, uint16_t len)
 {
-    // usr_spi_write(data, len);
-    usr_spi_write(fido_recv_buf, fido_recv_len);
+    if ( !spi_xfer_write(fido_recv_buf, fido_recv_len, fido_write_data_done, NULL) )
+    {
+        NRF_LOG_WARNING("fido message dropped, spi transfer queue full");
+        fido_recv_buf_busy = false;
+        return;
+    }
+    fido_keepalive_start();
+}
+
+// message complete in fido_recv_buf, it stays there until the SPI write finished
+static void fido_write_data_post(void)
+{
+    fido_recv_buf_busy = true;
+    if ( app_sched_event_put(NULL, 0, fido_write_data_to_st) != NRF_SUCCESS )
+    {
+        NRF_LOG_WARNING("fido message dropped, scheduler queue full");
+        fido_recv_buf_busy = false;
+    }
 }
 
-static void ble_fido_send_packet(uint8_t* data, uint16_t data_len)
+static ret_code_t ble_fido_send_packet(uint8_t* data, uint16_t data_len)
 {
     ret_code_t err_code;
-    uint16_t length = 0;
+    uint16_t length = data_len;
 
-    do
+    err_code = ble_fido_data_send(&m_fido, data, &length, m_conn_handle);
+    if ( err_code == NRF_SUCCESS )
+    {
+        ble_hvn_tx_queued(BLE_TX_CH_FIDO);
+        ble_link_traffic_add(length);
+    }
+    else if ( err_code == NRF_ERROR_RESOURCES )
+    {
+        // retried from the TX ready event
+        ble_tx_stats.resources_hits++;
+    }
+    else if ( (err_code != NRF_ERROR_INVALID_STATE) && (err_code != NRF_ERROR_NOT_FOUND) )
     {
-        length = data_len > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : data_len;
-        err_code = ble_fido_data_send(&m_fido, data, &length, m_conn_handle);
-        if ( (err_code != NRF_ERROR_INVALID_STATE) && (err_code != NRF_ERROR_RESOURCES) &&
-             (err_code != NRF_ERROR_NOT_FOUND) )
+        APP_ERROR_CHECK(err_code);
+    }
+    return err_code;
+}
+
+// fragment size for responses, what the link carries per notification capped by the
+// fidoControlPointLength we advertise, the MTU may grow after the first message
+static uint16_t ble_fido_fragment_len(void)
+{
+    return MIN(m_ble_gatt_max_data_len, BLE_FIDO_MAX_DATA_LEN);
+}
+
+// One fragment of the FIDO response, the sequence number only advances once the SoftDevice took it.
+// NRF_ERROR_RESOURCES leaves it for the next TX complete.
+static ret_code_t ble_fido_tx_one(void)
+{
+    ret_code_t err_code;
+    uint8_t fido_packet[BLE_FIDO_MAX_DATA_LEN];
+    uint16_t fragment_len = ble_fido_fragment_len();
+    uint16_t length = ble_fido_send_len - ble_fido_send_offset;
+
+    if ( ble_fido_send_offset == 0 )
+    {
+        length = MIN(length, fragment_len);
+        err_code = ble_fido_send_packet(ble_fido_send_buf, length);
+    }
+    else
+    {
+        length = MIN(length, fragment_len - 1);
+        fido_packet[0] = fido_sequence_number;
+        memcpy(fido_packet + 1, ble_fido_send_buf + ble_fido_send_offset, length);
+        err_code = ble_fido_send_packet(fido_packet, length + 1);
+        if ( err_code == NRF_SUCCESS )
         {
-            APP_ERROR_CHECK(err_code);
+            fido_sequence_number = (fido_sequence_number + 1) & FIDO_SEQ_MASK;
         }
     }
-    while ( err_code == NRF_ERROR_RESOURCES );
+
+    if ( err_code == NRF_ERROR_RESOURCES )
+    {
+        return err_code;
+    }
+    if ( err_code != NRF_SUCCESS )
+    {
+        // link gone or notification disabled, drop the rest
+        fido_tx_stats.aborted++;
+        ble_tx_chan_drop(BLE_TX_CH_FIDO, ble_fido_send_buf, &ble_fido_send_len, &ble_fido_send_offset);
+        spi_read_resume();
+        return err_code;
+    }
+    ble_fido_send_offset += length;
+    fido_tx_stats.fragments++;
+    return NRF_SUCCESS;
+}
+
+// a new response starts over at sequence 0, the MTU may have grown since the last one
+static void ble_fido_tx_begin(void)
+{
+    fido_sequence_number = 0;
+    fido_tx_stats.fragment_len = ble_fido_fragment_len();
+}
+
+// last fragment left the SoftDevice, called once the completed notifications are counted
+static void ble_fido_tx_complete(void)
+{
+    uint32_t ms;
+
+    if ( ble_fido_send_len == 0 || ble_fido_send_offset < ble_fido_send_len ||
+         ble_tx_chan[BLE_TX_CH_FIDO].pending != 0 )
+    {
+        return;
+    }
+
+    ms = BLE_TICKS_TO_MS(app_timer_cnt_diff_compute(app_timer_cnt_get(), ble_tx_chan[BLE_TX_CH_FIDO].start_ticks));
+    fido_tx_stats.messages++;
+    fido_tx_stats.last_ms = MIN(ms, UINT16_MAX);
+    fido_tx_stats.max_ms = MAX(fido_tx_stats.max_ms, fido_tx_stats.last_ms);
+    ble_tx_latency_record(BLE_TX_CH_FIDO);
+
+    spi_recv_buf_release(ble_fido_send_buf);
+    if ( ble_tx_chan_next(BLE_TX_CH_FIDO, &ble_fido_send_buf, &ble_fido_send_len, &ble_fido_send_offset) )
+    {
+        ble_fido_tx_begin();
+    }
+    spi_read_resume();
+}
+
+static bool fido_stream_forward(const char* p_tag, const uint8_t* p_data, uint16_t len, uint16_t head_len)
+{
+    spi_pkt_t* p_pkt;
+
+    if ( len + FIDO_STREAM_HEAD_LEN > SPI_PKT_DATA_SIZE )
+    {
+        return false;
+    }
+    p_pkt = spi_pkt_alloc();
+    if ( p_pkt == NULL )
+    {
+        return false;
+    }
+    memcpy(p_pkt->data, p_tag, 3);
+    p_pkt->data[3] = head_len >> 8;
+    p_pkt->data[4] = head_len & 0xff;
+    if ( len != 0 )
+    {
+        memcpy(p_pkt->data + FIDO_STREAM_HEAD_LEN, p_data, len);
+    }
+    p_pkt->len = len + FIDO_STREAM_HEAD_LEN;
+    return spi_pkt_submit(p_pkt);
+}
+
+// true once the ST was told, otherwise sent again as soon as a packet comes back to the pool
+static bool fido_stream_abort_send(void)
+{
+    bool sent;
+
+    CRITICAL_REGION_ENTER();
+    sent = fido_stream_forward("fia", NULL, 0, 0);
+    fido_stream_abort_pending = !sent;
+    CRITICAL_REGION_EXIT();
+    return sent;
+}
+
+// called from the SPI completion path after a packet went back to the pool
+void fido_stream_pkt_freed(void)
+{
+    if ( fido_stream_abort_pending )
+    {
+        UNUSED_RETURN_VALUE(fido_stream_abort_send());
+    }
+}
+
+// drop the message on both sides, the client times out and retries
+static void fido_stream_abort(void)
+{
+    if ( fido_data_state == FIDO_DATA_STATE_STREAM )
+    {
+        NRF_LOG_WARNING("fido stream aborted, %d bytes short", fido_stream_left);
+        if ( !fido_stream_abort_send() )
+        {
+            NRF_LOG_WARNING("fido stream abort pending, no spi packet");
+        }
+    }
+    fido_data_state = FIDO_DATA_STATE_IDLE;
+}
+
+static void fido_stream_start(uint8_t* rcv_data, uint32_t rcv_len)
+{
+    // cmd and len16 count towards the message
+    uint32_t total = (rcv_len < 3) ? 0 : (uint32_t)(rcv_data[1] << 8 | rcv_data[2]) + 3;
+
+    if ( total == 0 || total > UINT16_MAX || rcv_len > total )
+    {
+        return;
+    }
+    if ( !(rcv_data[0] & 0x80) )
+    {
+        // continuation left over from an aborted message
+        NRF_LOG_DEBUG("fido fragment 0x%02x dropped, no message in progress", rcv_data[0]);
+        return;
+    }
+    if ( fido_stream_abort_pending && !fido_stream_abort_send() )
+    {
+        // the ST still holds part of the last message, it has to hear about that first
+        NRF_LOG_WARNING("fido stream start dropped, abort pending");
+        return;
+    }
+    if ( !fido_stream_forward("fid", rcv_data, rcv_len, total) )
+    {
+        NRF_LOG_WARNING("fido stream start dropped");
+        return;
+    }
+    if ( total > rcv_len )
+    {
+        fido_stream_seq = 0;
+        fido_stream_left = total - rcv_len;
+        fido_data_state = FIDO_DATA_STATE_STREAM;
+    }
+    else
+    {
+        fido_keepalive_start();
+    }
+}
+
+static void fido_stream_continue(uint8_t* rcv_data, uint32_t rcv_len)
+{
+    if ( rcv_len < 2 || rcv_data[0] != fido_stream_seq || rcv_len - 1 > fido_stream_left )
+    {
+        fido_stream_abort();
+        return;
+    }
+    if ( !fido_stream_forward("fic", rcv_data, rcv_len, rcv_len) )
+    {
+        fido_stream_abort();
+        return;
+    }
+    fido_stream_seq = (fido_stream_seq + 1) & FIDO_SEQ_MASK;
+    fido_stream_left -= rcv_len - 1;
+    if ( fido_stream_left == 0 )
+    {
+        fido_data_state = FIDO_DATA_STATE_IDLE;
+        fido_keepalive_start();
+    }
+}
+
+// link gone, the rest of a streamed message will not come
+static void fido_rx_reset(void)
+{
+    fido_stream_abort();
+    fido_keepalive_stop();
+}
+
+// takes effect with the next message
+static bool fido_stream_set(uint8_t mode)
+{
+    if ( mode > FIDO_STREAM_ON )
+    {
+        return false;
+    }
+    CRITICAL_REGION_ENTER();
+    fido_stream_abort();
+    fido_stream_mode = mode;
+    CRITICAL_REGION_EXIT();
+    return true;
 }
 
 static void fido_data_handler(ble_fido_evt_t* p_evt)
@@ -39,7 +364,21 @@ static void fido_data_handler(ble_fido_evt_t* p_evt)
     uint32_t rcv_len = p_evt->params.rx_data.length;
     if ( p_evt->type == BLE_FIDO_EVT_RX_DATA )
     {
-        if ( fido_data_state == FIDO_DATA_STATE_IDLE )
+        ble_link_traffic_add(rcv_len);
+        if ( fido_data_state == FIDO_DATA_STATE_STREAM )
+        {
+            fido_stream_continue(rcv_data, rcv_len);
+        }
+        else if ( fido_data_state == FIDO_DATA_STATE_IDLE && fido_stream_mode == FIDO_STREAM_ON )
+        {
+            fido_stream_start(rcv_data, rcv_len);
+        }
+        else if ( fido_data_state == FIDO_DATA_STATE_IDLE && fido_recv_buf_busy )
+        {
+            // the previous request is still going to the ST, the client retries on timeout
+            NRF_LOG_WARNING("fido message dropped, previous one still in transfer");
+        }
+        else if ( fido_data_state == FIDO_DATA_STATE_IDLE )
         {
             fido_sequence_number = 0;
             fido_recv_len = rcv_data[1] << 8 | rcv_data[2];
@@ -64,7 +403,7 @@ static void fido_data_handler(ble_fido_evt_t* p_evt)
                 memcpy(fido_recv_buf + 5, rcv_data, rcv_len);
                 fido_recv_len = rcv_len + 5;
                 // fido_write_data_to_st(fido_recv_buf,fido_recv_len);
-                app_sched_event_put(NULL, 0, fido_write_data_to_st);
+                fido_write_data_post();
             }
         }
         else if ( fido_data_state == FIDO_DATA_STATE_RECV )
@@ -79,7 +418,7 @@ static void fido_data_handler(ble_fido_evt_t* p_evt)
                     fido_data_state = FIDO_DATA_STATE_IDLE;
                     fido_recv_len += 8;
                     // fido_write_data_to_st(fido_recv_buf,fido_recv_len);
-                    app_sched_event_put(NULL, 0, fido_write_data_to_st);
+                    fido_write_data_post();
                 }
             }
             else
@@ -90,39 +429,146 @@ static void fido_data_handler(ble_fido_evt_t* p_evt)
     }
     else if ( p_evt->type == BLE_FIDO_EVT_TX_RDY )
     {
-        uint8_t fido_packet[BLE_FIDO_MAX_DATA_LEN];
-        uint16_t length = ble_fido_send_len - ble_fido_send_offset;
-        if ( length > 0 )
+        ble_tx_schedule();
+    }
+}
+
+void ble_fido_send(uint8_t* data, uint16_t data_len)
+{
+    if ( data_len == 0 || m_conn_handle == BLE_CONN_HANDLE_INVALID )
+    {
+        spi_recv_buf_release(data);
+        return;
+    }
+
+    if ( data != fido_keepalive_frame )
+    {
+        if ( data[0] == FIDO_CMD_KEEPALIVE && data_len >= sizeof(fido_keepalive_frame) && fido_keepalive_active )
         {
-            fido_packet[0] = fido_sequence_number++;
-            length = length > BLE_FIDO_MAX_DATA_LEN - 1 ? BLE_FIDO_MAX_DATA_LEN - 1 : length;
-            memcpy(fido_packet + 1, ble_fido_send_buf + ble_fido_send_offset, length);
-            ble_fido_send_packet(fido_packet, length + 1);
-            ble_fido_send_offset += length;
+            // ST keepalive, repeat its status from now on
+            fido_keepalive_frame[3] = data[3];
         }
         else
         {
-            ble_fido_send_len = 0;
-            ble_fido_send_offset = 0;
-            fido_sequence_number = 0;
+            fido_keepalive_stop();
         }
     }
+
+    CRITICAL_REGION_ENTER();
+    if ( ble_fido_send_len == 0 )
+    {
+        ble_fido_tx_begin();
+    }
+    if ( !ble_tx_chan_put(BLE_TX_CH_FIDO, data, data_len, &ble_fido_send_buf, &ble_fido_send_len, &ble_fido_send_offset) )
+    {
+        NRF_LOG_WARNING("fido message dropped, channel full");
+        spi_recv_buf_release(data);
+    }
+    ble_tx_schedule();
+    CRITICAL_REGION_EXIT();
 }
 
-void ble_fido_send(uint8_t* data, uint16_t data_len)
+// Next channel to get a fragment. FIDO goes first while it has credit, every round refills
+// the credits from the weights so a long FIDO response cannot starve NUS and the other way round.
+static int8_t ble_tx_pick(void)
 {
-    uint16_t length = 0;
+    bool ready[BLE_TX_CH_COUNT];
+    uint8_t ch;
+
+    ready[BLE_TX_CH_NUS] = ble_nus_send_offset < ble_nus_send_len;
+    ready[BLE_TX_CH_FIDO] = ble_fido_send_offset < ble_fido_send_len;
 
-    if ( data_len == 0 )
+    for ( uint8_t round = 0; round < 2; round++ )
     {
-        return;
+        for ( ch = BLE_TX_CH_COUNT; ch-- > 0; )
+        {
+            if ( ready[ch] && ble_tx_chan[ch].credit != 0 )
+            {
+                ble_tx_chan[ch].credit--;
+                return ch;
+            }
+        }
+        for ( ch = 0; ch < BLE_TX_CH_COUNT; ch++ )
+        {
+            ble_tx_chan[ch].credit = ble_tx_weight[ch];
+        }
     }
+    return -1;
+}
+
+// Hand fragments to the SoftDevice until it runs out of buffers, so several go out in one
+// connection event. Runs from the senders and from every TX complete.
+static void ble_tx_schedule(void)
+{
+    ret_code_t err_code;
+    uint8_t burst = 0;
+    int8_t ch;
 
-    ble_fido_send_buf = data;
-    ble_fido_send_len = data_len;
+    CRITICAL_REGION_ENTER();
+    while ( (ch = ble_tx_pick()) >= 0 )
+    {
+        err_code = ch == BLE_TX_CH_FIDO ? ble_fido_tx_one() : ble_nus_tx_one();
+        if ( err_code == NRF_ERROR_RESOURCES )
+        {
+            // give the credit back, the fragment is still first in line
+            ble_tx_chan[ch].credit++;
+            break;
+        }
+        if ( err_code == NRF_SUCCESS && ch == BLE_TX_CH_FIDO )
+        {
+            burst++;
+        }
+    }
+    if ( burst > fido_tx_stats.burst_max )
+    {
+        fido_tx_stats.burst_max = burst;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+// connection gone, drop both channels and hand their buffers back
+static void ble_tx_reset(void)
+{
+    ble_tx_chan_drop(BLE_TX_CH_NUS, ble_nus_send_buf, &ble_nus_send_len, &ble_nus_send_offset);
+    ble_tx_chan_drop(BLE_TX_CH_FIDO, ble_fido_send_buf, &ble_fido_send_len, &ble_fido_send_offset);
+    for ( uint8_t ch = 0; ch < BLE_TX_CH_COUNT; ch++ )
+    {
+        ble_tx_chan[ch].pending = 0;
+        ble_tx_chan[ch].credit = 0;
+    }
+    ble_hvn_tx_pending = 0;
+    ble_hvn_tx_head = 0;
     fido_sequence_number = 0;
+}
 
-    length = ble_fido_send_len > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : ble_fido_send_len;
-    ble_fido_send_offset = length;
-    ble_fido_send_packet(ble_fido_send_buf, length);
+void ble_tx_stats_spi_deferred(void)
+{
+    ble_tx_stats.spi_reads_deferred++;
+}
+
+void ble_tx_stats_get(ble_tx_stats_t* p_stats)
+{
+    CRITICAL_REGION_ENTER();
+    *p_stats = ble_tx_stats;
+    p_stats->hvn_pending = ble_hvn_tx_pending;
+    CRITICAL_REGION_EXIT();
+}
+
+void ble_fido_tx_stats_get(ble_fido_tx_stats_t* p_stats)
+{
+    CRITICAL_REGION_ENTER();
+    *p_stats = fido_tx_stats;
+    CRITICAL_REGION_EXIT();
+}
+
+void ble_tx_chan_stats_get(uint8_t ch, ble_tx_chan_stats_t* p_stats)
+{
+    if ( ch >= BLE_TX_CH_COUNT )
+    {
+        memset(p_stats, 0, sizeof(*p_stats));
+        return;
+    }
+    CRITICAL_REGION_ENTER();
+    *p_stats = ble_tx_chan_stats[ch];
+    CRITICAL_REGION_EXIT();
 }
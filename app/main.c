@@ -52,7 +52,6 @@
 #include <string.h>
 #include "app_error.h"
 #include "app_timer.h"
-#include "app_uart.h"
 #include "ble_advdata.h"
 #include "ble_advertising.h"
 #include "ble_bas.h"
@@ -94,15 +93,12 @@
 #include "power_manage.h"
 #include "flashled_manage.h"
 #include "data_transmission.h"
+#include "uart_transmission.h"
+#include "ble_link_manage.h"
 #include "device_config.h"
 #include "firmware_config.h"
 #include "dfu_upgrade.h"
 
-#define RX_PIN_NUMBER           11
-#define TX_PIN_NUMBER           12
-#define CTS_PIN_NUMBER          UART_PIN_DISCONNECTED
-#define RTS_PIN_NUMBER          UART_PIN_DISCONNECTED
-
 #define APDU_TAG_BLE            0x44
 
 #define BLE_DEFAULT             0
@@ -126,23 +122,6 @@
 #define BLE_CON                 4
 #define BLE_PAIR                5
 
-#define PWR_DEF                 0
-#define PWR_SHUTDOWN_SYS        1
-#define PWR_CLOSE_EMMC          2
-#define PWR_OPEN_EMMC           3
-#define PWR_BAT_PERCENT         5
-#define PWR_USB_STATUS          6
-
-#define LED_DEF                 0
-#define LED_SET_BRIHTNESS       1
-#define LED_GET_BRIHTNESS       2
-
-#define BAT_DEF                 0
-#define SEND_BAT_VOL            1
-#define SEND_BAT_CHARGE_CUR     2
-#define SEND_BAT_DISCHARGE_CUR  3
-#define SEND_BAT_INNER_TEMP     4
-
 #define INIT_VALUE              0
 #define AUTH_VALUE              1
 
@@ -156,8 +135,8 @@
 #define COMPANY_IDENTIFIER      0xFE
 
 // SCHEDULER CONFIGS
-#define SCHED_MAX_EVENT_DATA_SIZE   256 //!< Maximum size of the scheduler event data.
-#define SCHED_QUEUE_SIZE            4   //!< Size of the scheduler queue.
+#define SCHED_MAX_EVENT_DATA_SIZE   sizeof(void*) //!< Maximum size of the scheduler event data, buffers are passed by pointer.
+#define SCHED_QUEUE_SIZE            8             //!< Size of the scheduler queue, SPI completions are batched into one event.
 
 #define RCV_DATA_TIMEOUT_INTERVAL   APP_TIMER_TICKS(500)
 #define BATTERY_LEVEL_MEAS_INTERVAL APP_TIMER_TICKS(1000) /**< Battery level measurement interval (ticks). */
@@ -174,6 +153,7 @@
     APP_TIMER_TICKS(30000             \
     ) /**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
 #define ONE_SECOND_INTERVAL      APP_TIMER_TICKS(1000)
+#define PMU_DEBOUNCE_INTERVAL    APP_TIMER_TICKS(10) // step of the pmu irq and PowerOK debounce
 
 #define RST_ONE_SECNOD_COUNTER() one_second_counter = 0;
 #define TWI_TIMEOUT_COUNTER      10
@@ -215,8 +195,6 @@
 
 // UART define
 #define MAX_TEST_DATA_BYTES (15U) /**< max number of test bytes to be used for tx and rx. */
-#define UART_TX_BUF_SIZE    256   /**< UART TX buffer size. */
-#define UART_RX_BUF_SIZE    256   /**< UART RX buffer size. */
 
 // BLE send CMD
 #define BLE_CMD_ADV_NAME 0x01
@@ -252,6 +230,11 @@
 #define BLE_CMD_BUILD_ID         0x10
 #define BLE_CMD_HASH             0x11
 #define BLE_CMD_BT_MAC           0x12
+#define BLE_CMD_SPI_CAPS         0x13
+#define BLE_CMD_SPI_CFG          0x14
+#define BLE_CMD_UART_CFG         0x15
+#define BLE_CMD_FIDO_STATS       0x18
+#define BLE_CMD_TX_HIST          0x19
 
 // end BLE send CMD
 //
@@ -280,6 +263,10 @@
 #define ST_REQ_USB_STATUS      0x05
 #define ST_REQ_ENABLE_CHARGE   0x06
 #define ST_REQ_DISABLE_CHARGE  0x07
+#define ST_REQ_POWER_TLM       0x08 // one BLE_CMD_POWER_TLM full frame
+#define ST_SET_POWER_TLM       0x09 // period_s16, percent, mv16, ma16, temp, POWER_TLM_FLAG_*
+#define ST_REQ_PMU_BUS         0x0A // one BLE_CMD_PMU_BUS frame
+#define ST_REQ_I2C_HEALTH      0x0B // one BLE_CMD_I2C_HEALTH frame
 //
 #define ST_CMD_BLE_INFO       0x83
 #define ST_REQ_ADV_NAME       0x01
@@ -289,6 +276,9 @@
 #define ST_REQ_BUILD_ID       0x05
 #define ST_REQ_HASH           0x06
 #define ST_REQ_BT_MAC         0x07
+#define ST_REQ_SPI_CAPS       0x08
+#define ST_REQ_FIDO_STATS     0x09
+#define ST_REQ_TX_HIST        0x0A // channel BLE_TX_CH_*
 
 //
 #define ST_CMD_RESET_BLE   0x84
@@ -309,6 +299,19 @@
 #define STM_LOCK_PUBKEY            0x02
 #define STM_REQUEST_SIGN           0x03
 
+#define ST_CMD_SPI_CFG             0x88
+#define ST_SPI_SET_CRC             0x01 // value: SPI_CRC_NONE / SPI_CRC_16 / SPI_CRC_32
+#define ST_SPI_GET_STATS           0x02
+#define ST_SPI_SET_FRAME           0x03 // value: SPI_FRAME_PADDED / SPI_FRAME_VARIABLE
+#define ST_SPI_SET_FIDO_STREAM     0x04 // value: FIDO_STREAM_OFF / FIDO_STREAM_ON
+
+#define ST_CMD_UART_CFG            0x89
+#define ST_UART_SET_RATE           0x01 // value: UART_RATE_115200 / UART_RATE_1M, then UART_FLAG_*
+#define ST_UART_LOOPBACK           0x02 // payload is echoed back at the new rate
+#define ST_UART_COMMIT             0x03
+#define ST_UART_GET_STATS          0x04
+#define ST_UART_FALLBACK           0x05 // sent by us when the link dropped back to 115200
+
 // end Receive ST CMD
 
 // VALUE
@@ -329,6 +332,8 @@
 #define DATA_HEAD 0x01
 #define DATA_RECV 0x02
 #define DATA_WAIT 0x03
+#define DATA_DROP      0x04 // a chunk was lost, the rest of the message goes too
+#define DATA_DROP_WAIT 0x05
 
 // BLE RSP STATUS
 #define CTL_SUCCESSS 0x01
@@ -339,29 +344,12 @@
 // #define NFC_CHANNEL                     0x02
 #define UART_CHANNEL                0x03
 
-#define UART_DEF                    0x00
-#define ACTIVE_SEND_UART            0x01
-#define RESPONESE_NAME              0x02
-#define RESPONESE_BAT               0x03
-#define RESPONESE_VER               0x04
-#define RESPONESE_SD_VER            0x05
-#define RESPONESE_BOOT_VER          0x06
-#define RESPONESE_LED_VER           0x07
-#define RESPONESE_BLE_PUBKEY        0x08
-#define RESPONESE_BLE_PUBKEY_LOCK   0x09
-#define RESPONESE_BLE_SIGN          0x0A
-#define RESPONESE_BUILD_ID          0x0B
-#define RESPONESE_HASH              0x0C
-#define RESPONESE_BT_MAC            0x0D
-#define DEF_RESP                    0xFF
-
 #define TIMER_INIT_FLAG             0
 #define TIMER_RESET_FLAG            1
 #define TIMER_START_FLAG            2
 #define TIMER_STOP_FLAG             3
 
-#define BLE_GAP_DATA_LENGTH_DEFAULT 27  //!< The stack's default data length.
-#define BLE_GAP_DATA_LENGTH_MAX     251 //!< Maximum data length.
+#define BLE_HVN_TX_QUEUE_SIZE       8 //!< Notifications the SoftDevice can hold per link.
 
 #define ST_WAKE_IO                  22
 
@@ -374,16 +362,13 @@ BLE_ADVERTISING_DEF(m_advertising); /**< Advertising module instance. */
 APP_TIMER_DEF(m_battery_timer_id);  /**< Battery timer. */
 APP_TIMER_DEF(data_wait_timer_id);  /**< data wait timeout timer. */
 APP_TIMER_DEF(m_1s_timer_id);
+APP_TIMER_DEF(m_pmu_irq_timer_id);   /**< PMU irq debounce step. */
+APP_TIMER_DEF(m_pmu_pwrok_timer_id); /**< PowerOK debounce step. */
 nrf_drv_wdt_channel_id m_channel_id;
 
 static volatile uint8_t one_second_counter = 0;
 volatile uint8_t ble_adv_switch_flag = BLE_DEF;
-static volatile uint8_t ble_conn_flag = BLE_DEF;
 static volatile uint8_t ble_conn_nopair_flag = BLE_DEF;
-static volatile uint8_t pwr_status_flag = PWR_DEF;
-static volatile uint8_t trans_info_flag = UART_DEF;
-static volatile uint8_t led_brightness_flag = LED_DEF;
-static volatile uint8_t bat_msg_flag = BAT_DEF;
 static volatile uint8_t ble_trans_timer_flag = TIMER_INIT_FLAG;
 static uint8_t mac_ascii[12];
 static uint8_t mac[BLE_GAP_ADDR_LEN] = {0x42, 0x13, 0xc7, 0x98, 0x95, 0x1a}; // Device MAC address
@@ -412,14 +397,11 @@ static ble_uuid_t m_adv_uuids[] =                        /**< Universally unique
         {BLE_UUID_NUS_SERVICE, BLE_UUID_TYPE_BLE}};
 
 static volatile uint8_t flag_uart_trans = 1;
-static uint8_t uart_trans_buff[128];
-static uint8_t bak_buff[128];
-static uint8_t uart_data_array[64];
-static void uart_put_data(uint8_t* pdata, uint8_t lenth);
+static uint8_t bak_buff[128]; // st_cmd replies only, those all run from the main loop
 static void send_stm_data(uint8_t* pdata, uint8_t lenth);
-static uint8_t calcXor(uint8_t* buf, uint8_t len);
 
 static bool bt_advertising_ctrl(bool enable, bool commit);
+static bool bt_disconnect();
 static void idle_state_handle(void);
 
 static uint8_t bond_check_key_flag = INIT_VALUE;
@@ -428,6 +410,32 @@ static uint8_t ble_status_flag = 0;
 
 static volatile uint16_t ble_nus_send_len = 0, ble_nus_send_offset = 0;
 static uint8_t* ble_nus_send_buf;
+static volatile uint8_t ble_hvn_tx_pending = 0; // notifications queued in SoftDevice, not yet completed
+static ble_tx_stats_t ble_tx_stats = {0};
+
+// BLE TX multiplexing: each channel has one message in flight and one queued behind it,
+// fragments of both channels are interleaved by weight, FIDO first
+typedef struct
+{
+    uint8_t* p_next; // queued behind the message in flight
+    uint16_t next_len;
+    uint32_t next_ticks;
+    uint32_t start_ticks; // message in flight handed to BLE
+    uint8_t pending;      // notifications of this channel in the SoftDevice
+    uint8_t credit;       // fragments left in this scheduling round
+    uint8_t held;         // messages in flight and queued
+} ble_tx_chan_t;
+
+static ble_tx_chan_t ble_tx_chan[BLE_TX_CH_COUNT];
+static const uint8_t ble_tx_weight[BLE_TX_CH_COUNT] = {[BLE_TX_CH_NUS] = 1, [BLE_TX_CH_FIDO] = 4};
+static ble_tx_chan_stats_t ble_tx_chan_stats[BLE_TX_CH_COUNT];
+static const uint16_t ble_tx_hist_limits[BLE_TX_HIST_BUCKETS - 1] = {10, 20, 50, 100, 200, 500, 1000};
+// notifications complete in the order they were queued, remember whose they were
+static uint8_t ble_hvn_tx_chan[BLE_HVN_TX_QUEUE_SIZE];
+static uint8_t ble_hvn_tx_head = 0;
+
+#define BLE_TICKS_TO_MS(ticks) \
+    ((uint32_t)(((uint64_t)(ticks) * 1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / APP_TIMER_CLOCK_FREQ))
 
 // global vars
 static uint8_t g_bas_update_flag = 0;
@@ -441,12 +449,6 @@ static volatile bool pmu_feat_charge_enable = false;
 static volatile bool led_brightness_synced = false;
 static volatile uint8_t led_brightness_value = 0;
 
-// misc status flags
-// mainly use for workarounds when needs shutdown before app fullly boots to main even loop
-// NRF5 SDK is poorly designed which do not track if a feature is initialized when calling apis
-// Thus uninit function may stuck if feature init never called
-static volatile bool app_uart_is_initialized = false;
-
 /**@brief Handler for shutdown preparation.
  *
  * @details During shutdown procedures, this function will be called at a 1 second interval
@@ -505,11 +507,7 @@ static inline void gpio_uninit(void)
 static void enter_low_power_mode(void)
 {
     // stop uart
-    if ( app_uart_is_initialized )
-    {
-        app_uart_close();
-        app_uart_is_initialized = false;
-    }
+    uart_trans_uninit();
 
     // stop bt adv
     if ( nrf_sdh_is_enabled() )
@@ -579,7 +577,11 @@ void data_wait_timeout_hander(void* p_context)
     {
         rcv_head_flag = DATA_WAIT;
     }
-    else if ( rcv_head_flag == DATA_WAIT )
+    else if ( rcv_head_flag == DATA_DROP )
+    {
+        rcv_head_flag = DATA_DROP_WAIT;
+    }
+    else if ( rcv_head_flag == DATA_WAIT || rcv_head_flag == DATA_DROP_WAIT )
     {
         rcv_head_flag = DATA_INIT;
     }
@@ -692,13 +694,12 @@ static void pm_evt_handler(const pm_evt_t* p_evt)
             {
                 if ( ble_conn_nopair_flag == BLE_PAIR )
                 {
+                    uint8_t st_frame[2] = {BLE_CMD_PAIR_STA, BLE_PAIR_SUCCESS};
+
                     ble_conn_nopair_flag = BLE_DEF;
-                    bak_buff[0] = BLE_CMD_PAIR_STA;
-                    bak_buff[1] = BLE_PAIR_SUCCESS;
-                    send_stm_data(bak_buff, 2);
+                    send_stm_data(st_frame, sizeof(st_frame));
                 }
 
-                nrf_ble_gatt_data_length_set(&m_gatt, m_conn_handle, BLE_GAP_DATA_LENGTH_MAX);
                 NRF_LOG_INFO(
                     "Link secured. Role: %d. conn_handle: %d, Procedure: %d", ble_conn_state_role(p_evt->conn_handle),
                     p_evt->conn_handle, p_evt->params.conn_sec_succeeded.procedure
@@ -723,10 +724,10 @@ static void pm_evt_handler(const pm_evt_t* p_evt)
             p_evt->params.conn_sec_failed.error, p_evt->params.conn_sec_failed.error_src
         );
         m_conn_handle = BLE_CONN_HANDLE_INVALID;
-
-        bak_buff[0] = BLE_CMD_PAIR_STA;
-        bak_buff[1] = BLE_PAIR_FAIL;
-        send_stm_data(bak_buff, 2);
+        {
+            uint8_t st_frame[2] = {BLE_CMD_PAIR_STA, BLE_PAIR_FAIL};
+            send_stm_data(st_frame, sizeof(st_frame));
+        }
         break;
 
     case PM_EVT_LOCAL_DB_CACHE_APPLIED:
@@ -856,6 +857,8 @@ static void gatt_init(void)
 
     err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
     APP_ERROR_CHECK(err_code);
+
+    ble_link_manage_init(&m_gatt);
 }
 
 /**@brief Function for handling Queued Write Module errors.
@@ -870,22 +873,182 @@ static void nrf_qwr_error_handler(uint32_t nrf_error)
     APP_ERROR_HANDLER(nrf_error);
 }
 
-static void ble_nus_send_packet(uint8_t* data, uint16_t data_len)
+static void ble_hvn_tx_queued(uint8_t ch);
+static void ble_fido_tx_complete(void);
+static void ble_tx_schedule(void);
+
+// hand a message to a channel, it waits behind the one in flight if there is one
+static bool ble_tx_chan_put(
+    uint8_t ch, uint8_t* data, uint16_t len, uint8_t** pp_buf, volatile uint16_t* p_len, volatile uint16_t* p_offset
+)
+{
+    ble_tx_chan_t* p_chan = &ble_tx_chan[ch];
+    uint32_t ticks = app_timer_cnt_get();
+
+    if ( *p_len == 0 )
+    {
+        *pp_buf = data;
+        *p_len = len;
+        *p_offset = 0;
+        p_chan->start_ticks = ticks;
+    }
+    else if ( p_chan->p_next == NULL )
+    {
+        p_chan->p_next = data;
+        p_chan->next_len = len;
+        p_chan->next_ticks = ticks;
+    }
+    else
+    {
+        return false;
+    }
+    p_chan->held++;
+    ble_tx_chan_stats[ch].queued_max = MAX(ble_tx_chan_stats[ch].queued_max, p_chan->held);
+    return true;
+}
+
+// the queued message takes over, false when there was none
+static bool ble_tx_chan_next(uint8_t ch, uint8_t** pp_buf, volatile uint16_t* p_len, volatile uint16_t* p_offset)
+{
+    ble_tx_chan_t* p_chan = &ble_tx_chan[ch];
+
+    // the one in flight is done
+    if ( p_chan->held > 0 )
+    {
+        p_chan->held--;
+    }
+    *pp_buf = p_chan->p_next;
+    *p_len = p_chan->next_len;
+    *p_offset = 0;
+    p_chan->start_ticks = p_chan->next_ticks;
+    p_chan->p_next = NULL;
+    p_chan->next_len = 0;
+    return *p_len != 0;
+}
+
+// drop whatever the channel holds, the buffers go back to the SPI side
+static void ble_tx_chan_drop(uint8_t ch, uint8_t* p_buf, volatile uint16_t* p_len, volatile uint16_t* p_offset)
+{
+    if ( *p_len != 0 )
+    {
+        spi_recv_buf_release(p_buf);
+    }
+    if ( ble_tx_chan[ch].p_next != NULL )
+    {
+        spi_recv_buf_release(ble_tx_chan[ch].p_next);
+        ble_tx_chan[ch].p_next = NULL;
+        ble_tx_chan[ch].next_len = 0;
+    }
+    ble_tx_chan[ch].held = 0;
+    *p_len = 0;
+    *p_offset = 0;
+}
+
+// handed to BLE until the last fragment left the SoftDevice, waiting behind the channel included
+static void ble_tx_latency_record(uint8_t ch)
+{
+    ble_tx_chan_stats_t* p_stats = &ble_tx_chan_stats[ch];
+    uint32_t ms = BLE_TICKS_TO_MS(app_timer_cnt_diff_compute(app_timer_cnt_get(), ble_tx_chan[ch].start_ticks));
+    uint8_t bucket = 0;
+
+    while ( bucket < BLE_TX_HIST_BUCKETS - 1 && ms >= ble_tx_hist_limits[bucket] )
+    {
+        bucket++;
+    }
+    if ( p_stats->hist[bucket] < UINT16_MAX )
+    {
+        p_stats->hist[bucket]++;
+    }
+    p_stats->messages++;
+    p_stats->max_ms = MAX(p_stats->max_ms, MIN(ms, UINT16_MAX));
+}
+
+// One NUS fragment, NRF_ERROR_RESOURCES leaves it for the next TX complete.
+static ret_code_t ble_nus_tx_one(void)
 {
     ret_code_t err_code;
-    uint16_t length = 0;
+    uint16_t length = ble_nus_send_len - ble_nus_send_offset;
 
-    do
+    length = length > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : length;
+    err_code = ble_nus_data_send(&m_nus, ble_nus_send_buf + ble_nus_send_offset, &length, m_conn_handle);
+    if ( err_code == NRF_ERROR_RESOURCES )
+    {
+        ble_tx_stats.resources_hits++;
+        return err_code;
+    }
+    if ( err_code != NRF_SUCCESS )
     {
-        length = data_len > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : data_len;
-        err_code = ble_nus_data_send(&m_nus, data, &length, m_conn_handle);
-        if ( (err_code != NRF_ERROR_INVALID_STATE) && (err_code != NRF_ERROR_RESOURCES) &&
-             (err_code != NRF_ERROR_NOT_FOUND) )
+        if ( (err_code != NRF_ERROR_INVALID_STATE) && (err_code != NRF_ERROR_NOT_FOUND) )
         {
             APP_ERROR_CHECK(err_code);
         }
+        // link gone or notification disabled, drop the rest
+        ble_tx_chan_drop(BLE_TX_CH_NUS, ble_nus_send_buf, &ble_nus_send_len, &ble_nus_send_offset);
+        spi_read_resume();
+        return err_code;
+    }
+    ble_nus_send_offset += length;
+    ble_hvn_tx_queued(BLE_TX_CH_NUS);
+    ble_link_traffic_add(length);
+    return NRF_SUCCESS;
+}
+
+static void ble_nus_tx_complete(void)
+{
+    if ( ble_nus_send_len == 0 || ble_nus_send_offset < ble_nus_send_len || ble_tx_chan[BLE_TX_CH_NUS].pending != 0 )
+    {
+        return;
+    }
+    ble_tx_latency_record(BLE_TX_CH_NUS);
+    // receive buffer is free again, let the STM32 send the next message
+    spi_recv_buf_release(ble_nus_send_buf);
+    UNUSED_RETURN_VALUE(ble_tx_chan_next(BLE_TX_CH_NUS, &ble_nus_send_buf, &ble_nus_send_len, &ble_nus_send_offset));
+    spi_read_resume();
+}
+
+static void ble_hvn_tx_queued(uint8_t ch)
+{
+    ble_hvn_tx_chan[(ble_hvn_tx_head + ble_hvn_tx_pending) % BLE_HVN_TX_QUEUE_SIZE] = ch;
+    ble_tx_chan[ch].pending++;
+    ble_hvn_tx_pending++;
+    if ( ble_hvn_tx_pending > ble_tx_stats.hvn_pending_max )
+    {
+        ble_tx_stats.hvn_pending_max = ble_hvn_tx_pending;
+    }
+}
+
+static void ble_hvn_tx_complete(uint8_t count)
+{
+    while ( count-- > 0 && ble_hvn_tx_pending > 0 )
+    {
+        ble_tx_chan[ble_hvn_tx_chan[ble_hvn_tx_head]].pending--;
+        ble_hvn_tx_head = (ble_hvn_tx_head + 1) % BLE_HVN_TX_QUEUE_SIZE;
+        ble_hvn_tx_pending--;
+    }
+
+    ble_nus_tx_complete();
+    ble_fido_tx_complete();
+    // a queued message may have taken over
+    ble_tx_schedule();
+}
+
+// Failure (message type 3) with code Failure_ProcessError, the host gets an answer for the
+// message dropped for lack of packets instead of waiting for one from the ST
+static uint8_t nus_drop_reply[] = {'?', '#', '#', 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x08, 0x09};
+
+static void nus_drop_reply_send(void)
+{
+    bool queued;
+
+    CRITICAL_REGION_ENTER();
+    queued = (ble_nus_send_len != 0 && ble_nus_send_buf == nus_drop_reply) ||
+             ble_tx_chan[BLE_TX_CH_NUS].p_next == nus_drop_reply;
+    CRITICAL_REGION_EXIT();
+
+    if ( !queued )
+    {
+        ble_nus_send(nus_drop_reply, sizeof(nus_drop_reply));
     }
-    while ( err_code == NRF_ERROR_RESOURCES );
 }
 
 /**@brief Function for handling the data from the Nordic UART Service.
@@ -901,7 +1064,8 @@ static void nus_data_handler(ble_nus_evt_t* p_evt)
     NRF_LOG_INFO("----> nus_data_handler CALLED");
     static uint32_t msg_len;
     uint32_t pad;
-    uint8_t nus_data_buf[NRF_SDH_BLE_GATT_MAX_MTU_SIZE - OPCODE_LENGTH - HANDLE_LENGTH] = {0};
+    spi_pkt_t* p_pkt;
+    uint8_t* nus_data_buf;
     uint32_t nus_data_len = 0;
 
     if ( p_evt->type == BLE_NUS_EVT_RX_DATA )
@@ -909,14 +1073,42 @@ static void nus_data_handler(ble_nus_evt_t* p_evt)
         NRF_LOG_INFO("Received data from BLE NUS.");
         NRF_LOG_HEXDUMP_DEBUG(p_evt->params.rx_data.p_data, p_evt->params.rx_data.length);
         nus_data_len = p_evt->params.rx_data.length;
+        ble_link_traffic_add(nus_data_len);
+
+        // the only copy, the packet goes to the SPI side by reference
+        p_pkt = spi_pkt_alloc();
+        if ( p_pkt == NULL )
+        {
+            // the ST must never see a message with a chunk missing
+            if ( rcv_head_flag != DATA_DROP && rcv_head_flag != DATA_DROP_WAIT )
+            {
+                nus_drop_reply_send();
+            }
+            rcv_head_flag = DATA_DROP;
+            msg_len = 0;
+            return;
+        }
+        nus_data_buf = p_pkt->data;
         memcpy(nus_data_buf, (uint8_t*)p_evt->params.rx_data.p_data, nus_data_len);
 
+        if ( rcv_head_flag == DATA_DROP || rcv_head_flag == DATA_DROP_WAIT )
+        {
+            if ( nus_data_buf[0] == '?' && !(nus_data_buf[1] == '#' && nus_data_buf[2] == '#') )
+            {
+                rcv_head_flag = DATA_DROP;
+                spi_pkt_free(p_pkt);
+                return;
+            }
+            rcv_head_flag = DATA_INIT;
+        }
+
         if ( rcv_head_flag == DATA_INIT )
         {
             if ( nus_data_buf[0] == '?' && nus_data_buf[1] == '#' && nus_data_buf[2] == '#' )
             {
                 if ( nus_data_len < 9 )
                 {
+                    spi_pkt_free(p_pkt);
                     return;
                 }
                 else
@@ -935,6 +1127,7 @@ static void nus_data_handler(ble_nus_evt_t* p_evt)
                       nus_data_buf[3] == 0x1 && nus_data_buf[4] == 0x03 )
             {
                 ble_adv_switch_flag = BLE_OFF_ALWAYS;
+                spi_pkt_free(p_pkt);
                 return;
             }
         }
@@ -960,25 +1153,12 @@ static void nus_data_handler(ble_nus_evt_t* p_evt)
                 rcv_head_flag = DATA_INIT;
             }
         }
-        // spi_write_st_data(nus_data_buf, nus_data_len);
-        app_sched_event_put(nus_data_buf, nus_data_len, spi_write_st_data);
+        p_pkt->len = nus_data_len;
+        spi_pkt_submit(p_pkt);
     }
     else if ( p_evt->type == BLE_NUS_EVT_TX_RDY )
     {
-        uint32_t length = 0;
-
-        length = ble_nus_send_len - ble_nus_send_offset;
-        if ( length > 0 )
-        {
-            length = length > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : length;
-            ble_nus_send_packet(ble_nus_send_buf + ble_nus_send_offset, length);
-            ble_nus_send_offset += length;
-        }
-        else
-        {
-            ble_nus_send_len = 0;
-            ble_nus_send_offset = 0;
-        }
+        ble_tx_schedule();
     }
 }
 
@@ -1037,7 +1217,8 @@ static void services_init(void)
     memset(&fido_init, 0, sizeof(fido_init));
     fido_init.data_handler = fido_data_handler;
     err_code = ble_fido_init(&m_fido, &fido_init);
-    APP_ERROR_CHECK(err_code);    
+    APP_ERROR_CHECK(err_code);
+    fido_keepalive_init();    
 }
 
 /**@brief Function for the Timer initialization.
@@ -1109,6 +1290,10 @@ static void on_conn_params_evt(ble_conn_params_evt_t* p_evt)
 
     if ( p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED )
     {
+        if ( ble_link_mode_conn_params_failed() )
+        {
+            return;
+        }
         err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
     }
@@ -1129,6 +1314,12 @@ static void conn_params_init(void)
 {
     ret_code_t err_code;
     ble_conn_params_init_t cp_init;
+    ble_gap_conn_params_t normal_params = {
+        .min_conn_interval = MIN_CONN_INTERVAL,
+        .max_conn_interval = MAX_CONN_INTERVAL,
+        .slave_latency = SLAVE_LATENCY,
+        .conn_sup_timeout = CONN_SUP_TIMEOUT,
+    };
 
     memset(&cp_init, 0, sizeof(cp_init));
 
@@ -1143,6 +1334,9 @@ static void conn_params_init(void)
 
     err_code = ble_conn_params_init(&cp_init);
     APP_ERROR_CHECK(err_code);
+
+    // traffic driven interval control falls back to these
+    ble_link_mode_init(&normal_params);
 }
 
 /**@brief Function for handling advertising events.
@@ -1215,28 +1409,29 @@ static void ble_evt_handler(const ble_evt_t* p_ble_evt, void* p_context)
     case BLE_GAP_EVT_CONNECTED:
         NRF_LOG_DEBUG("%s ---> BLE_GAP_EVT_CONNECTED", __func__);
         {
-            bak_buff[0] = BLE_CMD_CON_STA;
-            bak_buff[1] = BLE_CON_STATUS;
-            send_stm_data(bak_buff, 2);
+            uint8_t st_frame[2] = {BLE_CMD_CON_STA, BLE_CON_STATUS};
+            send_stm_data(st_frame, sizeof(st_frame));
 
             m_peer_to_be_deleted = PM_PEER_ID_INVALID;
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
             err_code = nrf_ble_qwr_conn_handle_assign(&m_qwr, m_conn_handle);
             APP_ERROR_CHECK(err_code);
-            nrf_ble_gatt_data_length_set(&m_gatt, m_conn_handle, BLE_GAP_DATA_LENGTH_DEFAULT);
-            // Start Security Request timer.
+            // data length, PHY and event length are negotiated by ble_link_manage
         }
         break;
 
     case BLE_GAP_EVT_DISCONNECTED:
         NRF_LOG_DEBUG("%s ---> BLE_GAP_EVT_DISCONNECTED", __func__);
         {
+            uint8_t st_frame[2] = {BLE_CMD_CON_STA, BLE_DISCON_STATUS};
+
             bond_check_key_flag = INIT_VALUE;
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
+            ble_tx_reset();
+            fido_rx_reset();
+            spi_read_resume();
 
-            bak_buff[0] = BLE_CMD_CON_STA;
-            bak_buff[1] = BLE_DISCON_STATUS;
-            send_stm_data(bak_buff, 2);
+            send_stm_data(st_frame, sizeof(st_frame));
 
             // Check if the last connected peer had not used MITM, if so, delete its bond information.
             if ( m_peer_to_be_deleted != PM_PEER_ID_INVALID )
@@ -1263,13 +1458,14 @@ static void ble_evt_handler(const ble_evt_t* p_ble_evt, void* p_context)
         NRF_LOG_DEBUG("%s ---> BLE_GAP_EVT_PASSKEY_DISPLAY", __func__);
         {
             char passkey[PASSKEY_LENGTH + 1];
+            uint8_t st_frame[1 + PASSKEY_LENGTH];
             memcpy(passkey, p_ble_evt->evt.gap_evt.params.passkey_display.passkey, PASSKEY_LENGTH);
             passkey[PASSKEY_LENGTH] = 0;
 
             ble_conn_nopair_flag = BLE_PAIR;
-            bak_buff[0] = BLE_CMD_PAIR_CODE;
-            memcpy(&bak_buff[1], passkey, PASSKEY_LENGTH);
-            send_stm_data(bak_buff, 1 + PASSKEY_LENGTH);
+            st_frame[0] = BLE_CMD_PAIR_CODE;
+            memcpy(&st_frame[1], passkey, PASSKEY_LENGTH);
+            send_stm_data(st_frame, sizeof(st_frame));
 
             NRF_LOG_INFO("Passkey: %s", nrf_log_push(passkey));
         }
@@ -1368,6 +1564,10 @@ static void ble_evt_handler(const ble_evt_t* p_ble_evt, void* p_context)
         NRF_LOG_INFO("BLE_GATTS_EVT_HVC");
         break;
 
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+        ble_hvn_tx_complete(p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count);
+        break;
+
     case BLE_GATTC_EVT_HVX:
         NRF_LOG_INFO("BLE_GATTC_EVT_HVX");
         break;
@@ -1397,6 +1597,13 @@ static void ble_evt_handler(const ble_evt_t* p_ble_evt, void* p_context)
         NRF_LOG_INFO("Disconnected");
         // LED indication will be changed when advertising starts.
         m_conn_handle = BLE_CONN_HANDLE_INVALID;
+        ble_tx_reset();
+        fido_rx_reset();
+        spi_read_resume();
+        break;
+
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+        ble_hvn_tx_complete(p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count);
         break;
 
     case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
@@ -1461,6 +1668,14 @@ static void ble_stack_init(void)
     err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
     APP_ERROR_CHECK(err_code);
 
+    // Allow several notifications to be queued per connection event.
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = BLE_HVN_TX_QUEUE_SIZE;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
     // Enable BLE stack.
     err_code = nrf_sdh_ble_enable(&ram_start);
     APP_ERROR_CHECK(err_code);
@@ -1503,358 +1718,645 @@ static void peer_manager_init(void)
 }
 #endif
 
-/**@brief   Function for handling app_uart events.
- *
- * @details This function will receive a single character from the app_uart module and append it to
- *          a string. The string will be be sent over BLE when the last character received was a
- *          'new line' '\n' (hex 0x0A) or if the string has reached the maximum data length.
- */
-/**@snippet [Handling the data received over UART] */
-void uart_event_handle(app_uart_evt_t* p_event)
+static void ble_adv_switch(bool on)
 {
-    static uint8_t index = 0;
-    static uint32_t lenth = 0;
-    uint8_t uart_xor_byte;
-
-    switch ( p_event->evt_type )
+    if ( !on && BLE_ON_ALWAYS == ble_status_flag )
     {
-    case APP_UART_DATA_READY:
-        UNUSED_VARIABLE(app_uart_get(&uart_data_array[index]));
-        index++;
-        // NRF_LOG_INFO("receive uart data.")
-        if ( 1 == index )
-        {
-            if ( UART_TX_TAG != uart_data_array[0] )
-            {
-                index = 0;
-                return;
-            }
-        }
-        else if ( 2 == index )
-        {
-            if ( UART_TX_TAG2 != uart_data_array[1] )
-            {
-                index = 0;
-                return;
-            }
-        }
-        else if ( 3 == index )
-        {
-            if ( (UART_TX_TAG2 == uart_data_array[0]) && (UART_TX_TAG == uart_data_array[1]) )
-            {
-                index = 0;
-                return;
-            }
-        }
-        else if ( 4 == index )
-        {
-            lenth = ((uint32_t)uart_data_array[2] << 8) + uart_data_array[3];
-        }
-        else if ( index >= lenth + 4 )
-        {
-            uart_xor_byte = calcXor(uart_data_array, index - 1);
-            if ( uart_xor_byte != uart_data_array[index - 1] )
-            {
-                index = 0;
-                return;
-            }
-
-            switch ( uart_data_array[4] )
-            {
-            case ST_CMD_BLE:
-                switch ( uart_data_array[5] )
-                {
-                case ST_SEND_OPEN_BLE:
-                    ble_adv_switch_flag = BLE_ON_ALWAYS;
-                    NRF_LOG_INFO("RCV ble always ON.");
-                    break;
-                case ST_SEND_CLOSE_BLE:
-                    ble_adv_switch_flag = BLE_OFF_ALWAYS;
-                    NRF_LOG_INFO("RCV ble always OFF.");
-                    break;
-                case ST_SEND_DISCON_BLE:
-                    ble_conn_flag = BLE_DISCON;
-                    NRF_LOG_INFO("RCV ble flag disconnect.");
-                    break;
-                case ST_GET_BLE_SWITCH_STATUS:
-                    ble_conn_flag = BLE_CON;
-                    break;
-                default:
-                    break;
-                }
-                break;
-            case ST_CMD_POWER:
-                switch ( uart_data_array[5] )
-                {
-                case ST_SEND_CLOSE_SYS_PWR:
-                    pwr_status_flag = PWR_SHUTDOWN_SYS;
-                    break;
-                case ST_SEND_CLOSE_EMMC_PWR:
-                    pwr_status_flag = PWR_CLOSE_EMMC;
-                    break;
-                case ST_SEND_OPEN_EMMC_PWR:
-                    pwr_status_flag = PWR_OPEN_EMMC;
-                    break;
-                case ST_REQ_POWER_PERCENT:
-                    pwr_status_flag = PWR_BAT_PERCENT;
-                    break;
-                case ST_REQ_USB_STATUS:
-                    pwr_status_flag = PWR_USB_STATUS;
-                    break;
-                case ST_REQ_ENABLE_CHARGE:
-                    pmu_feat_charge_enable = true;
-                    pmu_feat_synced = false;
-                    NRF_LOG_INFO("RCV pwr charge enable");
-                    break;
-                case ST_REQ_DISABLE_CHARGE:
-                    pmu_feat_charge_enable = false;
-                    pmu_feat_synced = false;
-                    NRF_LOG_INFO("RCV pwr charge disable");
-                    break;
-                default:
-                    pwr_status_flag = PWR_DEF;
-                    break;
-                }
-                break;
-            case ST_CMD_BLE_INFO:
-                switch ( uart_data_array[5] )
-                {
-                case ST_REQ_ADV_NAME:
-                    trans_info_flag = RESPONESE_NAME;
-                    break;
-                case ST_REQ_FIRMWARE_VER:
-                    trans_info_flag = RESPONESE_VER;
-                    break;
-                case ST_REQ_SOFTDEVICE_VER:
-                    trans_info_flag = RESPONESE_SD_VER;
-                    break;
-                case ST_REQ_BOOTLOADER_VER:
-                    trans_info_flag = RESPONESE_BOOT_VER;
-                    break;
-                case ST_REQ_BUILD_ID:
-                    trans_info_flag = RESPONESE_BUILD_ID;
-                    break;
-                case ST_REQ_HASH:
-                    trans_info_flag = RESPONESE_HASH;
-                    break;
-                case ST_REQ_BT_MAC:
-                    trans_info_flag = RESPONESE_BT_MAC;
-                    break;
-                default:
-                    trans_info_flag = UART_DEF;
-                    break;
-                }
-                break;
-            case ST_CMD_RESET_BLE:
-                if ( ST_VALUE_RESET_BLE == uart_data_array[5] )
-                {
-                    NVIC_SystemReset();
-                }
-                break;
-            case ST_CMD_LED:
-                if ( ST_SEND_GET_LED_BRIGHTNESS == uart_data_array[5] )
-                {
-                    led_brightness_flag = LED_GET_BRIHTNESS;
-                }
-                else if ( ST_SEND_SET_LED_BRIGHTNESS == uart_data_array[5] )
-                {
-                    led_brightness_flag = LED_SET_BRIHTNESS;
-                    led_brightness_value = uart_data_array[6];
-                    led_brightness_synced = false;
-                }
-                break;
-
-            case STM_CMD_BAT:
-                switch ( uart_data_array[5] )
-                {
-                case STM_SEND_BAT_VOL:
-                    bat_msg_flag = SEND_BAT_VOL;
-                    break;
-                case STM_SEND_BAT_CHARGE_CUR:
-                    bat_msg_flag = SEND_BAT_CHARGE_CUR;
-                    break;
-                case STM_SEND_BAT_DISCHARGE_CUR:
-                    bat_msg_flag = SEND_BAT_DISCHARGE_CUR;
-                    break;
-                case STM_SEND_BAT_INNER_TEMP:
-                    bat_msg_flag = SEND_BAT_INNER_TEMP;
-                    break;
-                default:
-                    bat_msg_flag = BAT_DEF;
-                    break;
-                }
-                break;
-            case STM_CMD_KEY:
-                switch ( (uart_data_array[5]) )
-                {
-                case STM_GET_PUBKEY:
-                    trans_info_flag = RESPONESE_BLE_PUBKEY;
-                    break;
-                case STM_LOCK_PUBKEY:
-                    trans_info_flag = RESPONESE_BLE_PUBKEY_LOCK;
-                    break;
-                case STM_REQUEST_SIGN:
-                    trans_info_flag = RESPONESE_BLE_SIGN;
-                    break;
-                default:
-                    break;
-                }
-                break;
-            default:
-                break;
-            }
-            index = 0;
-        }
-        break;
-    // ignore uart error
-    case APP_UART_COMMUNICATION_ERROR:
-        // APP_ERROR_HANDLER(p_event->data.error_communication);
-        break;
-
-    case APP_UART_FIFO_ERROR:
-        // APP_ERROR_HANDLER(p_event->data.error_code);
-        break;
-
-    default:
-        break;
+        // disconnect, stop adv, commit
+        bt_advertising_ctrl(false, true);
+    }
+    else if ( on && BLE_OFF_ALWAYS == ble_status_flag )
+    {
+        bt_advertising_ctrl(true, true);
+        NRF_LOG_INFO("2-Start advertisement.\n");
     }
-    NRF_LOG_FLUSH();
 }
-/**@snippet [Handling the data received over UART] */
 
-/**@brief  Function for initializing the UART module.
- */
-/**@snippet [UART Initialization] */
-static void usr_uart_init(void)
+// replies carry the request id back when the ST tagged the request
+static void st_cmd_reply(const uart_cmd_t* p_cmd, uint8_t* pdata, uint8_t lenth)
 {
-    uint32_t err_code;
-    const app_uart_comm_params_t comm_params = {
-        .rx_pin_no = RX_PIN_NUMBER,
-        .tx_pin_no = TX_PIN_NUMBER,
-        .rts_pin_no = RTS_PIN_NUMBER,
-        .cts_pin_no = CTS_PIN_NUMBER,
-        .flow_control = APP_UART_FLOW_CONTROL_DISABLED,
-        .use_parity = false,
-        .baud_rate = NRF_UARTE_BAUDRATE_115200
-    };
+    uint8_t tagged_buff[sizeof(bak_buff) + 2];
 
-    APP_UART_FIFO_INIT(
-        &comm_params, UART_RX_BUF_SIZE, UART_TX_BUF_SIZE, uart_event_handle, APP_IRQ_PRIORITY_LOWEST, err_code
-    );
-    APP_ERROR_CHECK(err_code);
-    app_uart_is_initialized = true;
+    if ( !p_cmd->tagged )
+    {
+        send_stm_data(pdata, lenth);
+        return;
+    }
+    tagged_buff[0] = UART_RSP_TAGGED;
+    tagged_buff[1] = p_cmd->req_id;
+    memcpy(&tagged_buff[2], pdata, lenth);
+    send_stm_data(tagged_buff, lenth + 2);
 }
 
-/**@brief Function for initializing the Advertising functionality.
- *
- * @details Encodes the required advertising data and passes it to the stack.
- *          Also builds a structure to be passed to the stack when starting advertising.
- */
-static void advertising_init(void)
+static void st_cmd_ble_switch(const uart_cmd_t* p_cmd)
 {
-    uint32_t err_code;
-    ble_advertising_init_t init;
-    // ble_advdata_manuf_data_t   manuf_data;
-    // uint8_t m_addl_adv_manuf_data[MAC_ADDRESS_LENGTH];
-
-    memset(&init, 0, sizeof(init));
-
-    // manuf_data.company_identifier = COMPANY_IDENTIFIER;
-    // manuf_data.data.size          = ADV_ADDL_MANUF_DATA_LEN;
-    // memcpy(m_addl_adv_manuf_data,mac,MAC_ADDRESS_LENGTH);
-    // manuf_data.data.p_data        = m_addl_adv_manuf_data;
+    bool on = (p_cmd->sub == ST_SEND_OPEN_BLE);
 
-    init.advdata.name_type = BLE_ADVDATA_FULL_NAME;
-    init.advdata.include_appearance = false;
-    init.advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
-    init.advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-    init.advdata.uuids_complete.p_uuids = m_adv_uuids;
-    // init.advdata.p_manuf_specific_data = &manuf_data;
+    NRF_LOG_INFO("RCV ble always %s.", on ? "ON" : "OFF");
+    ble_adv_switch(on);
+    bak_buff[0] = BLE_CMD_CON_STA;
+    bak_buff[1] = on ? BLE_ADV_ON_STATUS : BLE_ADV_OFF_STATUS;
+    st_cmd_reply(p_cmd, bak_buff, 2);
+}
 
-    init.config.ble_adv_fast_enabled = true;
-    init.config.ble_adv_fast_interval = APP_ADV_INTERVAL;
-    init.config.ble_adv_fast_timeout = APP_ADV_DURATION;
+static void st_cmd_ble_discon(const uart_cmd_t* p_cmd)
+{
+    NRF_LOG_INFO("RCV ble flag disconnect.");
+    bak_buff[0] = BLE_CMD_CON_STA;
+    bak_buff[1] = BLE_DISCON_STATUS;
+    st_cmd_reply(p_cmd, bak_buff, 2);
 
-    init.evt_handler = on_adv_evt;
+    bt_disconnect();
+}
 
-    err_code = ble_advertising_init(&m_advertising, &init);
-    APP_ERROR_CHECK(err_code);
+static void st_cmd_ble_status(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_CON_STA;
+    bak_buff[1] = ble_status_flag + 2;
+    st_cmd_reply(p_cmd, bak_buff, 2);
+}
 
-    ble_advertising_conn_cfg_tag_set(&m_advertising, APP_BLE_CONN_CFG_TAG);
+static void st_cmd_pwr_off(const uart_cmd_t* p_cmd)
+{
+    if ( ble_status_flag != BLE_OFF_ALWAYS )
+    {
+        bt_disconnect();
+    }
+    pmu_p->SetState(PWR_STATE_HARD_OFF);
 }
 
-uint32_t get_rtc_counter(void)
+static void st_cmd_bat_percent(const uart_cmd_t* p_cmd)
 {
-    return NRF_RTC1->COUNTER;
+    bak_buff[0] = BLE_SYSTEM_POWER_PERCENT;
+    bak_buff[1] = pmu_p->PowerStatus->batteryPercent;
+    st_cmd_reply(p_cmd, bak_buff, 2);
 }
-/**@brief Function for initializing the nrf log module.
- */
-static void log_init(void)
+
+static void st_cmd_power_tlm(const uart_cmd_t* p_cmd)
 {
-    ret_code_t err_code = NRF_LOG_INIT(get_rtc_counter);
-    APP_ERROR_CHECK(err_code);
+    uint8_t len = power_telemetry_snapshot(bak_buff);
 
-    NRF_LOG_DEFAULT_BACKENDS_INIT();
+    st_cmd_reply(p_cmd, bak_buff, len);
 }
 
-/**@brief Function for initializing power management.
- */
-static void power_management_init(void)
+static void st_cmd_pmu_bus(const uart_cmd_t* p_cmd)
 {
-    ret_code_t err_code = nrf_pwr_mgmt_init();
-    APP_ERROR_CHECK(err_code);
+    const PMU_Refresh_Stats_t* p_stats = pmu_p->RefreshStats;
+
+    bak_buff[0] = BLE_CMD_PMU_BUS;
+    uint32_big_encode(p_stats->refreshes, &bak_buff[1]);
+    uint16_big_encode(p_stats->transfers, &bak_buff[5]);
+    uint16_big_encode(p_stats->bus_us, &bak_buff[7]);
+    uint16_big_encode(p_stats->transfers_max, &bak_buff[9]);
+    uint16_big_encode(p_stats->bus_us_max, &bak_buff[11]);
+    st_cmd_reply(p_cmd, bak_buff, 13);
 }
 
-void ble_nus_send(uint8_t* data, uint16_t len)
+static void st_cmd_i2c_health(const uart_cmd_t* p_cmd)
 {
-    uint16_t length = 0;
+    uint8_t len = pmu_bus_health_snapshot(bak_buff);
 
-    NRF_LOG_INFO("ble_nus_send_len: %d", len);
+    st_cmd_reply(p_cmd, bak_buff, len);
+}
+
+// subscribe, the reply is the first full frame
+static void st_cmd_power_tlm_set(const uart_cmd_t* p_cmd)
+{
+    power_tlm_config_t config;
 
-    if ( m_conn_handle == BLE_CONN_HANDLE_INVALID )
+    if ( p_cmd->len < 9 )
     {
+        bak_buff[0] = BLE_CMD_POWER_TLM;
+        bak_buff[1] = BLE_POWER_TLM_REJECTED;
+        st_cmd_reply(p_cmd, bak_buff, 2);
         return;
     }
-
-    ble_nus_send_buf = data;
-    ble_nus_send_len = len;
-
-    length = len > m_ble_gatt_max_data_len ? m_ble_gatt_max_data_len : len;
-    ble_nus_send_offset = length;
-    ble_nus_send_packet(data, length);
+    config.period_s = uint16_big_decode(&p_cmd->data[0]);
+    config.percent = p_cmd->data[2];
+    config.voltage_mv = uint16_big_decode(&p_cmd->data[3]);
+    config.current_ma = uint16_big_decode(&p_cmd->data[5]);
+    config.temp = p_cmd->data[7];
+    config.flags = p_cmd->data[8];
+    power_telemetry_config(&config);
+
+    st_cmd_power_tlm(p_cmd);
 }
 
-/**@brief Function for handling the idle state (main loop).
- *
- * @details If there is no pending log operation, then sleep until next the next event occurs.
- */
-static void idle_state_handle(void)
+static void st_cmd_usb_status(const uart_cmd_t* p_cmd)
 {
-    ret_code_t err_code;
+    bak_buff[0] = BLE_CMD_POWER_STA;
 
-    if ( (BLE_DEF == ble_adv_switch_flag) || (BLE_ON_ALWAYS == ble_adv_switch_flag) )
+    if ( pmu_p->PowerStatus->chargerAvailable )
     {
-        if ( bond_check_key_flag != AUTH_VALUE )
-        {
-            err_code = nrf_ble_lesc_request_handler();
-            APP_ERROR_CHECK(err_code);
-        }
+        // bak_buff[1] =
+        //     ((pmu_p->PowerStatus->chargeFinished && pmu_p->PowerStatus->chargeAllowed) ? BLE_CHARGE_OVER
+        //                                                                                : BLE_CHARGING_PWR);
+        bak_buff[1] = BLE_CHARGING_PWR;
+        bak_buff[2] = (pmu_p->PowerStatus->wiredCharge ? CHARGE_TYPE_USB : CHARGE_TYPE_WIRELESS);
     }
-    if ( NRF_LOG_PROCESS() == false )
+    else
     {
-        nrf_pwr_mgmt_run();
+        bak_buff[1] = BLE_REMOVE_POWER;
+        bak_buff[2] = 0;
     }
+    st_cmd_reply(p_cmd, bak_buff, 3);
 }
 
-void in_gpiote_handler(nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+static void st_cmd_charge(const uart_cmd_t* p_cmd)
 {
-    switch ( pin )
-    {
+    pmu_feat_charge_enable = (p_cmd->sub == ST_REQ_ENABLE_CHARGE);
+    pmu_feat_synced = false;
+    NRF_LOG_INFO("RCV pwr charge %s", pmu_feat_charge_enable ? "enable" : "disable");
+}
+
+static void st_cmd_adv_name(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_ADV_NAME;
+    memcpy(&bak_buff[1], (uint8_t*)ble_adv_name, ADV_NAME_LENGTH);
+    st_cmd_reply(p_cmd, bak_buff, 1 + ADV_NAME_LENGTH);
+}
+
+static void st_cmd_bt_mac(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_BT_MAC;
+    memcpy(&bak_buff[1], (uint8_t*)mac, BLE_GAP_ADDR_LEN);
+    st_cmd_reply(p_cmd, bak_buff, 1 + BLE_GAP_ADDR_LEN);
+}
+
+static void st_cmd_version(const uart_cmd_t* p_cmd)
+{
+    switch ( p_cmd->sub )
+    {
+    case ST_REQ_FIRMWARE_VER:
+        bak_buff[0] = BLE_FIRMWARE_VER;
+        memcpy(&bak_buff[1], FW_REVISION, sizeof(FW_REVISION) - 1);
+        st_cmd_reply(p_cmd, bak_buff, sizeof(FW_REVISION));
+        break;
+    case ST_REQ_SOFTDEVICE_VER:
+        bak_buff[0] = BLE_SOFTDEVICE_VER;
+        memcpy(&bak_buff[1], SW_REVISION, sizeof(SW_REVISION) - 1);
+        st_cmd_reply(p_cmd, bak_buff, sizeof(SW_REVISION));
+        break;
+    case ST_REQ_BOOTLOADER_VER:
+        bak_buff[0] = BLE_BOOTLOADER_VER;
+        memcpy(&bak_buff[1], BT_REVISION, sizeof(BT_REVISION) - 1);
+        st_cmd_reply(p_cmd, bak_buff, sizeof(BT_REVISION));
+        break;
+    default:
+        break;
+    }
+}
+
+static void st_cmd_build_id(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_BUILD_ID;
+    memcpy(&bak_buff[1], (uint8_t*)BUILD_ID, 7);
+    st_cmd_reply(p_cmd, bak_buff, 8);
+}
+
+static void st_cmd_hash(const uart_cmd_t* p_cmd)
+{
+    ret_code_t err_code = NRF_SUCCESS;
+    nrf_crypto_backend_hash_context_t hash_context = {0};
+    uint8_t hash[32] = {0};
+    size_t hash_len = 32;
+    int chunks = 0;
+    int app_size = 0;
+    uint8_t* code_addr = (uint8_t*)0x26000;
+    uint8_t* code_len = (uint8_t*)0x7F018;
+    app_size = code_len[0] + code_len[1] * 256 + code_len[2] * 256 * 256;
+    chunks = app_size / 512;
+
+    err_code = nrf_crypto_hash_init(&hash_context, &g_nrf_crypto_hash_sha256_info);
+    APP_ERROR_CHECK(err_code);
+    for ( int i = 0; i < chunks; i++ )
+    {
+        err_code = nrf_crypto_hash_update(&hash_context, code_addr + i * 512, 512);
+        APP_ERROR_CHECK(err_code);
+    }
+    if ( app_size % 512 )
+    {
+        err_code = nrf_crypto_hash_update(&hash_context, code_addr + chunks * 512, app_size % 512);
+        APP_ERROR_CHECK(err_code);
+    }
+    err_code = nrf_crypto_hash_finalize(&hash_context, hash, &hash_len);
+    APP_ERROR_CHECK(err_code);
+
+    bak_buff[0] = BLE_CMD_HASH;
+    memcpy(&bak_buff[1], hash, 32);
+    st_cmd_reply(p_cmd, bak_buff, 33);
+}
+
+static void st_cmd_reset(const uart_cmd_t* p_cmd)
+{
+    NVIC_SystemReset();
+}
+
+static void st_cmd_led(const uart_cmd_t* p_cmd)
+{
+    if ( p_cmd->sub == ST_SEND_SET_LED_BRIGHTNESS )
+    {
+        led_brightness_value = p_cmd->data[0];
+        led_brightness_synced = false;
+    }
+    bak_buff[0] = BLE_CMD_FLASH_LED_STA;
+    bak_buff[1] = p_cmd->sub;
+    bak_buff[2] = led_brightness_value;
+    st_cmd_reply(p_cmd, bak_buff, 3);
+}
+
+static void st_cmd_bat_msg(const uart_cmd_t* p_cmd)
+{
+    uint16_t val = 0;
+
+    switch ( p_cmd->sub )
+    {
+    case STM_SEND_BAT_VOL:
+        val = pmu_p->PowerStatus->batteryVoltage;
+        break;
+    case STM_SEND_BAT_CHARGE_CUR:
+        val = pmu_p->PowerStatus->chargeCurrent;
+        break;
+    case STM_SEND_BAT_DISCHARGE_CUR:
+        val = pmu_p->PowerStatus->dischargeCurrent;
+        break;
+    case STM_SEND_BAT_INNER_TEMP:
+        val = (uint16_t)(pmu_p->PowerStatus->batteryTemp);
+        break;
+    default:
+        return;
+    }
+
+    bak_buff[0] = BLE_CMD_BAT_CV_MSG;
+    bak_buff[1] = p_cmd->sub;
+
+    bak_buff[2] = (val & 0xFF00) >> 8;
+    bak_buff[3] = (val & 0x00FF);
+
+    st_cmd_reply(p_cmd, bak_buff, 4);
+}
+
+static void st_cmd_pubkey(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_KEY_RESP;
+    if ( deviceConfig_p->keystore.flag_locked == DEVICE_CONFIG_FLAG_MAGIC )
+    {
+        bak_buff[1] = BLE_KEY_RESP_FAILED;
+        st_cmd_reply(p_cmd, bak_buff, 2);
+    }
+    else if ( !deviceCfg_keystore_validate(&(deviceConfig_p->keystore)) )
+    {
+        bak_buff[1] = BLE_KEY_RESP_FAILED;
+        st_cmd_reply(p_cmd, bak_buff, 2);
+    }
+    else
+    {
+        bak_buff[1] = BLE_KEY_RESP_PUBKEY;
+        memcpy(&bak_buff[2], deviceConfig_p->keystore.public_key, sizeof(deviceConfig_p->keystore.public_key));
+        st_cmd_reply(p_cmd, bak_buff, sizeof(deviceConfig_p->keystore.public_key) + 2);
+    }
+}
+
+static void st_cmd_pubkey_lock(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_KEY_RESP;
+    bak_buff[1] =
+        ((deviceCfg_keystore_lock(&(deviceConfig_p->keystore)) && device_config_commit()) ? BLE_KEY_RESP_SUCCESS
+                                                                                          : BLE_KEY_RESP_FAILED);
+    st_cmd_reply(p_cmd, bak_buff, 2);
+}
+
+static void st_cmd_sign(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_KEY_RESP;
+    if ( !deviceCfg_keystore_validate(&(deviceConfig_p->keystore)) )
+    {
+        bak_buff[1] = BLE_KEY_RESP_FAILED;
+        st_cmd_reply(p_cmd, bak_buff, 2);
+    }
+    else
+    {
+        bak_buff[1] = BLE_KEY_RESP_SIGN;
+        if ( deviceConfig_p->keystore.flag_locked != DEVICE_CONFIG_FLAG_MAGIC )
+        {
+            deviceCfg_keystore_lock(&(deviceConfig_p->keystore));
+            device_config_commit();
+        }
+        sign_ecdsa_msg(deviceConfig_p->keystore.private_key, (uint8_t*)p_cmd->data, p_cmd->len, bak_buff + 2);
+        st_cmd_reply(p_cmd, bak_buff, 64 + 2);
+    }
+}
+
+static void st_cmd_spi_caps(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_SPI_CAPS;
+    bak_buff[1] = spi_link_caps_get();
+    st_cmd_reply(p_cmd, bak_buff, 2);
+}
+
+static void st_cmd_fido_stats(const uart_cmd_t* p_cmd)
+{
+    ble_fido_tx_stats_t fido_stats;
+
+    ble_fido_tx_stats_get(&fido_stats);
+    bak_buff[0] = BLE_CMD_FIDO_STATS;
+    uint16_big_encode(fido_stats.fragment_len, &bak_buff[1]);
+    uint32_big_encode(fido_stats.messages, &bak_buff[3]);
+    uint32_big_encode(fido_stats.fragments, &bak_buff[7]);
+    uint32_big_encode(fido_stats.aborted, &bak_buff[11]);
+    uint16_big_encode(fido_stats.last_ms, &bak_buff[15]);
+    uint16_big_encode(fido_stats.max_ms, &bak_buff[17]);
+    bak_buff[19] = fido_stats.burst_max;
+    st_cmd_reply(p_cmd, bak_buff, 20);
+}
+
+static void st_cmd_tx_hist(const uart_cmd_t* p_cmd)
+{
+    ble_tx_chan_stats_t chan_stats;
+    uint8_t ch = p_cmd->len ? p_cmd->data[0] : BLE_TX_CH_NUS;
+
+    ble_tx_chan_stats_get(ch, &chan_stats);
+    bak_buff[0] = BLE_CMD_TX_HIST;
+    bak_buff[1] = ch;
+    uint32_big_encode(chan_stats.messages, &bak_buff[2]);
+    uint16_big_encode(chan_stats.max_ms, &bak_buff[6]);
+    for ( uint8_t i = 0; i < BLE_TX_HIST_BUCKETS; i++ )
+    {
+        uint16_big_encode(chan_stats.hist[i], &bak_buff[8 + i * 2]);
+    }
+    st_cmd_reply(p_cmd, bak_buff, 8 + BLE_TX_HIST_BUCKETS * 2);
+}
+
+static void st_cmd_spi_set(const uart_cmd_t* p_cmd)
+{
+    bool ok = false;
+
+    switch ( p_cmd->sub )
+    {
+    case ST_SPI_SET_CRC:
+        ok = spi_link_crc_set(p_cmd->data[0]);
+        break;
+    case ST_SPI_SET_FRAME:
+        ok = spi_link_frame_set(p_cmd->data[0]);
+        break;
+    case ST_SPI_SET_FIDO_STREAM:
+        ok = fido_stream_set(p_cmd->data[0]);
+        break;
+    default:
+        break;
+    }
+
+    bak_buff[0] = BLE_CMD_SPI_CFG;
+    bak_buff[1] = p_cmd->sub;
+    bak_buff[2] = ok ? VALUE_SECCESS : VALUE_FAILED;
+    st_cmd_reply(p_cmd, bak_buff, 3);
+}
+
+static void st_cmd_spi_stats(const uart_cmd_t* p_cmd)
+{
+    spi_link_stats_t spi_stats;
+
+    spi_link_stats_get(&spi_stats);
+    bak_buff[0] = BLE_CMD_SPI_CFG;
+    bak_buff[1] = ST_SPI_GET_STATS;
+    bak_buff[2] = spi_stats.crc_mode;
+    uint32_big_encode(spi_stats.frequency, &bak_buff[3]);
+    uint32_big_encode(spi_stats.crc_errors, &bak_buff[7]);
+    uint32_big_encode(spi_stats.naks_received, &bak_buff[11]);
+    uint32_big_encode(spi_stats.retransmits, &bak_buff[15]);
+    st_cmd_reply(p_cmd, bak_buff, 19);
+}
+
+static void st_cmd_uart_rate(const uart_cmd_t* p_cmd)
+{
+    bool rate_ok = uart_trans_rate_supported(p_cmd->data[0], p_cmd->data[1]);
+
+    // answer at the old rate, the ST switches once it has the reply
+    bak_buff[0] = BLE_CMD_UART_CFG;
+    bak_buff[1] = ST_UART_SET_RATE;
+    bak_buff[2] = rate_ok ? VALUE_SECCESS : VALUE_FAILED;
+    st_cmd_reply(p_cmd, bak_buff, 3);
+    if ( rate_ok )
+    {
+        uart_trans_rate_set(p_cmd->data[0], p_cmd->data[1]);
+    }
+}
+
+static void st_cmd_uart_loopback(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_UART_CFG;
+    bak_buff[1] = ST_UART_LOOPBACK;
+    memcpy(&bak_buff[2], p_cmd->data, p_cmd->len);
+    st_cmd_reply(p_cmd, bak_buff, 2 + p_cmd->len);
+}
+
+static void st_cmd_uart_commit(const uart_cmd_t* p_cmd)
+{
+    bak_buff[0] = BLE_CMD_UART_CFG;
+    bak_buff[1] = ST_UART_COMMIT;
+    bak_buff[2] = uart_trans_rate_commit() ? VALUE_SECCESS : VALUE_FAILED;
+    st_cmd_reply(p_cmd, bak_buff, 3);
+}
+
+static void st_cmd_uart_stats(const uart_cmd_t* p_cmd)
+{
+    uart_trans_stats_t uart_stats;
+
+    uart_trans_stats_get(&uart_stats);
+    bak_buff[0] = BLE_CMD_UART_CFG;
+    bak_buff[1] = ST_UART_GET_STATS;
+    bak_buff[2] = uart_stats.rate;
+    bak_buff[3] = uart_stats.flags;
+    uint32_big_encode(uart_stats.frames_rx, &bak_buff[4]);
+    uint32_big_encode(uart_stats.xor_errors + uart_stats.len_errors, &bak_buff[8]);
+    uint32_big_encode(uart_stats.hw_errors + uart_stats.overruns, &bak_buff[12]);
+    uint32_big_encode(uart_stats.fallbacks, &bak_buff[16]);
+    uint32_big_encode(uart_stats.cmds_dropped, &bak_buff[20]);
+    uint32_big_encode(uart_stats.cmds_unknown, &bak_buff[24]);
+    bak_buff[28] = uart_stats.cmds_queued_max;
+    uint32_big_encode(uart_stats.tx_frames, &bak_buff[29]);
+    uint32_big_encode(uart_stats.tx_dropped, &bak_buff[33]);
+    bak_buff[37] = uart_stats.tx_queued_max;
+    st_cmd_reply(p_cmd, bak_buff, 38);
+}
+
+// ST command table, looked up by (cmd, sub) from the main loop
+static const uart_cmd_entry_t st_cmd_table[] = {
+    {ST_CMD_BLE, ST_SEND_OPEN_BLE, st_cmd_ble_switch},
+    {ST_CMD_BLE, ST_SEND_CLOSE_BLE, st_cmd_ble_switch},
+    {ST_CMD_BLE, ST_SEND_DISCON_BLE, st_cmd_ble_discon},
+    {ST_CMD_BLE, ST_GET_BLE_SWITCH_STATUS, st_cmd_ble_status},
+    {ST_CMD_POWER, ST_SEND_CLOSE_SYS_PWR, st_cmd_pwr_off},
+    {ST_CMD_POWER, ST_REQ_POWER_PERCENT, st_cmd_bat_percent},
+    {ST_CMD_POWER, ST_REQ_USB_STATUS, st_cmd_usb_status},
+    {ST_CMD_POWER, ST_REQ_ENABLE_CHARGE, st_cmd_charge},
+    {ST_CMD_POWER, ST_REQ_DISABLE_CHARGE, st_cmd_charge},
+    {ST_CMD_POWER, ST_REQ_POWER_TLM, st_cmd_power_tlm},
+    {ST_CMD_POWER, ST_REQ_PMU_BUS, st_cmd_pmu_bus},
+    {ST_CMD_POWER, ST_REQ_I2C_HEALTH, st_cmd_i2c_health},
+    {ST_CMD_POWER, ST_SET_POWER_TLM, st_cmd_power_tlm_set},
+    {ST_CMD_BLE_INFO, ST_REQ_ADV_NAME, st_cmd_adv_name},
+    {ST_CMD_BLE_INFO, ST_REQ_FIRMWARE_VER, st_cmd_version},
+    {ST_CMD_BLE_INFO, ST_REQ_SOFTDEVICE_VER, st_cmd_version},
+    {ST_CMD_BLE_INFO, ST_REQ_BOOTLOADER_VER, st_cmd_version},
+    {ST_CMD_BLE_INFO, ST_REQ_BUILD_ID, st_cmd_build_id},
+    {ST_CMD_BLE_INFO, ST_REQ_HASH, st_cmd_hash},
+    {ST_CMD_BLE_INFO, ST_REQ_BT_MAC, st_cmd_bt_mac},
+    {ST_CMD_BLE_INFO, ST_REQ_SPI_CAPS, st_cmd_spi_caps},
+    {ST_CMD_BLE_INFO, ST_REQ_FIDO_STATS, st_cmd_fido_stats},
+    {ST_CMD_BLE_INFO, ST_REQ_TX_HIST, st_cmd_tx_hist},
+    {ST_CMD_RESET_BLE, ST_VALUE_RESET_BLE, st_cmd_reset},
+    {ST_CMD_LED, ST_SEND_SET_LED_BRIGHTNESS, st_cmd_led},
+    {ST_CMD_LED, ST_SEND_GET_LED_BRIGHTNESS, st_cmd_led},
+    {STM_CMD_BAT, STM_SEND_BAT_VOL, st_cmd_bat_msg},
+    {STM_CMD_BAT, STM_SEND_BAT_CHARGE_CUR, st_cmd_bat_msg},
+    {STM_CMD_BAT, STM_SEND_BAT_DISCHARGE_CUR, st_cmd_bat_msg},
+    {STM_CMD_BAT, STM_SEND_BAT_INNER_TEMP, st_cmd_bat_msg},
+    {STM_CMD_KEY, STM_GET_PUBKEY, st_cmd_pubkey},
+    {STM_CMD_KEY, STM_LOCK_PUBKEY, st_cmd_pubkey_lock},
+    {STM_CMD_KEY, STM_REQUEST_SIGN, st_cmd_sign},
+    {ST_CMD_SPI_CFG, ST_SPI_SET_CRC, st_cmd_spi_set},
+    {ST_CMD_SPI_CFG, ST_SPI_GET_STATS, st_cmd_spi_stats},
+    {ST_CMD_SPI_CFG, ST_SPI_SET_FRAME, st_cmd_spi_set},
+    {ST_CMD_SPI_CFG, ST_SPI_SET_FIDO_STREAM, st_cmd_spi_set},
+    {ST_CMD_UART_CFG, ST_UART_SET_RATE, st_cmd_uart_rate},
+    {ST_CMD_UART_CFG, ST_UART_LOOPBACK, st_cmd_uart_loopback},
+    {ST_CMD_UART_CFG, ST_UART_COMMIT, st_cmd_uart_commit},
+    {ST_CMD_UART_CFG, ST_UART_GET_STATS, st_cmd_uart_stats},
+};
+
+/**@brief  Function for initializing the UART module.
+ */
+/**@snippet [UART Initialization] */
+static void uart_rate_fallback_handle(void)
+{
+    uint8_t notice[2] = {BLE_CMD_UART_CFG, ST_UART_FALLBACK};
+
+    send_stm_data(notice, sizeof(notice));
+}
+
+static void usr_uart_init(void)
+{
+    APP_ERROR_CHECK(uart_trans_init(st_cmd_table, ARRAY_SIZE(st_cmd_table), uart_rate_fallback_handle));
+}
+
+/**@brief Function for initializing the Advertising functionality.
+ *
+ * @details Encodes the required advertising data and passes it to the stack.
+ *          Also builds a structure to be passed to the stack when starting advertising.
+ */
+static void advertising_init(void)
+{
+    uint32_t err_code;
+    ble_advertising_init_t init;
+    // ble_advdata_manuf_data_t   manuf_data;
+    // uint8_t m_addl_adv_manuf_data[MAC_ADDRESS_LENGTH];
+
+    memset(&init, 0, sizeof(init));
+
+    // manuf_data.company_identifier = COMPANY_IDENTIFIER;
+    // manuf_data.data.size          = ADV_ADDL_MANUF_DATA_LEN;
+    // memcpy(m_addl_adv_manuf_data,mac,MAC_ADDRESS_LENGTH);
+    // manuf_data.data.p_data        = m_addl_adv_manuf_data;
+
+    init.advdata.name_type = BLE_ADVDATA_FULL_NAME;
+    init.advdata.include_appearance = false;
+    init.advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+    init.advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+    init.advdata.uuids_complete.p_uuids = m_adv_uuids;
+    // init.advdata.p_manuf_specific_data = &manuf_data;
+
+    init.config.ble_adv_fast_enabled = true;
+    init.config.ble_adv_fast_interval = APP_ADV_INTERVAL;
+    init.config.ble_adv_fast_timeout = APP_ADV_DURATION;
+
+    init.evt_handler = on_adv_evt;
+
+    err_code = ble_advertising_init(&m_advertising, &init);
+    APP_ERROR_CHECK(err_code);
+
+    ble_advertising_conn_cfg_tag_set(&m_advertising, APP_BLE_CONN_CFG_TAG);
+}
+
+uint32_t get_rtc_counter(void)
+{
+    return NRF_RTC1->COUNTER;
+}
+/**@brief Function for initializing the nrf log module.
+ */
+static void log_init(void)
+{
+    ret_code_t err_code = NRF_LOG_INIT(get_rtc_counter);
+    APP_ERROR_CHECK(err_code);
+
+    NRF_LOG_DEFAULT_BACKENDS_INIT();
+}
+
+/**@brief Function for initializing power management.
+ */
+static void power_management_init(void)
+{
+    ret_code_t err_code = nrf_pwr_mgmt_init();
+    APP_ERROR_CHECK(err_code);
+}
+
+void ble_nus_send(uint8_t* data, uint16_t len)
+{
+    NRF_LOG_INFO("ble_nus_send_len: %d", len);
+
+    if ( m_conn_handle == BLE_CONN_HANDLE_INVALID || len == 0 )
+    {
+        spi_recv_buf_release(data);
+        return;
+    }
+
+    // TX complete runs in SoftDevice interrupt context and pumps the same buffer
+    CRITICAL_REGION_ENTER();
+    if ( !ble_tx_chan_put(BLE_TX_CH_NUS, data, len, &ble_nus_send_buf, &ble_nus_send_len, &ble_nus_send_offset) )
+    {
+        NRF_LOG_WARNING("nus message dropped, channel full");
+        spi_recv_buf_release(data);
+    }
+    ble_tx_schedule();
+    CRITICAL_REGION_EXIT();
+}
+
+/**@brief Function for handling the idle state (main loop).
+ *
+ * @details If there is no pending log operation, then sleep until next the next event occurs.
+ */
+static void idle_state_handle(void)
+{
+    ret_code_t err_code;
+
+    if ( (BLE_DEF == ble_adv_switch_flag) || (BLE_ON_ALWAYS == ble_adv_switch_flag) )
+    {
+        if ( bond_check_key_flag != AUTH_VALUE )
+        {
+            err_code = nrf_ble_lesc_request_handler();
+            APP_ERROR_CHECK(err_code);
+        }
+    }
+    if ( NRF_LOG_PROCESS() == false )
+    {
+        nrf_pwr_mgmt_run();
+    }
+}
+
+void in_gpiote_handler(nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    switch ( pin )
+    {
     case SLAVE_SPI_RSP_IO:
         NRF_LOG_INFO("GPIO IRQ -> SLAVE_SPI_RSP_IO");
-        if ( spi_dir_out )
+        if ( spi_read_hw_edge_taken() )
+        {
+            // PPI already started the header read on this edge
+        }
+        else if ( spi_dir_out )
         {
             spi_dir_out = false;
+            spi_read_hw_arm();
         }
         else if ( nrf_gpio_pin_read(SLAVE_SPI_RSP_IO) == 0 && !spi_dir_out )
         {
@@ -1885,32 +2387,16 @@ static void gpio_init(void)
     nrf_gpio_cfg_input(PMIC_IRQ_IO, NRF_GPIO_PIN_PULLUP);
 }
 
-static uint8_t calcXor(uint8_t* buf, uint8_t len)
+// framed and copied into the TX ring before this returns, any context may call it with a frame
+// in its own buffer, bak_buff is for the main loop st_cmd replies only
+static void send_stm_data(uint8_t* pdata, uint8_t lenth)
 {
-    uint8_t tmp = 0;
-    uint8_t i;
+    ret_code_t err_code = uart_trans_send(pdata, lenth);
 
-    for ( i = 0; i < len; i++ )
+    if ( err_code != NRF_SUCCESS )
     {
-        tmp ^= buf[i];
+        NRF_LOG_WARNING("st frame 0x%02x dropped, 0x%x", pdata[0], err_code);
     }
-    return tmp;
-}
-static void uart_put_data(uint8_t* pdata, uint8_t lenth)
-{
-    app_uart_put_data(pdata, lenth);
-}
-
-static void send_stm_data(uint8_t* pdata, uint8_t lenth)
-{
-    uart_trans_buff[0] = UART_TX_TAG2;
-    uart_trans_buff[1] = UART_TX_TAG;
-    uart_trans_buff[2] = 0x00;
-    uart_trans_buff[3] = lenth + 1;
-    memcpy(&uart_trans_buff[4], pdata, lenth);
-    uart_trans_buff[uart_trans_buff[3] + 3] = calcXor(uart_trans_buff, (uart_trans_buff[3] + 3));
-
-    uart_put_data(uart_trans_buff, uart_trans_buff[3] + 4);
 }
 
 static bool bt_disconnect()
@@ -1961,232 +2447,29 @@ static bool bt_advertising_ctrl(bool enable, bool commit)
     return true;
 }
 
-static void rsp_st_uart_cmd(void* p_event_data, uint16_t event_size)
-{
-    if ( trans_info_flag == DEF_RESP )
-    {
-        return;
-    }
-
-    memset(bak_buff, 0x00, sizeof(bak_buff));
-    switch ( trans_info_flag )
-    {
-    case RESPONESE_NAME:
-        bak_buff[0] = BLE_CMD_ADV_NAME;
-        memcpy(&bak_buff[1], (uint8_t*)ble_adv_name, ADV_NAME_LENGTH);
-        send_stm_data(bak_buff, 1 + ADV_NAME_LENGTH);
-        break;
-
-    case RESPONESE_BT_MAC:
-        bak_buff[0] = BLE_CMD_BT_MAC;
-        memcpy(&bak_buff[1], (uint8_t*)mac, BLE_GAP_ADDR_LEN);
-        send_stm_data(bak_buff, 1 + BLE_GAP_ADDR_LEN);
-        trans_info_flag = DEF_RESP;
-        break;
-
-    case RESPONESE_VER:
-        bak_buff[0] = BLE_FIRMWARE_VER;
-        memcpy(&bak_buff[1], FW_REVISION, sizeof(FW_REVISION) - 1);
-        send_stm_data(bak_buff, sizeof(FW_REVISION));
-        break;
-
-    case RESPONESE_SD_VER:
-        bak_buff[0] = BLE_SOFTDEVICE_VER;
-        memcpy(&bak_buff[1], SW_REVISION, sizeof(SW_REVISION) - 1);
-        send_stm_data(bak_buff, sizeof(SW_REVISION));
-        break;
-
-    case RESPONESE_BOOT_VER:
-        bak_buff[0] = BLE_BOOTLOADER_VER;
-        memcpy(&bak_buff[1], BT_REVISION, sizeof(BT_REVISION) - 1);
-        send_stm_data(bak_buff, sizeof(BT_REVISION));
-        break;
-
-    case RESPONESE_BLE_PUBKEY:
-        bak_buff[0] = BLE_CMD_KEY_RESP;
-        if ( deviceConfig_p->keystore.flag_locked == DEVICE_CONFIG_FLAG_MAGIC )
-        {
-            bak_buff[1] = BLE_KEY_RESP_FAILED;
-            send_stm_data(bak_buff, 2);
-        }
-        else if ( !deviceCfg_keystore_validate(&(deviceConfig_p->keystore)) )
-        {
-            bak_buff[1] = BLE_KEY_RESP_FAILED;
-            send_stm_data(bak_buff, 2);
-        }
-        else
-        {
-            bak_buff[1] = BLE_KEY_RESP_PUBKEY;
-            memcpy(&bak_buff[2], deviceConfig_p->keystore.public_key, sizeof(deviceConfig_p->keystore.public_key));
-            send_stm_data(bak_buff, sizeof(deviceConfig_p->keystore.public_key) + 2);
-        }
-        break;
-
-    case RESPONESE_BLE_PUBKEY_LOCK:
-        bak_buff[0] = BLE_CMD_KEY_RESP;
-        bak_buff[1] =
-            ((deviceCfg_keystore_lock(&(deviceConfig_p->keystore)) && device_config_commit()) ? BLE_KEY_RESP_SUCCESS
-                                                                                              : BLE_KEY_RESP_FAILED);
-        send_stm_data(bak_buff, 2);
-        break;
-
-    case RESPONESE_BLE_SIGN:
-        uint32_t msg_len = (uart_data_array[2] << 8 | uart_data_array[3]) - 3;
-        bak_buff[0] = BLE_CMD_KEY_RESP;
-        if ( !deviceCfg_keystore_validate(&(deviceConfig_p->keystore)) )
-        {
-            bak_buff[1] = BLE_KEY_RESP_FAILED;
-            send_stm_data(bak_buff, 2);
-        }
-        else
-        {
-            bak_buff[1] = BLE_KEY_RESP_SIGN;
-            if ( deviceConfig_p->keystore.flag_locked != DEVICE_CONFIG_FLAG_MAGIC )
-            {
-                deviceCfg_keystore_lock(&(deviceConfig_p->keystore));
-                device_config_commit();
-            }
-            sign_ecdsa_msg(deviceConfig_p->keystore.private_key, uart_data_array + 6, msg_len, bak_buff + 2);
-            send_stm_data(bak_buff, 64 + 2);
-        }
-        break;
-
-    case RESPONESE_BUILD_ID:
-        bak_buff[0] = BLE_CMD_BUILD_ID;
-        memcpy(&bak_buff[1], (uint8_t*)BUILD_ID, 7);
-        send_stm_data(bak_buff, 8);
-        break;
-
-    case RESPONESE_HASH:
-        ret_code_t err_code = NRF_SUCCESS;
-        nrf_crypto_backend_hash_context_t hash_context = {0};
-        uint8_t hash[32] = {0};
-        size_t hash_len = 32;
-        int chunks = 0;
-        int app_size = 0;
-        uint8_t* code_addr = (uint8_t*)0x26000;
-        uint8_t* code_len = (uint8_t*)0x7F018;
-        app_size = code_len[0] + code_len[1] * 256 + code_len[2] * 256 * 256;
-        chunks = app_size / 512;
-
-        err_code = nrf_crypto_hash_init(&hash_context, &g_nrf_crypto_hash_sha256_info);
-        APP_ERROR_CHECK(err_code);
-        for ( int i = 0; i < chunks; i++ )
-        {
-            err_code = nrf_crypto_hash_update(&hash_context, code_addr + i * 512, 512);
-            APP_ERROR_CHECK(err_code);
-        }
-        if ( app_size % 512 )
-        {
-            err_code = nrf_crypto_hash_update(&hash_context, code_addr + chunks * 512, app_size % 512);
-            APP_ERROR_CHECK(err_code);
-        }
-        err_code = nrf_crypto_hash_finalize(&hash_context, hash, &hash_len);
-        APP_ERROR_CHECK(err_code);
-
-        bak_buff[0] = BLE_CMD_HASH;
-        memcpy(&bak_buff[1], hash, 32);
-        send_stm_data(bak_buff, 33);
-        break;
-    default:
-        break;
-    }
-    trans_info_flag = DEF_RESP;
-}
 static void manage_bat_level(void* p_event_data, uint16_t event_size)
 {
     static uint8_t bak_bat_persent = 0x00;
 
     if ( bak_bat_persent != pmu_p->PowerStatus->batteryPercent )
     {
+        uint8_t st_frame[2] = {BLE_SYSTEM_POWER_PERCENT, pmu_p->PowerStatus->batteryPercent};
+
         bak_bat_persent = pmu_p->PowerStatus->batteryPercent;
-        bak_buff[0] = BLE_SYSTEM_POWER_PERCENT;
-        bak_buff[1] = pmu_p->PowerStatus->batteryPercent;
-        send_stm_data(bak_buff, 2);
+        send_stm_data(st_frame, sizeof(st_frame));
     }
 }
 static void ble_ctl_process(void* p_event_data, uint16_t event_size)
 {
-    if ( BLE_OFF_ALWAYS == ble_adv_switch_flag )
-    {
-        ble_adv_switch_flag = BLE_DEF;
-        if ( BLE_ON_ALWAYS == ble_status_flag )
-        {
-            // disconnect, stop adv, commit
-            bt_advertising_ctrl(false, true);
-        }
-        bak_buff[0] = BLE_CMD_CON_STA;
-        bak_buff[1] = BLE_ADV_OFF_STATUS;
-        send_stm_data(bak_buff, 2);
-    }
-    else if ( BLE_ON_ALWAYS == ble_adv_switch_flag )
-    {
-        ble_adv_switch_flag = BLE_DEF;
-        if ( BLE_OFF_ALWAYS == ble_status_flag )
-        {
-            bt_advertising_ctrl(true, true);
-            NRF_LOG_INFO("2-Start advertisement.\n");
-        }
-
-        bak_buff[0] = BLE_CMD_CON_STA;
-        bak_buff[1] = BLE_ADV_ON_STATUS;
-        send_stm_data(bak_buff, 2);
-    }
-
-    if ( BLE_DISCON == ble_conn_flag )
+    // switch requested from the phone side, report it to the ST
+    if ( BLE_OFF_ALWAYS == ble_adv_switch_flag || BLE_ON_ALWAYS == ble_adv_switch_flag )
     {
-        ble_conn_flag = BLE_DEF;
-        bak_buff[0] = BLE_CMD_CON_STA;
-        bak_buff[1] = BLE_DISCON_STATUS;
-        send_stm_data(bak_buff, 2);
+        bool on = (BLE_ON_ALWAYS == ble_adv_switch_flag);
+        uint8_t st_frame[2] = {BLE_CMD_CON_STA, on ? BLE_ADV_ON_STATUS : BLE_ADV_OFF_STATUS};
 
-        bt_disconnect();
-    }
-    if ( BLE_CON == ble_conn_flag )
-    {
-        ble_conn_flag = BLE_DEF;
-        bak_buff[0] = BLE_CMD_CON_STA;
-        bak_buff[1] = ble_status_flag + 2;
-        send_stm_data(bak_buff, 2);
-    }
-
-    switch ( pwr_status_flag )
-    {
-    case PWR_SHUTDOWN_SYS:
-        pwr_status_flag = PWR_DEF;
-        if ( ble_status_flag != BLE_OFF_ALWAYS )
-        {
-            bt_disconnect();
-        }
-        pmu_p->SetState(PWR_STATE_HARD_OFF);
-        break;
-    case PWR_BAT_PERCENT:
-        pwr_status_flag = PWR_DEF;
-        bak_buff[0] = BLE_SYSTEM_POWER_PERCENT;
-        bak_buff[1] = pmu_p->PowerStatus->batteryPercent;
-        send_stm_data(bak_buff, 2);
-        break;
-    case PWR_USB_STATUS:
-        pwr_status_flag = PWR_DEF;
-        bak_buff[0] = BLE_CMD_POWER_STA;
-
-        if ( pmu_p->PowerStatus->chargerAvailable )
-        {
-            // bak_buff[1] =
-            //     ((pmu_p->PowerStatus->chargeFinished && pmu_p->PowerStatus->chargeAllowed) ? BLE_CHARGE_OVER
-            //                                                                                : BLE_CHARGING_PWR);
-            bak_buff[1] = BLE_CHARGING_PWR;
-            bak_buff[2] = (pmu_p->PowerStatus->wiredCharge ? CHARGE_TYPE_USB : CHARGE_TYPE_WIRELESS);
-        }
-        else
-        {
-            bak_buff[1] = BLE_REMOVE_POWER;
-            bak_buff[2] = 0;
-        }
-        send_stm_data(bak_buff, 3);
-        break;
-    default:
-        break;
+        ble_adv_switch_flag = BLE_DEF;
+        ble_adv_switch(on);
+        send_stm_data(st_frame, sizeof(st_frame));
     }
 }
 
@@ -2208,6 +2491,7 @@ static inline void pmu_status_print()
     NRF_LOG_INFO("chargeCurrent=%lu", pmu_p->PowerStatus->chargeCurrent);
     NRF_LOG_INFO("dischargeCurrent=%lu", pmu_p->PowerStatus->dischargeCurrent);
     NRF_LOG_INFO("irqSnapshot=0x%08x", pmu_p->PowerStatus->irqSnapshot);
+    NRF_LOG_INFO("refresh transfers=%u bus_us=%u", pmu_p->RefreshStats->transfers, pmu_p->RefreshStats->bus_us);
     NRF_LOG_INFO("=== ============== ===");
     NRF_LOG_FLUSH();
 }
@@ -2238,6 +2522,24 @@ static void pmu_status_refresh(void* p_event_data, uint16_t event_size)
     pmu_status_print();
 }
 
+// both lines are handled on their edges, the debounce steps run from the scheduler and are paced by app_timer
+static volatile bool pmu_irq_debouncing = false;
+// neither the scheduler nor app_timer took the step, the main loop posts it on its next pass
+static volatile bool pmu_irq_retry = false;
+static volatile bool pmu_pwrok_retry = false;
+
+static void pmu_step_start(app_timer_id_t timer_id, volatile bool* p_retry)
+{
+    if ( app_timer_start(timer_id, PMU_DEBOUNCE_INTERVAL, NULL) != NRF_SUCCESS )
+        *p_retry = true;
+}
+
+static void pmu_event_post(app_sched_event_handler_t handler, app_timer_id_t timer_id, volatile bool* p_retry)
+{
+    if ( app_sched_event_put(NULL, 0, handler) != NRF_SUCCESS )
+        pmu_step_start(timer_id, p_retry); // queue full, try again on the next step
+}
+
 static void pmu_pwrok_pull(void* p_event_data, uint16_t event_size)
 {
     static uint8_t match_count = 0;
@@ -2256,6 +2558,8 @@ static void pmu_pwrok_pull(void* p_event_data, uint16_t event_size)
             NRF_LOG_INFO("PowerOK debounce, match reset");
             NRF_LOG_FLUSH();
         }
+        // line is fine, wait for the next edge
+        return;
     }
 
     if ( (match_count >= match_required) )
@@ -2264,50 +2568,135 @@ static void pmu_pwrok_pull(void* p_event_data, uint16_t event_size)
         NRF_LOG_FLUSH();
         enter_low_power_mode();
     }
+
+    pmu_step_start(m_pmu_pwrok_timer_id, &pmu_pwrok_retry);
 }
 
 static void pmu_irq_pull(void* p_event_data, uint16_t event_size)
 {
-    if ( !nrf_gpio_pin_read(PMIC_IRQ_IO) )
+    // wait charger status stabilize before process irq
+    // chargerAvailable may take few ms to be set in some case
+    static Power_Status_t pwr_status_temp;
+    static uint8_t match_count;
+    const uint8_t match_required = 3;
+
+    if ( !pmu_irq_debouncing )
     {
+        if ( nrf_gpio_pin_read(PMIC_IRQ_IO) )
+            return;
+
         PRINT_CURRENT_LOCATION();
+        memset(&pwr_status_temp, 0, sizeof(pwr_status_temp));
+        match_count = 0;
+        pmu_irq_debouncing = true;
+    }
 
-        // wait charger status stabilize before process irq
-        // chargerAvailable may take few ms to be set in some case
+    while ( match_count < match_required )
+    {
+        pmu_p->PullStatus();
 
-        Power_Status_t pwr_status_temp = {0};
-        uint8_t match_count = 0;
-        const uint8_t match_required = 3;
-        while ( match_count < match_required )
+        if ( (pwr_status_temp.chargerAvailable == pmu_p->PowerStatus->chargerAvailable) &&
+             (pwr_status_temp.wiredCharge == pmu_p->PowerStatus->wiredCharge) &&
+             (pwr_status_temp.wirelessCharge == pmu_p->PowerStatus->wirelessCharge) )
         {
-            pmu_p->PullStatus();
+            match_count++;
+            NRF_LOG_INFO("PowerStatus debounce, match %u/%u", match_count, match_required);
 
-            if ( (pwr_status_temp.chargerAvailable == pmu_p->PowerStatus->chargerAvailable) &&
-                 (pwr_status_temp.wiredCharge == pmu_p->PowerStatus->wiredCharge) &&
-                 (pwr_status_temp.wirelessCharge == pmu_p->PowerStatus->wirelessCharge) )
-            {
-                match_count++;
-                NRF_LOG_INFO("PowerStatus debounce, match %u/%u", match_count, match_required);
+            continue;
+        }
+        else
+        {
+            match_count = 0;
+            NRF_LOG_INFO("PowerStatus debounce, match reset");
+
+            pwr_status_temp.chargerAvailable = pmu_p->PowerStatus->chargerAvailable;
+            pwr_status_temp.wiredCharge = pmu_p->PowerStatus->wiredCharge;
+            pwr_status_temp.wirelessCharge = pmu_p->PowerStatus->wirelessCharge;
+            // resume on the next step instead of blocking the loop
+            pmu_step_start(m_pmu_irq_timer_id, &pmu_irq_retry);
+            return;
+        }
+    }
+    pmu_irq_debouncing = false;
+    pmu_status_synced = true;
+    pmu_status_print();
+    pmu_p->Irq();
 
-                continue;
-            }
-            else
-            {
-                match_count = 0;
-                NRF_LOG_INFO("PowerStatus debounce, match reset");
+    // the line is level triggered, anything raised while we were busy keeps it low without a new edge
+    pmu_step_start(m_pmu_irq_timer_id, &pmu_irq_retry);
+}
 
-                pwr_status_temp.chargerAvailable = pmu_p->PowerStatus->chargerAvailable;
-                pwr_status_temp.wiredCharge = pmu_p->PowerStatus->wiredCharge;
-                pwr_status_temp.wirelessCharge = pmu_p->PowerStatus->wirelessCharge;
-                nrf_delay_ms(10);
-            }
-        }
-        pmu_status_synced = true;
-        pmu_status_print();
-        pmu_p->Irq();
+static void pmu_irq_timeout_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    pmu_event_post(pmu_irq_pull, m_pmu_irq_timer_id, &pmu_irq_retry);
+}
+
+static void pmu_pwrok_timeout_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    pmu_event_post(pmu_pwrok_pull, m_pmu_pwrok_timer_id, &pmu_pwrok_retry);
+}
+
+static void pmu_gpiote_handler(nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    switch ( pin )
+    {
+    case PMIC_IRQ_IO:
+        if ( !pmu_irq_debouncing )
+            pmu_event_post(pmu_irq_pull, m_pmu_irq_timer_id, &pmu_irq_retry);
+        break;
+    case PMIC_PWROK_IO:
+        pmu_event_post(pmu_pwrok_pull, m_pmu_pwrok_timer_id, &pmu_pwrok_retry);
+        break;
+    default:
+        break;
     }
 }
 
+// main loop pass, steps that could not be scheduled from interrupt context
+static void pmu_event_process(void)
+{
+    if ( pmu_irq_retry )
+    {
+        pmu_irq_retry = false;
+        pmu_event_post(pmu_irq_pull, m_pmu_irq_timer_id, &pmu_irq_retry);
+    }
+    if ( pmu_pwrok_retry )
+    {
+        pmu_pwrok_retry = false;
+        pmu_event_post(pmu_pwrok_pull, m_pmu_pwrok_timer_id, &pmu_pwrok_retry);
+    }
+}
+
+// needs the scheduler and app_timer, pins stay plain inputs from gpio_init until then
+static void pmu_event_init(void)
+{
+    ret_code_t err_code;
+
+    err_code = app_timer_create(&m_pmu_irq_timer_id, APP_TIMER_MODE_SINGLE_SHOT, pmu_irq_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_create(&m_pmu_pwrok_timer_id, APP_TIMER_MODE_SINGLE_SHOT, pmu_pwrok_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    // port events, no gpiote channel held and no extra current while asleep
+    nrfx_gpiote_in_config_t irq_config = NRFX_GPIOTE_CONFIG_IN_SENSE_HITOLO(false);
+    irq_config.pull = NRF_GPIO_PIN_PULLUP;
+    err_code = nrfx_gpiote_in_init(PMIC_IRQ_IO, &irq_config, pmu_gpiote_handler);
+    APP_ERROR_CHECK(err_code);
+    nrfx_gpiote_in_event_enable(PMIC_IRQ_IO, true);
+
+    nrfx_gpiote_in_config_t pwrok_config = NRFX_GPIOTE_CONFIG_IN_SENSE_TOGGLE(false);
+    pwrok_config.pull = NRF_GPIO_PIN_NOPULL;
+    err_code = nrfx_gpiote_in_init(PMIC_PWROK_IO, &pwrok_config, pmu_gpiote_handler);
+    APP_ERROR_CHECK(err_code);
+    nrfx_gpiote_in_event_enable(PMIC_PWROK_IO, true);
+
+    // lines may already be low, edges before this point were not seen
+    pmu_event_post(pmu_irq_pull, m_pmu_irq_timer_id, &pmu_irq_retry);
+    pmu_event_post(pmu_pwrok_pull, m_pmu_pwrok_timer_id, &pmu_pwrok_retry);
+}
+
 static void pmu_sys_voltage_monitor(void* p_event_data, uint16_t event_size)
 {
     static uint8_t match_count = 0;
@@ -2360,24 +2749,6 @@ static void pmu_sys_voltage_monitor(void* p_event_data, uint16_t event_size)
 
 static void led_ctl_process(void* p_event_data, uint16_t event_size)
 {
-    // handle commands
-    if ( ST_SEND_SET_LED_BRIGHTNESS == led_brightness_flag )
-    {
-        bak_buff[0] = BLE_CMD_FLASH_LED_STA;
-        bak_buff[1] = led_brightness_flag;
-        bak_buff[2] = led_brightness_value;
-        send_stm_data(bak_buff, 3);
-        led_brightness_flag = LED_DEF;
-    }
-    else if ( ST_SEND_GET_LED_BRIGHTNESS == led_brightness_flag )
-    {
-        bak_buff[0] = BLE_CMD_FLASH_LED_STA;
-        bak_buff[1] = led_brightness_flag;
-        bak_buff[2] = led_brightness_value;
-        send_stm_data(bak_buff, 3);
-        led_brightness_flag = LED_DEF;
-    }
-
     // keep controller in sync
     if ( !led_brightness_synced )
     {
@@ -2386,40 +2757,6 @@ static void led_ctl_process(void* p_event_data, uint16_t event_size)
     }
 }
 
-static void bat_msg_report_process(void* p_event_data, uint16_t event_size)
-{
-
-    uint16_t val = 0;
-
-    switch ( bat_msg_flag )
-    {
-    case SEND_BAT_VOL:
-        val = pmu_p->PowerStatus->batteryVoltage;
-        break;
-    case SEND_BAT_CHARGE_CUR:
-        val = pmu_p->PowerStatus->chargeCurrent;
-        break;
-    case SEND_BAT_DISCHARGE_CUR:
-        val = pmu_p->PowerStatus->dischargeCurrent;
-        break;
-    case SEND_BAT_INNER_TEMP:
-        val = (uint16_t)(pmu_p->PowerStatus->batteryTemp);
-        break;
-    default:
-        return;
-    }
-
-    bak_buff[0] = BLE_CMD_BAT_CV_MSG;
-    bak_buff[1] = bat_msg_flag;
-
-    bak_buff[2] = (val & 0xFF00) >> 8;
-    bak_buff[3] = (val & 0x00FF);
-
-    send_stm_data(bak_buff, 4);
-
-    bat_msg_flag = BAT_DEF;
-}
-
 static void scheduler_init(void)
 {
     APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
@@ -2460,6 +2797,19 @@ int main(void)
     nrf_crypto_init();
     // ==> Power Manage IC, LED Driver, and Device Configs
     CRITICAL_REGION_ENTER();
+    // device config init, before the pmu as it holds the BROM verified marker
+    EXEC_RETRY(
+        3, {}, { return device_config_init(); },
+        {
+            NRF_LOG_INFO("Config Init Success");
+            NRF_LOG_FLUSH();
+        },
+        {
+            NRF_LOG_INFO("Config Init Fail");
+            NRF_LOG_FLUSH();
+            enter_low_power_mode(); // something wrong, shutdown to prevent battery drain
+        }
+    );
     // pmu init
     EXEC_RETRY(
         10, { set_send_stm_data_p(send_stm_data); },
@@ -2483,19 +2833,6 @@ int main(void)
     );
     // soft power off ST until self init done
     // pmu_p->SetState(PWR_STATE_SOFT_OFF);
-    // device config init
-    EXEC_RETRY(
-        3, {}, { return device_config_init(); },
-        {
-            NRF_LOG_INFO("Config Init Success");
-            NRF_LOG_FLUSH();
-        },
-        {
-            NRF_LOG_INFO("Config Init Fail");
-            NRF_LOG_FLUSH();
-            enter_low_power_mode(); // something wrong, shutdown to prevent battery drain
-        }
-    );
     CRITICAL_REGION_EXIT();
 
     // ###############################
@@ -2515,6 +2852,7 @@ int main(void)
     usr_spim_init();
     timers_init();
     scheduler_init();
+    pmu_event_init();
     watch_dog_init();
 
     // ###############################
@@ -2574,15 +2912,15 @@ int main(void)
     for ( ;; )
     {
         pmu_sys_voltage_monitor(NULL, 0);
-        pmu_pwrok_pull(NULL, 0);
-        pmu_irq_pull(NULL, 0);
         pmu_status_refresh(NULL, 0);
         pmu_req_process(NULL, 0);
+        pmu_event_process();
+        power_telemetry_process();
+        spi_xfer_process();
         ble_ctl_process(NULL, 0);
-        rsp_st_uart_cmd(NULL, 0);
+        uart_trans_cmd_process();
         manage_bat_level(NULL, 0);
         led_ctl_process(NULL, 0);
-        bat_msg_report_process(NULL, 0);
         // event exec
         app_sched_execute();
         // idle
@@ -4,7 +4,9 @@
 #include "power_manage.h"
 
 #include "nrf_i2c.h"
+#include "device_config.h"
 
+#include "app_timer.h"
 #include "nrf_delay.h"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
@@ -23,6 +25,25 @@ void set_send_stm_data_p(void (*send_stm_data_p_)(uint8_t* pdata, uint8_t lenth)
 static PMU_Interface_t pmu_if;
 PMU_t* pmu_p = NULL;
 
+// telemetry, values as the frame carries them
+typedef struct
+{
+    uint8_t state;
+    uint8_t percent;
+    uint16_t bat_vol;
+    uint16_t sys_vol;
+    int16_t bat_temp;
+    uint16_t pmu_temp;
+    uint16_t charge_cur;
+    uint16_t discharge_cur;
+} power_tlm_values_t;
+
+static power_tlm_config_t tlm_config;
+static power_tlm_values_t tlm_reported; // what the ST has seen last, field by field
+static uint32_t tlm_last_ticks = 0;
+static uint32_t tlm_elapsed_ticks = 0; // since the last full frame
+static uint8_t tlm_seq = 0;
+
 // ================================
 // functions private
 
@@ -152,6 +173,118 @@ static void pmu_if_irq(const uint64_t irq)
     }
 }
 
+static void power_tlm_values_get(power_tlm_values_t* p_values)
+{
+    const Power_Status_t* p_status = pmu_p->PowerStatus;
+
+    p_values->state = (p_status->batteryPresent ? POWER_TLM_STATE_BATT_PRESENT : 0) |
+                      (p_status->chargeAllowed ? POWER_TLM_STATE_CHARGE_ALLOWED : 0) |
+                      (p_status->chargerAvailable ? POWER_TLM_STATE_CHARGER : 0) |
+                      (p_status->chargeFinished ? POWER_TLM_STATE_CHARGE_FINISHED : 0) |
+                      (p_status->wiredCharge ? POWER_TLM_STATE_WIRED : 0) |
+                      (p_status->wirelessCharge ? POWER_TLM_STATE_WIRELESS : 0);
+    p_values->percent = p_status->batteryPercent;
+    p_values->bat_vol = p_status->batteryVoltage;
+    p_values->sys_vol = p_status->sysVoltage;
+    p_values->bat_temp = p_status->batteryTemp;
+    p_values->pmu_temp = p_status->pmuTemp;
+    p_values->charge_cur = p_status->chargeCurrent;
+    p_values->discharge_cur = p_status->dischargeCurrent;
+}
+
+static bool power_tlm_moved(int32_t now, int32_t reported, uint16_t threshold)
+{
+    int32_t diff = (now > reported) ? (now - reported) : (reported - now);
+
+    return diff != 0 && diff >= threshold;
+}
+
+static uint8_t power_tlm_changed(const power_tlm_values_t* p_now)
+{
+    uint8_t mask = 0;
+
+    if ( p_now->state != tlm_reported.state )
+        mask |= POWER_TLM_FIELD_STATE;
+    if ( power_tlm_moved(p_now->percent, tlm_reported.percent, tlm_config.percent) )
+        mask |= POWER_TLM_FIELD_PERCENT;
+    if ( power_tlm_moved(p_now->bat_vol, tlm_reported.bat_vol, tlm_config.voltage_mv) )
+        mask |= POWER_TLM_FIELD_BAT_VOL;
+    if ( power_tlm_moved(p_now->sys_vol, tlm_reported.sys_vol, tlm_config.voltage_mv) )
+        mask |= POWER_TLM_FIELD_SYS_VOL;
+    if ( power_tlm_moved(p_now->bat_temp, tlm_reported.bat_temp, tlm_config.temp) )
+        mask |= POWER_TLM_FIELD_BAT_TEMP;
+    if ( power_tlm_moved(p_now->pmu_temp, tlm_reported.pmu_temp, tlm_config.temp) )
+        mask |= POWER_TLM_FIELD_PMU_TEMP;
+    if ( power_tlm_moved(p_now->charge_cur, tlm_reported.charge_cur, tlm_config.current_ma) )
+        mask |= POWER_TLM_FIELD_CHARGE_CUR;
+    if ( power_tlm_moved(p_now->discharge_cur, tlm_reported.discharge_cur, tlm_config.current_ma) )
+        mask |= POWER_TLM_FIELD_DISCHARGE_CUR;
+
+    return mask;
+}
+
+static uint8_t power_tlm_put_u16(uint8_t* p_buf, uint8_t len, uint16_t val)
+{
+    p_buf[len++] = (val & 0xFF00) >> 8;
+    p_buf[len++] = (val & 0x00FF);
+    return len;
+}
+
+// fields go out big endian in bit order, whatever is sent becomes the new reference
+static uint8_t power_tlm_encode(uint8_t* p_buf, uint8_t kind, uint8_t mask, const power_tlm_values_t* p_now)
+{
+    uint8_t len = 0;
+
+    p_buf[len++] = BLE_CMD_POWER_TLM;
+    p_buf[len++] = kind;
+    p_buf[len++] = BLE_POWER_TLM_VERSION;
+    p_buf[len++] = tlm_seq++;
+    p_buf[len++] = mask;
+
+    if ( mask & POWER_TLM_FIELD_STATE )
+    {
+        p_buf[len++] = p_now->state;
+        tlm_reported.state = p_now->state;
+    }
+    if ( mask & POWER_TLM_FIELD_PERCENT )
+    {
+        p_buf[len++] = p_now->percent;
+        tlm_reported.percent = p_now->percent;
+    }
+    if ( mask & POWER_TLM_FIELD_BAT_VOL )
+    {
+        len = power_tlm_put_u16(p_buf, len, p_now->bat_vol);
+        tlm_reported.bat_vol = p_now->bat_vol;
+    }
+    if ( mask & POWER_TLM_FIELD_SYS_VOL )
+    {
+        len = power_tlm_put_u16(p_buf, len, p_now->sys_vol);
+        tlm_reported.sys_vol = p_now->sys_vol;
+    }
+    if ( mask & POWER_TLM_FIELD_BAT_TEMP )
+    {
+        len = power_tlm_put_u16(p_buf, len, (uint16_t)p_now->bat_temp);
+        tlm_reported.bat_temp = p_now->bat_temp;
+    }
+    if ( mask & POWER_TLM_FIELD_PMU_TEMP )
+    {
+        len = power_tlm_put_u16(p_buf, len, p_now->pmu_temp);
+        tlm_reported.pmu_temp = p_now->pmu_temp;
+    }
+    if ( mask & POWER_TLM_FIELD_CHARGE_CUR )
+    {
+        len = power_tlm_put_u16(p_buf, len, p_now->charge_cur);
+        tlm_reported.charge_cur = p_now->charge_cur;
+    }
+    if ( mask & POWER_TLM_FIELD_DISCHARGE_CUR )
+    {
+        len = power_tlm_put_u16(p_buf, len, p_now->discharge_cur);
+        tlm_reported.discharge_cur = p_now->discharge_cur;
+    }
+
+    return len;
+}
+
 static bool pmu_if_gpio_config(uint32_t pin_num, const Power_GPIO_Config_t config)
 {
     switch ( config )
@@ -222,6 +355,21 @@ static bool pmu_if_gpio_read(uint32_t pin_num, bool* const high_low)
     return false;
 }
 
+static bool pmu_if_brom_marker_get(uint32_t* const table_hash)
+{
+    if ( deviceConfig_p == NULL )
+        return false;
+    return deviceCfg_pmu_brom_verified(&(deviceConfig_p->pmu), table_hash);
+}
+
+static bool pmu_if_brom_marker_set(const uint32_t table_hash)
+{
+    if ( deviceConfig_p == NULL )
+        return false;
+    deviceCfg_pmu_brom_mark(&(deviceConfig_p->pmu), table_hash);
+    return device_config_commit();
+}
+
 #ifdef PMU_LOG_NRF_LOG
 static void pmu_if_log(const Power_LogLevel_t level, const char* fmt, ...)
 {
@@ -311,14 +459,19 @@ bool power_manage_init()
     pmu_if.HighDriveStrengthCtrl = i2c_handle->HighDriveStrengthCtrl;
     pmu_if.Send = i2c_handle->Send;
     pmu_if.Receive = i2c_handle->Receive;
+    pmu_if.BusStats = i2c_handle->BusStats;
     pmu_if.Irq = pmu_if_irq;
     pmu_if.Reg.Write = i2c_handle->Reg.Write;
     pmu_if.Reg.Read = i2c_handle->Reg.Read;
+    pmu_if.Reg.ReadBurst = i2c_handle->Reg.ReadBurst;
     pmu_if.Reg.SetBits = i2c_handle->Reg.SetBits;
     pmu_if.Reg.ClrBits = i2c_handle->Reg.ClrBits;
+    pmu_if.Reg.WriteAsync = i2c_handle->Reg.WriteAsync;
     pmu_if.GPIO.Config = pmu_if_gpio_config;
     pmu_if.GPIO.Write = pmu_if_gpio_write;
     pmu_if.GPIO.Read = pmu_if_gpio_read;
+    pmu_if.BromMarker.Get = pmu_if_brom_marker_get;
+    pmu_if.BromMarker.Set = pmu_if_brom_marker_set;
     pmu_if.Delay_ms = nrf_delay_ms;
     pmu_if.Log = pmu_if_log;
 
@@ -332,9 +485,14 @@ bool power_manage_init()
     if ( pmu_p->Init() != PWR_ERROR_NONE )
         return false;
 
-    // config
+    // config, timed on the cycle counter as app_timer is not running yet
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    uint32_t config_cycles = DWT->CYCCNT;
     if ( pmu_p->Config() != PWR_ERROR_NONE )
         return false;
+    config_cycles = DWT->CYCCNT - config_cycles;
+    NRF_LOG_INFO("pmu config took %lu ms", config_cycles / (SystemCoreClock / 1000));
 
     return true;
 }
@@ -353,9 +511,91 @@ bool power_manage_deinit()
     // interface
     memset(&pmu_if, 0x00, sizeof(PMU_Interface_t));
 
+    // telemetry
+    memset(&tlm_config, 0x00, sizeof(power_tlm_config_t));
+
     return true;
 }
 
+void power_telemetry_config(const power_tlm_config_t* p_config)
+{
+    tlm_config = *p_config;
+    tlm_last_ticks = app_timer_cnt_get();
+    tlm_elapsed_ticks = 0;
+}
+
+// full frame for a request, the subscription counts it as sent
+uint8_t power_telemetry_snapshot(uint8_t* p_buf)
+{
+    power_tlm_values_t now;
+
+    power_tlm_values_get(&now);
+    tlm_elapsed_ticks = 0;
+    return power_tlm_encode(p_buf, BLE_POWER_TLM_FULL, POWER_TLM_FIELD_ALL, &now);
+}
+
+// main loop, pushes a frame when a field moved past its threshold or the period ran out
+void power_telemetry_process(void)
+{
+    power_tlm_values_t now;
+    uint8_t frame[POWER_TLM_FRAME_MAX];
+    uint8_t len;
+    uint8_t mask;
+    uint32_t ticks;
+
+    if ( pmu_p == NULL || send_stm_data_p == NULL || tlm_config.period_s == 0 )
+        return;
+
+    // rtc counter wraps every few minutes, accumulate instead of comparing against a start
+    ticks = app_timer_cnt_get();
+    tlm_elapsed_ticks += app_timer_cnt_diff_compute(ticks, tlm_last_ticks);
+    tlm_last_ticks = ticks;
+
+    power_tlm_values_get(&now);
+    mask = power_tlm_changed(&now);
+
+    if ( tlm_elapsed_ticks >= APP_TIMER_TICKS((uint32_t)tlm_config.period_s * 1000) ||
+         (mask != 0 && !(tlm_config.flags & POWER_TLM_FLAG_DELTA)) )
+    {
+        len = power_telemetry_snapshot(frame);
+    }
+    else if ( mask != 0 )
+    {
+        len = power_tlm_encode(frame, BLE_POWER_TLM_DELTA, mask, &now);
+    }
+    else
+        return;
+
+    send_stm_data_p(frame, len);
+}
+
+// whole bus, not only the pmu, the flash led driver shares it
+uint8_t pmu_bus_health_snapshot(uint8_t* p_buf)
+{
+    I2C_t* i2c_handle = nrf_i2c_get_instance();
+    I2C_Device_Stats_t stats;
+    uint8_t len = 0;
+    uint8_t count = 0;
+
+    p_buf[len++] = BLE_CMD_I2C_HEALTH;
+    len = power_tlm_put_u16(p_buf, len, i2c_handle->SpeedGet());
+    len++; // device count, filled below
+
+    while ( count < I2C_HEALTH_DEVICE_MAX && i2c_handle->DeviceStats(count, &stats) )
+    {
+        p_buf[len++] = stats.device_addr;
+        len = power_tlm_put_u16(p_buf, len, (uint16_t)(stats.transfers >> 16));
+        len = power_tlm_put_u16(p_buf, len, (uint16_t)stats.transfers);
+        len = power_tlm_put_u16(p_buf, len, stats.nacks);
+        len = power_tlm_put_u16(p_buf, len, stats.timeouts);
+        len = power_tlm_put_u16(p_buf, len, stats.bus_clears);
+        count++;
+    }
+    p_buf[3] = count;
+
+    return len;
+}
+
 void axp_reg_dump(uint8_t pmu_addr)
 {
     uint8_t val = 0x99;
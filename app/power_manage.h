@@ -32,6 +32,46 @@
 #define BLE_CMD_POWER_ERR__BATT_OVER_VOLTAGE 0x04
 #define BLE_CMD_POWER_ERR__CHARGE_TIMEOUT    0x05
 
+// whole power status in one frame: kind, version, seq, field mask, then the fields in mask order
+#define BLE_CMD_POWER_TLM                    0x17
+#define BLE_POWER_TLM_FULL                   0x01
+#define BLE_POWER_TLM_DELTA                  0x02 // only the fields that moved past their threshold
+#define BLE_POWER_TLM_REJECTED               0x03 // subscription not taken, kind is the whole frame
+#define BLE_POWER_TLM_VERSION                0x01
+#define POWER_TLM_FIELD_STATE                (1 << 0) // u8, POWER_TLM_STATE_* bits
+#define POWER_TLM_FIELD_PERCENT              (1 << 1) // u8
+#define POWER_TLM_FIELD_BAT_VOL              (1 << 2) // u16 mV
+#define POWER_TLM_FIELD_SYS_VOL              (1 << 3) // u16 mV
+#define POWER_TLM_FIELD_BAT_TEMP             (1 << 4) // s16
+#define POWER_TLM_FIELD_PMU_TEMP             (1 << 5) // u16
+#define POWER_TLM_FIELD_CHARGE_CUR           (1 << 6) // u16 mA
+#define POWER_TLM_FIELD_DISCHARGE_CUR        (1 << 7) // u16 mA
+#define POWER_TLM_FIELD_ALL                  0xFF
+#define POWER_TLM_STATE_BATT_PRESENT         (1 << 0)
+#define POWER_TLM_STATE_CHARGE_ALLOWED       (1 << 1)
+#define POWER_TLM_STATE_CHARGER              (1 << 2)
+#define POWER_TLM_STATE_CHARGE_FINISHED      (1 << 3)
+#define POWER_TLM_STATE_WIRED                (1 << 4)
+#define POWER_TLM_STATE_WIRELESS             (1 << 5)
+#define POWER_TLM_FRAME_MAX                  19
+#define POWER_TLM_FLAG_DELTA                 0x01
+
+// i2c cost of the status refresh: refreshes32, then transfers16 and bus_us16 of the last one and their maximum
+#define BLE_CMD_PMU_BUS                      0x1A
+// i2c bus health: speed_khz16, count, then per device addr, transfers32, nacks16, timeouts16, bus_clears16
+#define BLE_CMD_I2C_HEALTH                   0x1B
+#define I2C_HEALTH_DEVICE_MAX                4
+
+typedef struct
+{
+    uint16_t period_s;   // full frame at least this often, 0 unsubscribes
+    uint8_t percent;     // change thresholds, a field is reported once it moved this far
+    uint16_t voltage_mv; // battery and system voltage
+    uint16_t current_ma; // charge and discharge current
+    uint8_t temp;        // battery and pmu temperature
+    uint8_t flags;       // POWER_TLM_FLAG_*
+} power_tlm_config_t;
+
 // pmu handle
 extern PMU_t* pmu_p;
 
@@ -39,6 +79,11 @@ void set_send_stm_data_p(void (*send_stm_data_p_)(uint8_t* pdata, uint8_t lenth)
 
 bool power_manage_init();
 bool power_manage_deinit();
+
+void power_telemetry_config(const power_tlm_config_t* p_config);
+uint8_t power_telemetry_snapshot(uint8_t* p_buf);
+void power_telemetry_process(void);
+uint8_t pmu_bus_health_snapshot(uint8_t* p_buf);
 void axp_reg_dump(uint8_t pmu_addr);
 // void axp2101_brom_dump();
 
@@ -0,0 +1,623 @@
+// own headers
+#include "uart_transmission.h"
+
+// std library
+#include <string.h>
+
+// sdk
+#include "app_error.h"
+#include "app_scheduler.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "ble_nus.h"
+#include "nrf_atfifo.h"
+#include "nrf_atomic.h"
+#include "nrf_delay.h"
+#include "nrf_libuarte_async.h"
+#include "nrf_queue.h"
+#define NRF_LOG_MODULE_NAME UartTrans
+#include "nrf_log.h"
+#include "nrf_log_ctrl.h"
+NRF_LOG_MODULE_REGISTER();
+
+#define UART_RX_PIN 11
+#define UART_TX_PIN 12
+// flow control lines, leave disconnected on boards without them routed to the ST,
+// wiring them also needs NRF_LIBUARTE_DRV_HWFC_ENABLED in sdk_config.h
+#ifndef UART_RTS_PIN
+  #define UART_RTS_PIN NRF_UARTE_PSEL_DISCONNECTED
+#endif
+#ifndef UART_CTS_PIN
+  #define UART_CTS_PIN NRF_UARTE_PSEL_DISCONNECTED
+#endif
+#define UART_HWFC_AVAILABLE \
+    (UART_RTS_PIN != NRF_UARTE_PSEL_DISCONNECTED && UART_CTS_PIN != NRF_UARTE_PSEL_DISCONNECTED)
+
+#define UART_TX_WAIT_MS         10
+#define UART_TX_WAIT_MAX        50
+#define UART_PROBATION_TIMEOUT  APP_TIMER_TICKS(1000) // new rate has to be committed within this
+#define UART_FALLBACK_ERRORS    4                     // bad frames in a row before dropping the rate
+
+// one port per rate, dma buffers sized for the byte rate, a few character times of rx timeout
+// both share UARTE0, TIMER1 counting bytes and RTC2 running the timeout, only one is open at a time
+NRF_LIBUARTE_ASYNC_DEFINE(m_libuarte_std, 0, 1, 2, NRF_LIBUARTE_PERIPHERAL_NOT_USED, 64, 3);
+NRF_LIBUARTE_ASYNC_DEFINE(m_libuarte_fast, 0, 1, 2, NRF_LIBUARTE_PERIPHERAL_NOT_USED, 255, 4);
+
+typedef struct
+{
+    const nrf_libuarte_async_t* p_port;
+    nrf_uarte_baudrate_t baudrate;
+    uint32_t timeout_us;
+} uart_rate_cfg_t;
+
+static const uart_rate_cfg_t uart_rate_cfg[UART_RATE_COUNT] = {
+    [UART_RATE_115200] = {&m_libuarte_std, NRF_UARTE_BAUDRATE_115200, 300},
+    [UART_RATE_1M] = {&m_libuarte_fast, NRF_UARTE_BAUDRATE_1000000, 64},
+};
+
+APP_TIMER_DEF(m_uart_probation_timer);
+static bool uart_timer_created = false;
+
+NRF_QUEUE_DEF(uart_cmd_t, m_uart_cmd_queue, UART_CMD_QUEUE_SIZE, NRF_QUEUE_MODE_NO_OVERFLOW);
+static const uart_cmd_entry_t* p_uart_cmd_table = NULL;
+static uint8_t uart_cmd_count = 0;
+
+typedef struct
+{
+    uint8_t len;
+    uint8_t frame[UART_TX_FRAME_MAX];
+} uart_tx_item_t;
+
+// any context reserves and fills a slot, only the owner of uart_tx_active takes them out
+NRF_ATFIFO_DEF(m_uart_tx_fifo, uart_tx_item_t, UART_TX_QUEUE_SIZE);
+static nrf_atfifo_item_get_t uart_tx_get_ctx;
+static uart_tx_item_t* p_uart_tx_item = NULL; // frame on the wire
+static nrf_atomic_flag_t uart_tx_active = 0;  // a transfer runs or is about to start
+static nrf_atomic_flag_t uart_tx_pending = 0; // frames may be waiting, owner has to look again
+static nrf_atomic_u32_t uart_tx_queued = 0;   // reserved and not yet sent
+
+static const nrf_libuarte_async_t* p_uart_port = NULL;
+static uart_fallback_handler_t uart_fallback_handler = NULL;
+static uint8_t uart_rate = UART_RATE_115200;
+static uint8_t uart_flags = 0;
+static volatile bool uart_probation = false; // rate switched, waiting for the commit
+static volatile bool uart_fallback_posted = false;
+static uint8_t uart_err_streak = 0;
+
+// frame assembly, dma chunks do not line up with frames
+static uint8_t uart_frame_buf[UART_FRAME_MAX_LEN];
+static uint16_t uart_frame_index = 0;
+static uint16_t uart_frame_len = 0; // whole frame, known once the head is in
+
+static uart_trans_stats_t uart_stats;
+
+static void uart_fallback(void* p_event_data, uint16_t event_size);
+
+static uint8_t uart_frame_xor(const uint8_t* p_buf, uint16_t len)
+{
+    uint8_t tmp = 0;
+
+    while ( len-- )
+    {
+        tmp ^= *p_buf++;
+    }
+    return tmp;
+}
+
+static void uart_link_error(void)
+{
+    uart_frame_index = 0;
+
+    if ( uart_rate == UART_RATE_115200 && uart_flags == 0 )
+    {
+        return;
+    }
+    if ( ++uart_err_streak >= UART_FALLBACK_ERRORS && !uart_fallback_posted )
+    {
+        uart_fallback_posted = (app_sched_event_put(NULL, 0, uart_fallback) == NRF_SUCCESS);
+    }
+}
+
+// cut a checked frame into a command and queue it, plain or tagged with a request id
+static void uart_cmd_queue(const uint8_t* p_frame, uint16_t len)
+{
+    uart_cmd_t cmd = {0};
+    const uint8_t* p_body = p_frame + UART_FRAME_HEAD_LEN;
+    uint16_t body_len = len - UART_FRAME_HEAD_LEN - 1; // xor
+
+    if ( body_len >= 1 && p_body[0] == UART_CMD_TAGGED )
+    {
+        if ( body_len < 4 )
+        {
+            uart_stats.len_errors++;
+            return;
+        }
+        cmd.tagged = true;
+        cmd.req_id = p_body[1];
+        p_body += 2;
+        body_len -= 2;
+    }
+    if ( body_len < 2 )
+    {
+        uart_stats.len_errors++;
+        return;
+    }
+
+    cmd.cmd = p_body[0];
+    cmd.sub = p_body[1];
+    cmd.len = body_len - 2;
+    memcpy(cmd.data, &p_body[2], cmd.len);
+
+    if ( nrf_queue_push(&m_uart_cmd_queue, &cmd) != NRF_SUCCESS )
+    {
+        uart_stats.cmds_dropped++;
+        return;
+    }
+    uart_stats.cmds_queued_max = MAX(uart_stats.cmds_queued_max, nrf_queue_utilization_get(&m_uart_cmd_queue));
+}
+
+static void uart_frame_complete(void)
+{
+    uint16_t len = uart_frame_len;
+
+    uart_frame_index = 0;
+    uart_frame_len = 0;
+
+    if ( uart_frame_xor(uart_frame_buf, len - 1) != uart_frame_buf[len - 1] )
+    {
+        uart_stats.xor_errors++;
+        uart_link_error();
+        return;
+    }
+
+    uart_err_streak = 0;
+    uart_stats.frames_rx++;
+    uart_cmd_queue(uart_frame_buf, len);
+}
+
+static void uart_frame_feed(const uint8_t* p_data, size_t length)
+{
+    while ( length > 0 )
+    {
+        // head goes byte by byte to find the tags again after garbage
+        if ( uart_frame_index < UART_FRAME_HEAD_LEN )
+        {
+            uint8_t byte = *p_data++;
+            length--;
+
+            if ( (uart_frame_index == 0 && byte != UART_TX_TAG) ||
+                 (uart_frame_index == 1 && byte != UART_TX_TAG2) )
+            {
+                uart_frame_index = (byte == UART_TX_TAG) ? 1 : 0;
+                uart_frame_buf[0] = byte;
+                continue;
+            }
+            uart_frame_buf[uart_frame_index++] = byte;
+
+            if ( uart_frame_index == UART_FRAME_HEAD_LEN )
+            {
+                uint16_t body = ((uint16_t)uart_frame_buf[2] << 8) + uart_frame_buf[3];
+                if ( body == 0 || body > UART_FRAME_MAX_LEN - UART_FRAME_HEAD_LEN )
+                {
+                    uart_stats.len_errors++;
+                    uart_link_error();
+                    continue;
+                }
+                uart_frame_len = UART_FRAME_HEAD_LEN + body;
+            }
+            continue;
+        }
+
+        // body is copied in one go
+        size_t chunk = MIN(length, (size_t)(uart_frame_len - uart_frame_index));
+        memcpy(&uart_frame_buf[uart_frame_index], p_data, chunk);
+        uart_frame_index += chunk;
+        p_data += chunk;
+        length -= chunk;
+
+        if ( uart_frame_index == uart_frame_len )
+        {
+            uart_frame_complete();
+        }
+    }
+}
+
+// tx owner only
+static void uart_tx_release(void)
+{
+    p_uart_tx_item = NULL;
+    UNUSED_RETURN_VALUE(nrf_atfifo_item_free(m_uart_tx_fifo, &uart_tx_get_ctx));
+    UNUSED_RETURN_VALUE(nrf_atomic_u32_sub(&uart_tx_queued, 1));
+}
+
+// tx owner only, the dma reads the frame straight out of its slot
+static bool uart_tx_start(void)
+{
+    while ( p_uart_port != NULL )
+    {
+        uart_tx_item_t* p_item = nrf_atfifo_item_get(m_uart_tx_fifo, &uart_tx_get_ctx);
+
+        if ( p_item == NULL )
+        {
+            return false;
+        }
+        p_uart_tx_item = p_item;
+        if ( nrf_libuarte_async_tx(p_uart_port, p_item->frame, p_item->len) == NRF_SUCCESS )
+        {
+            uart_stats.tx_frames++;
+            return true;
+        }
+        UNUSED_RETURN_VALUE(nrf_atomic_u32_add(&uart_stats.tx_dropped, 1));
+        uart_tx_release();
+    }
+    return false;
+}
+
+/**@brief Start the next queued frame unless a transfer already runs, any context.
+ *
+ * @details Whoever finds the link idle takes uart_tx_active and starts the dma. Everybody else
+ *          leaves uart_tx_pending set, the owner looks at the ring again before letting go.
+ */
+static void uart_tx_kick(void)
+{
+    while ( nrf_atomic_flag_clear_fetch(&uart_tx_pending) )
+    {
+        if ( nrf_atomic_flag_set_fetch(&uart_tx_active) )
+        {
+            UNUSED_RETURN_VALUE(nrf_atomic_flag_set(&uart_tx_pending));
+            return;
+        }
+        if ( uart_tx_start() )
+        {
+            return;
+        }
+        UNUSED_RETURN_VALUE(nrf_atomic_flag_clear(&uart_tx_active));
+    }
+}
+
+static void uart_evt_handler(void* context, nrf_libuarte_async_evt_t* p_evt)
+{
+    const nrf_libuarte_async_t* p_port = context;
+
+    switch ( p_evt->type )
+    {
+    case NRF_LIBUARTE_ASYNC_EVT_RX_DATA:
+        uart_stats.bytes_rx += p_evt->data.rxtx.length;
+        uart_frame_feed(p_evt->data.rxtx.p_data, p_evt->data.rxtx.length);
+        nrf_libuarte_async_rx_free(p_port, p_evt->data.rxtx.p_data, p_evt->data.rxtx.length);
+        break;
+    case NRF_LIBUARTE_ASYNC_EVT_TX_DONE:
+        uart_tx_release();
+        UNUSED_RETURN_VALUE(nrf_atomic_flag_clear(&uart_tx_active));
+        UNUSED_RETURN_VALUE(nrf_atomic_flag_set(&uart_tx_pending));
+        uart_tx_kick();
+        break;
+    // a broken frame fails its checksum, just start over
+    case NRF_LIBUARTE_ASYNC_EVT_ERROR:
+        uart_stats.hw_errors++;
+        uart_link_error();
+        break;
+    case NRF_LIBUARTE_ASYNC_EVT_OVERRUN_ERROR:
+        uart_stats.overruns += p_evt->data.overrun_err.overrun_length;
+        uart_link_error();
+        break;
+    default:
+        break;
+    }
+}
+
+static ret_code_t uart_port_open(uint8_t rate, uint8_t flags)
+{
+    ret_code_t err_code;
+    const uart_rate_cfg_t* p_cfg = &uart_rate_cfg[rate];
+    bool hwfc = (flags & UART_FLAG_HWFC) != 0;
+    nrf_libuarte_async_config_t config = {
+        .rx_pin = UART_RX_PIN,
+        .tx_pin = UART_TX_PIN,
+        .cts_pin = hwfc ? UART_CTS_PIN : NRF_UARTE_PSEL_DISCONNECTED,
+        .rts_pin = hwfc ? UART_RTS_PIN : NRF_UARTE_PSEL_DISCONNECTED,
+        .timeout_us = p_cfg->timeout_us,
+        .hwfc = hwfc ? NRF_UARTE_HWFC_ENABLED : NRF_UARTE_HWFC_DISABLED,
+        .parity = NRF_UARTE_PARITY_EXCLUDED,
+        .baudrate = p_cfg->baudrate,
+        .pullup_rx = false,
+        .int_prio = APP_IRQ_PRIORITY_LOW,
+    };
+
+    uart_frame_index = 0;
+    uart_frame_len = 0;
+    uart_err_streak = 0;
+
+    err_code = nrf_libuarte_async_init(p_cfg->p_port, &config, uart_evt_handler, (void*)p_cfg->p_port);
+    VERIFY_SUCCESS(err_code);
+    nrf_libuarte_async_enable(p_cfg->p_port);
+
+    p_uart_port = p_cfg->p_port;
+    uart_rate = rate;
+    uart_flags = flags;
+    uart_stats.rate = rate;
+    uart_stats.flags = flags;
+
+    return NRF_SUCCESS;
+}
+
+static void uart_port_close(void)
+{
+    if ( p_uart_port == NULL )
+    {
+        return;
+    }
+    nrf_libuarte_async_uninit(p_uart_port);
+    p_uart_port = NULL;
+
+    // a transfer cut short never reports done, its frame is gone
+    if ( p_uart_tx_item != NULL )
+    {
+        UNUSED_RETURN_VALUE(nrf_atomic_u32_add(&uart_stats.tx_dropped, 1));
+        uart_tx_release();
+    }
+    UNUSED_RETURN_VALUE(nrf_atomic_flag_clear(&uart_tx_active));
+}
+
+// wait for the ring to drain, frames queued meanwhile are waited for too
+static bool uart_tx_wait_idle(void)
+{
+    uint32_t count = 0;
+
+    while ( uart_tx_active || uart_tx_queued != 0 )
+    {
+        if ( count++ >= UART_TX_WAIT_MAX )
+        {
+            return false;
+        }
+        nrf_delay_ms(UART_TX_WAIT_MS);
+    }
+    return true;
+}
+
+// main loop only, the port is torn down under the caller
+static bool uart_port_switch(uint8_t rate, uint8_t flags)
+{
+    ret_code_t err_code;
+
+    // let the last frame at the old rate leave the wire
+    UNUSED_RETURN_VALUE(uart_tx_wait_idle());
+
+    CRITICAL_REGION_ENTER();
+    uart_port_close();
+    err_code = uart_port_open(rate, flags);
+    if ( err_code != NRF_SUCCESS )
+    {
+        NRF_LOG_ERROR("uart rate %d open failed, 0x%x", rate, err_code);
+        APP_ERROR_CHECK(uart_port_open(UART_RATE_115200, 0));
+    }
+    CRITICAL_REGION_EXIT();
+
+    // frames queued while the port was down go out at the new rate
+    UNUSED_RETURN_VALUE(nrf_atomic_flag_set(&uart_tx_pending));
+    uart_tx_kick();
+
+    return err_code == NRF_SUCCESS;
+}
+
+static void uart_fallback(void* p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    uart_fallback_posted = false;
+    if ( p_uart_port == NULL || (uart_rate == UART_RATE_115200 && uart_flags == 0) )
+    {
+        return;
+    }
+
+    NRF_LOG_WARNING("uart rate %d dropped, %d errors", uart_rate, uart_err_streak);
+    uart_probation = false;
+    UNUSED_RETURN_VALUE(app_timer_stop(m_uart_probation_timer));
+    uart_port_switch(UART_RATE_115200, 0);
+    uart_stats.fallbacks++;
+
+    if ( uart_fallback_handler != NULL )
+    {
+        uart_fallback_handler();
+    }
+}
+
+static void uart_probation_expired(void* p_event_data, uint16_t event_size)
+{
+    // commit may have come in while this was queued
+    if ( uart_probation )
+    {
+        uart_fallback(p_event_data, event_size);
+    }
+}
+
+static void uart_probation_timeout_handler(void* p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    UNUSED_RETURN_VALUE(app_sched_event_put(NULL, 0, uart_probation_expired));
+}
+
+ret_code_t uart_trans_init(
+    const uart_cmd_entry_t* p_cmd_table, uint8_t cmd_count, uart_fallback_handler_t fallback_handler
+)
+{
+    if ( p_uart_port != NULL )
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
+    p_uart_cmd_table = p_cmd_table;
+    uart_cmd_count = cmd_count;
+    nrf_queue_reset(&m_uart_cmd_queue);
+    APP_ERROR_CHECK(NRF_ATFIFO_INIT(m_uart_tx_fifo));
+    p_uart_tx_item = NULL;
+    uart_tx_active = 0;
+    uart_tx_pending = 0;
+    uart_tx_queued = 0;
+    uart_fallback_handler = fallback_handler;
+    uart_probation = false;
+
+    return uart_port_open(UART_RATE_115200, 0);
+}
+
+void uart_trans_uninit(void)
+{
+    if ( uart_probation )
+    {
+        uart_probation = false;
+        UNUSED_RETURN_VALUE(app_timer_stop(m_uart_probation_timer));
+    }
+    uart_port_close();
+}
+
+bool uart_trans_is_initialized(void)
+{
+    return p_uart_port != NULL;
+}
+
+/**@brief Frame a payload for the ST and queue it, any context.
+ *
+ * @details The slot is reserved atomically and the frame is built in it, so concurrent senders
+ *          never share a buffer and frames leave in reservation order. Nothing blocks: with the
+ *          ring full the frame is dropped and counted.
+ */
+ret_code_t uart_trans_send(const uint8_t* p_data, uint16_t len)
+{
+    nrf_atfifo_item_put_t put_ctx;
+    uart_tx_item_t* p_item;
+    uint32_t queued;
+
+    if ( p_uart_port == NULL )
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if ( len == 0 || len > UART_TX_DATA_MAX )
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    p_item = nrf_atfifo_item_alloc(m_uart_tx_fifo, &put_ctx);
+    if ( p_item == NULL )
+    {
+        UNUSED_RETURN_VALUE(nrf_atomic_u32_add(&uart_stats.tx_dropped, 1));
+        return NRF_ERROR_NO_MEM;
+    }
+
+    p_item->frame[0] = UART_TX_TAG2;
+    p_item->frame[1] = UART_TX_TAG;
+    p_item->frame[2] = 0x00;
+    p_item->frame[3] = len + 1;
+    memcpy(&p_item->frame[UART_FRAME_HEAD_LEN], p_data, len);
+    p_item->frame[UART_FRAME_HEAD_LEN + len] = uart_frame_xor(p_item->frame, UART_FRAME_HEAD_LEN + len);
+    p_item->len = UART_FRAME_HEAD_LEN + len + 1;
+
+    queued = nrf_atomic_u32_add(&uart_tx_queued, 1);
+    UNUSED_RETURN_VALUE(nrf_atfifo_item_put(m_uart_tx_fifo, &put_ctx));
+    uart_stats.tx_queued_max = MAX(uart_stats.tx_queued_max, queued);
+
+    UNUSED_RETURN_VALUE(nrf_atomic_flag_set(&uart_tx_pending));
+    uart_tx_kick();
+
+    return NRF_SUCCESS;
+}
+
+void uart_trans_stats_get(uart_trans_stats_t* p_stats)
+{
+    CRITICAL_REGION_ENTER();
+    *p_stats = uart_stats;
+    CRITICAL_REGION_EXIT();
+}
+
+/**@brief Run every queued command through the table, main loop only.
+ *
+ * @details Commands are handled in arrival order, so a burst of queries from the ST gets a burst
+ *          of replies instead of only the last one.
+ */
+void uart_trans_cmd_process(void)
+{
+    uart_cmd_t cmd;
+
+    while ( nrf_queue_pop(&m_uart_cmd_queue, &cmd) == NRF_SUCCESS )
+    {
+        uint8_t i;
+
+        for ( i = 0; i < uart_cmd_count; i++ )
+        {
+            if ( p_uart_cmd_table[i].cmd == cmd.cmd && p_uart_cmd_table[i].sub == cmd.sub )
+            {
+                p_uart_cmd_table[i].handler(&cmd);
+                break;
+            }
+        }
+        if ( i == uart_cmd_count )
+        {
+            uart_stats.cmds_unknown++;
+            NRF_LOG_INFO("uart cmd 0x%02x 0x%02x not handled", cmd.cmd, cmd.sub);
+        }
+    }
+}
+
+bool uart_trans_rate_supported(uint8_t rate, uint8_t flags)
+{
+    if ( rate >= UART_RATE_COUNT || (flags & ~UART_FLAG_HWFC) != 0 )
+    {
+        return false;
+    }
+    if ( (flags & UART_FLAG_HWFC) && !(NRF_LIBUARTE_DRV_HWFC_ENABLED && UART_HWFC_AVAILABLE) )
+    {
+        return false;
+    }
+    return true;
+}
+
+/**@brief Move the link to another rate, main loop only.
+ *
+ * @details Anything above plain 115200 runs on probation: the ST checks the new rate with
+ *          loopback frames and has to commit it, otherwise the link drops back to 115200.
+ */
+bool uart_trans_rate_set(uint8_t rate, uint8_t flags)
+{
+    ret_code_t err_code;
+
+    if ( p_uart_port == NULL || !uart_trans_rate_supported(rate, flags) )
+    {
+        return false;
+    }
+
+    if ( !uart_timer_created )
+    {
+        err_code = app_timer_create(&m_uart_probation_timer, APP_TIMER_MODE_SINGLE_SHOT, uart_probation_timeout_handler);
+        APP_ERROR_CHECK(err_code);
+        uart_timer_created = true;
+    }
+
+    uart_probation = false;
+    UNUSED_RETURN_VALUE(app_timer_stop(m_uart_probation_timer));
+
+    if ( !uart_port_switch(rate, flags) )
+    {
+        return false;
+    }
+
+    if ( rate != UART_RATE_115200 || flags != 0 )
+    {
+        uart_probation = true;
+        err_code = app_timer_start(m_uart_probation_timer, UART_PROBATION_TIMEOUT, NULL);
+        APP_ERROR_CHECK(err_code);
+    }
+    NRF_LOG_INFO("uart rate %d flags 0x%x", rate, flags);
+
+    return true;
+}
+
+bool uart_trans_rate_commit(void)
+{
+    if ( !uart_probation )
+    {
+        return false;
+    }
+    uart_probation = false;
+    UNUSED_RETURN_VALUE(app_timer_stop(m_uart_probation_timer));
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef _UART_TRANSMISSION_H_
+#define _UART_TRANSMISSION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+// defines
+#define UART_FRAME_HEAD_LEN 4  // tag, tag2, len16
+#define UART_FRAME_MAX_LEN  64 // whole frame, head and xor included
+
+// line rates, the link always comes up at UART_RATE_115200
+#define UART_RATE_115200    0x00
+#define UART_RATE_1M        0x01
+#define UART_RATE_COUNT     2
+
+#define UART_FLAG_HWFC      0x01 // RTS/CTS on top of the rate
+
+// commands from the ST queue up here and run from the main loop
+#define UART_CMD_QUEUE_SIZE 8
+#define UART_CMD_DATA_MAX   (UART_FRAME_MAX_LEN - UART_FRAME_HEAD_LEN - 3) // cmd, sub, xor
+#define UART_CMD_TAGGED     0x8F // ST wrapper: request id, then the plain cmd, sub and data
+#define UART_RSP_TAGGED     0x16 // our wrapper around the reply: request id, then the plain reply
+
+// frames to the ST are built in place in a ring and drained by dma in the order they were reserved
+#define UART_TX_QUEUE_SIZE  8
+#define UART_TX_FRAME_MAX   96 // whole frame, head and xor included
+#define UART_TX_DATA_MAX    (UART_TX_FRAME_MAX - UART_FRAME_HEAD_LEN - 1)
+
+typedef struct
+{
+    uint8_t cmd;
+    uint8_t sub;
+    bool tagged; // request came wrapped, the reply has to carry req_id
+    uint8_t req_id;
+    uint8_t len; // bytes in data, after the sub command
+    uint8_t data[UART_CMD_DATA_MAX];
+} uart_cmd_t;
+
+typedef void (*uart_cmd_handler_t)(const uart_cmd_t* p_cmd);
+
+typedef struct
+{
+    uint8_t cmd;
+    uint8_t sub;
+    uart_cmd_handler_t handler;
+} uart_cmd_entry_t;
+
+// called from the main loop after the link went back to 115200 on its own
+typedef void (*uart_fallback_handler_t)(void);
+
+typedef struct
+{
+    uint32_t frames_rx;    // frames handed to the dispatcher
+    uint32_t xor_errors;   // frames dropped on checksum
+    uint32_t len_errors;   // frames dropped on impossible length
+    uint32_t hw_errors;    // uarte error events
+    uint32_t overruns;     // bytes lost with all rx buffers taken
+    uint32_t bytes_rx;
+    uint32_t fallbacks;    // times a negotiated rate was dropped
+    uint32_t cmds_dropped; // command queue full
+    uint32_t cmds_unknown; // no handler registered
+    uint32_t tx_frames;    // frames handed to the dma
+    uint32_t tx_dropped;   // frames lost on a full ring or refused by the driver
+    uint8_t cmds_queued_max;
+    uint8_t tx_queued_max;
+    uint8_t rate;
+    uint8_t flags;
+} uart_trans_stats_t;
+
+ret_code_t uart_trans_init(
+    const uart_cmd_entry_t* p_cmd_table, uint8_t cmd_count, uart_fallback_handler_t fallback_handler
+);
+void uart_trans_uninit(void);
+bool uart_trans_is_initialized(void);
+ret_code_t uart_trans_send(const uint8_t* p_data, uint16_t len);
+void uart_trans_stats_get(uart_trans_stats_t* p_stats);
+void uart_trans_cmd_process(void);
+
+bool uart_trans_rate_supported(uint8_t rate, uint8_t flags);
+bool uart_trans_rate_set(uint8_t rate, uint8_t flags);
+bool uart_trans_rate_commit(void);
+
+#endif //_UART_TRANSMISSION_H_
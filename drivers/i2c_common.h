@@ -4,6 +4,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// async completion, runs in the bus interrupt
+typedef void (*I2C_Callback_t)(const bool success, void* const p_context);
+
+typedef struct
+{
+    uint8_t device_addr;
+    uint32_t transfers;
+    uint16_t nacks;      // transfers that ended in an error event
+    uint16_t timeouts;   // blocking calls that never completed
+    uint16_t bus_clears; // recoveries while this device held the bus
+} I2C_Device_Stats_t;
+
 typedef struct
 {
     bool* isInitialized;
@@ -13,13 +25,24 @@ typedef struct
     void (*HighDriveStrengthCtrl)(bool enable);
     bool (*Send)(const uint8_t device_addr, const uint32_t len, const uint8_t* const data); // iic host send
     bool (*Receive)(const uint8_t device_addr, const uint32_t len, uint8_t* const data);    // iic host receive
+    void (*BusStats)(uint32_t* const transfers, uint32_t* const bus_us);                    // totals since init
+    uint16_t (*SpeedGet)(void);                                                             // kHz the bus runs at now
+    // devices in the order they were first seen, false past the last one
+    bool (*DeviceStats)(const uint8_t index, I2C_Device_Stats_t* const stats);
 
     struct
     {
         bool (*Write)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t data);
         bool (*Read)(const uint8_t device_addr, const uint8_t reg_addr, uint8_t* const data);
+        // consecutive registers in one transaction, the device auto increments the address
+        bool (*ReadBurst)(const uint8_t device_addr, const uint8_t reg_addr, const uint32_t len, uint8_t* const data);
         bool (*SetBits)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t bit_mask);
         bool (*ClrBits)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t bit_mask);
+        // queued behind earlier transactions, false if nothing was queued, callback may be NULL
+        bool (*WriteAsync)(
+            const uint8_t device_addr, const uint8_t reg_addr, const uint8_t data, I2C_Callback_t callback,
+            void* const p_context
+        );
 
     } Reg;
 
@@ -27,6 +27,10 @@ ret_code_t lm36011_write(const uint8_t writeAddr, const uint8_t writeData)
     if ( !flashled_if_ensure_ready() )
         return NRF_ERROR_INTERNAL;
 
+    // brightness updates do not need to wait for the bus, reads queue behind them anyway
+    if ( i2c_handle->Reg.WriteAsync(LM36011_DEVICES_ADDR, writeAddr, writeData, NULL, NULL) )
+        return NRF_SUCCESS;
+
     return ((i2c_handle->Reg.Write(LM36011_DEVICES_ADDR, writeAddr, writeData) ? NRF_SUCCESS : NRF_ERROR_INTERNAL));
 }
 
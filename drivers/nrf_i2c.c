@@ -2,20 +2,65 @@
 
 #include "util_macros.h"
 
+#include "app_util_platform.h"
+#include "nrf_balloc.h"
 #include "nrf_delay.h"
 #include "nrf_gpio.h"
 // #include "nrf_twi.h"
-#include "nrfx_twi.h"
+#include "nrf_twi_mngr.h"
+
+// every transaction, blocking or not, goes through the manager queue in order
+NRF_TWI_MNGR_DEF(m_twi_mngr, I2C_QUEUE_SIZE, TWI_INSTANCE_ID);
+
+// async transactions own their descriptors until the callback
+typedef struct
+{
+    nrf_twi_mngr_transaction_t transaction;
+    nrf_twi_mngr_transfer_t transfers[1];
+    uint8_t tx_buff[2]; // register address, value for writes
+    uint8_t device_addr;
+    I2C_Callback_t callback;
+    void* p_context;
+} nrf_i2c_async_t;
+
+NRF_BALLOC_DEF(m_i2c_async_pool, sizeof(nrf_i2c_async_t), I2C_ASYNC_MAX);
+
+// per device share of the queue, one chatty device cannot lock the other out
+typedef struct
+{
+    uint8_t device_addr;
+    uint8_t pending;
+} nrf_i2c_device_t;
+
+static nrf_i2c_device_t i2c_devices[I2C_DEVICE_MAX];
 
-static const nrfx_twi_t nrf_i2c_handle = NRFX_TWI_INSTANCE(TWI_INSTANCE_ID);
 static bool i2c_configured = false;
 static I2C_t i2c_handle = {NULL};
-
-static const nrfx_twi_config_t twi_config = {
-    .scl = TWI_SCL_M,                           //
-    .sda = TWI_SDA_M,                           //
-    .frequency = NRF_TWI_FREQ_100K,             //
-    .interrupt_priority = APP_IRQ_PRIORITY_HIGH //
+static uint32_t i2c_transfers = 0;
+static uint32_t i2c_bus_us = 0;
+
+// bus health, counters per device and the speed the errors pushed us down to
+static I2C_Device_Stats_t i2c_stats[I2C_DEVICE_MAX];
+static uint8_t i2c_stats_count = 0;
+static uint8_t i2c_window_transfers = 0;
+static uint8_t i2c_window_errors = 0;
+static uint8_t i2c_speed = I2C_SPEED_DEFAULT;                 // twi_config runs at this
+static volatile uint8_t i2c_speed_target = I2C_SPEED_DEFAULT; // applied once the bus is idle
+
+static const nrf_drv_twi_frequency_t i2c_speed_freq[I2C_SPEED_COUNT] = {
+    NRF_DRV_TWI_FREQ_400K, //
+    NRF_DRV_TWI_FREQ_250K, //
+    NRF_DRV_TWI_FREQ_100K  //
+};
+static const uint16_t i2c_speed_khz[I2C_SPEED_COUNT] = {400, 250, 100};
+
+static nrf_drv_twi_config_t twi_config = {
+    .scl = TWI_SCL_M,                            //
+    .sda = TWI_SDA_M,                            //
+    .frequency = NRF_DRV_TWI_FREQ_400K,          // from i2c_speed on init
+    .interrupt_priority = APP_IRQ_PRIORITY_HIGH, //
+    .clear_bus_init = false,                     //
+    .hold_bus_uninit = false                     //
 };
 
 // ================================
@@ -93,6 +138,17 @@ static void nrf_i2c_bus_clear()
     TWI_PIN_CFG_STD(twi_config.sda);
 }
 
+// start, address byte, data bytes with ack and stop, a repeated start adds a start and an address byte
+static void nrf_i2c_account(const uint32_t len, const bool restart)
+{
+    uint32_t bits = 2 + (1 + len) * 9 + (restart ? 1 + 9 : 0);
+
+    CRITICAL_REGION_ENTER();
+    i2c_transfers++;
+    i2c_bus_us += bits * 1000 / i2c_speed_khz[i2c_speed];
+    CRITICAL_REGION_EXIT();
+}
+
 // Note: This is a workaround, only use when required
 static void nrf_i2c_strong_drive_ctrl(bool enable)
 {
@@ -120,12 +176,18 @@ static bool nrf_i2c_init()
 
     if ( !i2c_configured )
     {
-        if ( NRF_SUCCESS != nrfx_twi_init(&nrf_i2c_handle, &twi_config, NULL, NULL) )
+        if ( NRF_SUCCESS != nrf_balloc_init(&m_i2c_async_pool) )
         {
             return false;
         }
+        memset(i2c_devices, 0x00, sizeof(i2c_devices));
 
-        nrfx_twi_enable(&nrf_i2c_handle);
+        i2c_speed = i2c_speed_target;
+        twi_config.frequency = i2c_speed_freq[i2c_speed];
+        if ( NRF_SUCCESS != nrf_twi_mngr_init(&m_twi_mngr, &twi_config) )
+        {
+            return false;
+        }
 
         i2c_configured = true;
     }
@@ -139,8 +201,10 @@ static bool nrf_i2c_deinit()
 
     if ( i2c_configured )
     {
-        nrfx_twi_disable(&nrf_i2c_handle);
-        nrfx_twi_uninit(&nrf_i2c_handle);
+        // let queued transactions finish, their owners wait for the callbacks
+        while ( !nrf_twi_mngr_is_idle(&m_twi_mngr) )
+            ;
+        nrf_twi_mngr_uninit(&m_twi_mngr);
 
         i2c_configured = false;
     }
@@ -148,36 +212,189 @@ static bool nrf_i2c_deinit()
     return true;
 }
 
-static bool nrf_i2c_send(const uint8_t device_addr, const uint32_t len, const uint8_t* const data)
+static I2C_Device_Stats_t* nrf_i2c_stats_get(const uint8_t device_addr)
 {
-    // PRINT_CURRENT_LOCATION();
+    for ( uint8_t i = 0; i < i2c_stats_count; i++ )
+    {
+        if ( i2c_stats[i].device_addr == device_addr )
+            return &i2c_stats[i];
+    }
+    if ( i2c_stats_count >= I2C_DEVICE_MAX )
+        return NULL;
+
+    memset(&i2c_stats[i2c_stats_count], 0x00, sizeof(I2C_Device_Stats_t));
+    i2c_stats[i2c_stats_count].device_addr = device_addr;
+    return &i2c_stats[i2c_stats_count++];
+}
+
+// one step slower, taken on the next blocking call that finds the bus idle
+static void nrf_i2c_speed_down(void)
+{
+    if ( i2c_speed_target < I2C_SPEED_COUNT - 1 )
+        i2c_speed_target++;
+}
+
+// completed transaction, errors over a window of transfers decide the speed
+static void nrf_i2c_health_record(const uint8_t device_addr, const ret_code_t result)
+{
+    I2C_Device_Stats_t* p_stats;
+
+    CRITICAL_REGION_ENTER();
+    p_stats = nrf_i2c_stats_get(device_addr);
+    if ( p_stats != NULL )
+    {
+        p_stats->transfers++;
+        // the manager folds address and data nack into one error
+        if ( result == NRF_ERROR_INTERNAL && p_stats->nacks < UINT16_MAX )
+            p_stats->nacks++;
+    }
+
+    if ( result == NRF_ERROR_INTERNAL )
+        i2c_window_errors++;
+    if ( ++i2c_window_transfers >= I2C_HEALTH_WINDOW )
+    {
+        if ( i2c_window_errors >= I2C_HEALTH_ERR_MAX )
+            nrf_i2c_speed_down();
+        i2c_window_transfers = 0;
+        i2c_window_errors = 0;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+static void nrf_i2c_speed_apply(void)
+{
+    if ( i2c_speed == i2c_speed_target || !nrf_twi_mngr_is_idle(&m_twi_mngr) )
+        return;
+
+    nrf_twi_mngr_uninit(&m_twi_mngr);
+    i2c_speed = i2c_speed_target;
+    twi_config.frequency = i2c_speed_freq[i2c_speed];
+    i2c_configured = (NRF_SUCCESS == nrf_twi_mngr_init(&m_twi_mngr, &twi_config));
+}
+
+// A transaction never finished, most likely a device holding SDA low.
+// Every queued transaction is failed with NRF_ERROR_TIMEOUT, the bus is clocked free and
+// the manager comes back one speed step lower.
+static void nrf_i2c_recover(const uint8_t device_addr)
+{
+    const nrf_twi_mngr_transaction_t* p_transaction;
+    I2C_Device_Stats_t* p_stats;
+    uint8_t stuck_addr = device_addr;
+
+    CRITICAL_REGION_ENTER();
+    p_transaction = m_twi_mngr.p_nrf_twi_mngr_cb->p_current_transaction;
+    nrf_twi_mngr_uninit(&m_twi_mngr);
+    if ( p_transaction != NULL )
+        stuck_addr = NRF_TWI_MNGR_OP_ADDRESS(p_transaction->p_transfers[0].operation);
+
+    p_stats = nrf_i2c_stats_get(stuck_addr);
+    if ( p_stats != NULL )
+    {
+        if ( p_stats->timeouts < UINT16_MAX )
+            p_stats->timeouts++;
+        if ( p_stats->bus_clears < UINT16_MAX )
+            p_stats->bus_clears++;
+    }
+    nrf_i2c_speed_down();
+    CRITICAL_REGION_EXIT();
+
+    // the stuck one first, then everything queued behind it
+    while ( p_transaction != NULL || NRF_SUCCESS == nrf_queue_pop(m_twi_mngr.p_queue, &p_transaction) )
+    {
+        if ( p_transaction->callback != NULL )
+            p_transaction->callback(NRF_ERROR_TIMEOUT, p_transaction->p_user_data);
+        p_transaction = NULL;
+    }
+
+    nrf_i2c_bus_clear();
+    i2c_speed = i2c_speed_target;
+    twi_config.frequency = i2c_speed_freq[i2c_speed];
+    i2c_configured = (NRF_SUCCESS == nrf_twi_mngr_init(&m_twi_mngr, &twi_config));
+}
+
+typedef struct
+{
+    volatile bool in_progress;
+    ret_code_t result;
+} nrf_i2c_sync_t;
+
+static void nrf_i2c_sync_done(ret_code_t result, void* p_user_data)
+{
+    nrf_i2c_sync_t* p_sync = (nrf_i2c_sync_t*)p_user_data;
+
+    p_sync->result = result;
+    p_sync->in_progress = false;
+}
+
+// Blocking access queues behind pending async transactions and waits for its own.
+// Never call it from an async callback, that runs in the TWI interrupt and would wait forever.
+static bool nrf_i2c_perform(const uint8_t device_addr, const nrf_twi_mngr_transfer_t* p_transfers, const uint8_t count)
+{
+    nrf_i2c_sync_t sync = {.in_progress = true, .result = NRF_ERROR_INTERNAL};
+    nrf_twi_mngr_transaction_t transaction = {
+        .callback = nrf_i2c_sync_done, //
+        .p_user_data = &sync,          //
+        .p_transfers = p_transfers,    //
+        .number_of_transfers = count,  //
+        .p_required_twi_cfg = NULL     //
+    };
+    uint32_t waited_us = 0;
 
     // check i2c bus
     if ( !i2c_configured )
         return false;
 
-    // wait busy
-    while ( nrfx_twi_is_busy(&nrf_i2c_handle) )
-        ;
+    nrf_i2c_speed_apply();
+    if ( !i2c_configured || NRF_SUCCESS != nrf_twi_mngr_schedule(&m_twi_mngr, &transaction) )
+        return false;
+
+    while ( sync.in_progress )
+    {
+        if ( waited_us >= I2C_TIMEOUT_MS * 1000 )
+        {
+            // fails this transaction too
+            nrf_i2c_recover(device_addr);
+            break;
+        }
+        nrf_delay_us(I2C_WAIT_STEP_US);
+        waited_us += I2C_WAIT_STEP_US;
+    }
+
+    if ( sync.result != NRF_ERROR_TIMEOUT )
+        nrf_i2c_health_record(device_addr, sync.result);
+    return (sync.result == NRF_SUCCESS);
+}
+
+static bool nrf_i2c_send(const uint8_t device_addr, const uint32_t len, const uint8_t* const data)
+{
+    // PRINT_CURRENT_LOCATION();
+
+    if ( len > UINT8_MAX )
+        return false;
+
+    nrf_twi_mngr_transfer_t const transfers[] = {
+        NRF_TWI_MNGR_WRITE(device_addr, (uint8_t*)data, len, 0),
+    };
 
     // send
-    return (NRF_SUCCESS == nrfx_twi_tx(&nrf_i2c_handle, device_addr, data, len, false));
+    nrf_i2c_account(len, false);
+    return nrf_i2c_perform(device_addr, transfers, ARRAY_SIZE(transfers));
 }
 
 static bool nrf_i2c_receive(const uint8_t device_addr, const uint32_t len, uint8_t* const data)
 {
     // PRINT_CURRENT_LOCATION();
 
-    // check i2c bus
-    if ( !i2c_configured )
+    if ( len > UINT8_MAX )
         return false;
 
-    // wait busy
-    while ( nrfx_twi_is_busy(&nrf_i2c_handle) )
-        ;
+    nrf_twi_mngr_transfer_t const transfers[] = {
+        NRF_TWI_MNGR_READ(device_addr, data, len, 0),
+    };
 
     // read
-    return (NRF_SUCCESS == nrfx_twi_rx(&nrf_i2c_handle, device_addr, data, len));
+    nrf_i2c_account(len, false);
+    return nrf_i2c_perform(device_addr, transfers, ARRAY_SIZE(transfers));
 }
 
 // reg
@@ -196,17 +413,131 @@ static bool nrf_i2c_reg_write(const uint8_t device_addr, const uint8_t reg_addr,
     return true;
 }
 
-static bool nrf_i2c_reg_read(const uint8_t device_addr, const uint8_t reg_addr, uint8_t* const val)
+// register address then a repeated start into the read, one transaction for any number of registers
+static bool nrf_i2c_reg_read_burst(
+    const uint8_t device_addr, const uint8_t reg_addr, const uint32_t len, uint8_t* const data
+)
 {
     // PRINT_CURRENT_LOCATION();
 
     uint8_t tmp = reg_addr;
-    if ( !nrf_i2c_send(device_addr, sizeof(tmp), &tmp) )
+
+    if ( len > UINT8_MAX )
+        return false;
+
+    nrf_twi_mngr_transfer_t const transfers[] = {
+        NRF_TWI_MNGR_WRITE(device_addr, &tmp, sizeof(tmp), NRF_TWI_MNGR_NO_STOP),
+        NRF_TWI_MNGR_READ(device_addr, data, len, 0),
+    };
+
+    nrf_i2c_account(sizeof(tmp) + len, true);
+    return nrf_i2c_perform(device_addr, transfers, ARRAY_SIZE(transfers));
+}
+
+static bool nrf_i2c_reg_read(const uint8_t device_addr, const uint8_t reg_addr, uint8_t* const val)
+{
+    // PRINT_CURRENT_LOCATION();
+
+    return nrf_i2c_reg_read_burst(device_addr, reg_addr, sizeof(*val), val);
+}
+
+// async
+
+static nrf_i2c_device_t* nrf_i2c_device_get(const uint8_t device_addr)
+{
+    nrf_i2c_device_t* p_free = NULL;
+
+    for ( uint8_t i = 0; i < I2C_DEVICE_MAX; i++ )
+    {
+        if ( i2c_devices[i].pending != 0 && i2c_devices[i].device_addr == device_addr )
+            return &i2c_devices[i];
+        if ( i2c_devices[i].pending == 0 && p_free == NULL )
+            p_free = &i2c_devices[i];
+    }
+    if ( p_free != NULL )
+        p_free->device_addr = device_addr;
+
+    return p_free;
+}
+
+// runs in the TWI interrupt
+static void nrf_i2c_async_done(ret_code_t result, void* p_user_data)
+{
+    nrf_i2c_async_t* p_async = (nrf_i2c_async_t*)p_user_data;
+    I2C_Callback_t callback = p_async->callback;
+    void* p_context = p_async->p_context;
+
+    CRITICAL_REGION_ENTER();
+    nrf_i2c_device_get(p_async->device_addr)->pending--;
+    CRITICAL_REGION_EXIT();
+    if ( result != NRF_ERROR_TIMEOUT )
+        nrf_i2c_health_record(p_async->device_addr, result);
+    nrf_balloc_free(&m_i2c_async_pool, p_async);
+
+    if ( callback != NULL )
+        callback(result == NRF_SUCCESS, p_context);
+}
+
+// false when the bus is down or the device used up its share of the queue, nothing is queued then
+static bool nrf_i2c_async_schedule(
+    const uint8_t device_addr, nrf_i2c_async_t* p_async, const uint8_t transfer_count, I2C_Callback_t callback,
+    void* p_context
+)
+{
+    nrf_i2c_device_t* p_device;
+    bool ok = false;
+
+    p_async->device_addr = device_addr;
+    p_async->callback = callback;
+    p_async->p_context = p_context;
+    p_async->transaction.callback = nrf_i2c_async_done;
+    p_async->transaction.p_user_data = p_async;
+    p_async->transaction.p_transfers = p_async->transfers;
+    p_async->transaction.number_of_transfers = transfer_count;
+    p_async->transaction.p_required_twi_cfg = NULL;
+
+    CRITICAL_REGION_ENTER();
+    p_device = nrf_i2c_device_get(device_addr);
+    if ( p_device != NULL && p_device->pending < I2C_DEVICE_QUEUE_SIZE )
+    {
+        p_device->pending++;
+        ok = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    if ( ok && NRF_SUCCESS != nrf_twi_mngr_schedule(&m_twi_mngr, &p_async->transaction) )
+    {
+        CRITICAL_REGION_ENTER();
+        p_device->pending--;
+        CRITICAL_REGION_EXIT();
+        ok = false;
+    }
+    if ( !ok )
+        nrf_balloc_free(&m_i2c_async_pool, p_async);
+
+    return ok;
+}
+
+// the value is copied, callback may be NULL for fire and forget
+static bool nrf_i2c_reg_write_async(
+    const uint8_t device_addr, const uint8_t reg_addr, const uint8_t val, I2C_Callback_t callback, void* p_context
+)
+{
+    nrf_i2c_async_t* p_async;
+
+    if ( !i2c_configured )
         return false;
-    if ( !nrf_i2c_receive(device_addr, sizeof(*val), val) )
+
+    p_async = nrf_balloc_alloc(&m_i2c_async_pool);
+    if ( p_async == NULL )
         return false;
 
-    return true;
+    p_async->tx_buff[0] = reg_addr;
+    p_async->tx_buff[1] = val;
+    p_async->transfers[0] = (nrf_twi_mngr_transfer_t)NRF_TWI_MNGR_WRITE(device_addr, p_async->tx_buff, 2, 0);
+
+    nrf_i2c_account(2, false);
+    return nrf_i2c_async_schedule(device_addr, p_async, 1, callback, p_context);
 }
 
 static bool nrf_i2c_reg_set_bits(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t bit_mask)
@@ -258,6 +589,32 @@ static bool nrf_i2c_reg_clr_bits(const uint8_t device_addr, const uint8_t reg_ad
     return false;
 }
 
+static void nrf_i2c_bus_stats(uint32_t* const transfers, uint32_t* const bus_us)
+{
+    *transfers = i2c_transfers;
+    *bus_us = i2c_bus_us;
+}
+
+static uint16_t nrf_i2c_speed_get(void)
+{
+    return i2c_speed_khz[i2c_speed];
+}
+
+static bool nrf_i2c_device_stats(const uint8_t index, I2C_Device_Stats_t* const stats)
+{
+    bool found = false;
+
+    CRITICAL_REGION_ENTER();
+    if ( index < i2c_stats_count )
+    {
+        *stats = i2c_stats[index];
+        found = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return found;
+}
+
 // ================================
 // functions public
 
@@ -273,8 +630,13 @@ I2C_t* nrf_i2c_get_instance()
     i2c_handle.HighDriveStrengthCtrl = nrf_i2c_strong_drive_ctrl;
     i2c_handle.Send = nrf_i2c_send;
     i2c_handle.Receive = nrf_i2c_receive;
+    i2c_handle.BusStats = nrf_i2c_bus_stats;
+    i2c_handle.SpeedGet = nrf_i2c_speed_get;
+    i2c_handle.DeviceStats = nrf_i2c_device_stats;
     i2c_handle.Reg.Write = nrf_i2c_reg_write;
     i2c_handle.Reg.Read = nrf_i2c_reg_read;
+    i2c_handle.Reg.ReadBurst = nrf_i2c_reg_read_burst;
+    i2c_handle.Reg.WriteAsync = nrf_i2c_reg_write_async;
     i2c_handle.Reg.SetBits = nrf_i2c_reg_set_bits;
     i2c_handle.Reg.ClrBits = nrf_i2c_reg_clr_bits;
 
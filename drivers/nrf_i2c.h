@@ -13,6 +13,23 @@
 #define TWI_SDA_M       14
 #define TWI_SCL_M       15
 
+// bus speed, starts at I2C_SPEED_DEFAULT and steps down on a sick bus
+#define I2C_SPEED_400K     0
+#define I2C_SPEED_250K     1
+#define I2C_SPEED_100K     2
+#define I2C_SPEED_COUNT    3
+#define I2C_SPEED_DEFAULT  I2C_SPEED_400K
+
+#define I2C_HEALTH_WINDOW  64 // transfers per error rate check
+#define I2C_HEALTH_ERR_MAX 4  // failed transfers in one window that step the speed down
+#define I2C_TIMEOUT_MS     50 // blocking call, queue wait included, before the bus is recovered
+#define I2C_WAIT_STEP_US   10
+
+#define I2C_QUEUE_SIZE        8                    // transactions waiting in the twi manager
+#define I2C_ASYNC_MAX         (I2C_QUEUE_SIZE - 2) // the rest stays free for blocking calls
+#define I2C_DEVICE_MAX        4                    // devices with async transactions pending at once
+#define I2C_DEVICE_QUEUE_SIZE (I2C_ASYNC_MAX / 2)  // async transactions one device may have pending
+
 I2C_t* nrf_i2c_get_instance(void);
 
 #endif //_NRF_I2C_
\ No newline at end of file
@@ -1,19 +1,40 @@
 #include "axp2101.h"
 
 #include "ntc_util.h"
+#include "pmu_reg_cache.h"
+
+// defines
+#define AXP2101_BROM_READ_DELAY_MS  10 // pacing of the original check, now only to confirm a mismatch
+#define AXP2101_BROM_WRITE_DELAY_MS 10
 
 // macros
-#define axp2101_reg_read(reg, val)  pmu_interface_p->Reg.Read(AXP2101_I2C_ADDR, reg, val)
-#define axp2101_reg_write(reg, val) pmu_interface_p->Reg.Write(AXP2101_I2C_ADDR, reg, val)
-#define axp2101_set_bits(reg, mask) pmu_interface_p->Reg.SetBits(AXP2101_I2C_ADDR, reg, mask)
-#define axp2101_clr_bits(reg, mask) pmu_interface_p->Reg.ClrBits(AXP2101_I2C_ADDR, reg, mask)
+#define axp2101_reg_read(reg, val)            pmu_reg_cache_read(&reg_cache, reg, val)
+#define axp2101_reg_write(reg, val)           pmu_reg_cache_write(&reg_cache, reg, val)
+// burst reads are status and adc, always from the chip
+#define axp2101_reg_read_burst(reg, len, buf) pmu_interface_p->Reg.ReadBurst(AXP2101_I2C_ADDR, reg, len, buf)
+// queued behind earlier transactions without waiting, blocking write if the queue is full
+#define axp2101_reg_post(reg, val)            pmu_reg_cache_post(&reg_cache, reg, val)
+#define axp2101_set_bits(reg, mask)           pmu_reg_cache_update(&reg_cache, reg, mask, mask)
+#define axp2101_clr_bits(reg, mask)           pmu_reg_cache_update(&reg_cache, reg, mask, 0)
 
 // vars private
 static bool initialized = false;
 static PMU_Interface_t* pmu_interface_p = NULL;
+static PMU_Reg_Cache_t reg_cache;
 static Power_State_t state_current = PWR_STATE_INVALID;
 static Power_Status_t status_current = {0};
 
+// control registers only, SLEEP_CFG wake bits and WATCHDOG_CFG clear bit are set back by the chip
+static const uint8_t reg_cacheable[] = {
+    AXP2101_COMM_CFG, AXP2101_BATFET_CTRL, AXP2101_DIE_TEMP_CFG, AXP2101_VSYS_MIN, AXP2101_VINDPM_CFG, AXP2101_IIN_LIM,
+    AXP2101_RESET_CFG, AXP2101_MODULE_EN, AXP2101_GAUGE_THLD, AXP2101_PWROFF_EN, AXP2101_DCDC_PWROFF_EN,
+    AXP2101_VOFF_THLD, AXP2101_PWR_TIME_CTRL, AXP2101_PONLEVEL, AXP2101_ADC_CH_EN0, AXP2101_ADC_CH_EN1,
+    AXP2101_ADC_CH_EN2, AXP2101_ADC_CH_EN3, AXP2101_INTEN1, AXP2101_INTEN2, AXP2101_INTEN3, AXP2101_TS_CFG,
+    AXP2101_VLTF_CHG, AXP2101_VHTF_CHG, AXP2101_VLTF_DISCHG, AXP2101_VHTF_DISCHG, AXP2101_CHG_CFG, AXP2101_IPRECHG_CFG,
+    AXP2101_ICC_CFG, AXP2101_ITERM_CFG, AXP2101_CHG_V_CFG, AXP2101_CHG_TMR_CFG, AXP2101_CHGLED_CFG, AXP2101_DCDC_CFG0,
+    AXP2101_DCDC_CFG1, AXP2101_DCDC1_CFG, AXP2101_LDO_EN_CFG0, AXP2101_LDO_EN_CFG1, AXP2101_ALDO1_CFG, AXP2101_CONFIG,
+};
+
 // functions private
 
 static bool axp2101_config_voltage(void)
@@ -37,10 +58,124 @@ static bool axp2101_config_voltage(void)
     return true;
 }
 
+// FNV-1a, identifies the battery table in the verified marker
+static uint32_t axp2101_brom_hash(const uint8_t* data, const uint32_t len)
+{
+    uint32_t hash = 2166136261UL;
+
+    for ( uint32_t i = 0; i < len; i++ )
+    {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// BROM has a single data port, every read advances the internal pointer, so no burst here.
+// mismatch_at is len when all bytes match, false only on bus errors.
+static bool axp2101_brom_verify(
+    const uint8_t* data, const uint32_t len, const uint32_t delay_ms, uint32_t* const mismatch_at,
+    uint8_t* const mismatch_val
+)
+{
+    uint8_t val_temp;
+
+    *mismatch_at = len;
+
+    // enable BROM access, the toggle rewinds the pointer
+    EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
+    EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 0)));
+    for ( uint32_t i = 0; i < len; i++ )
+    {
+        val_temp = 0xff;
+        EC_E_BOOL_R_BOOL(axp2101_reg_read(AXP2101_BROM, &val_temp));
+        if ( data[i] != val_temp )
+        {
+            *mismatch_at = i;
+            *mismatch_val = val_temp;
+            break;
+        }
+        if ( delay_ms != 0 )
+            pmu_interface_p->Delay_ms(delay_ms);
+    }
+    // disable BROM access
+    EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
+
+    return true;
+}
+
+// back to back reads first, the old paced reads only to confirm a mismatch before touching the BROM
+static bool axp2101_brom_check(const uint8_t* data, const uint32_t len, bool* const valid)
+{
+    uint32_t mismatch_at;
+    uint8_t mismatch_val;
+
+    EC_E_BOOL_R_BOOL(axp2101_brom_verify(data, len, 0, &mismatch_at, &mismatch_val));
+    if ( mismatch_at != len )
+    {
+        pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM fast verify mismatch at %lu, confirming", mismatch_at);
+        EC_E_BOOL_R_BOOL(axp2101_brom_verify(data, len, AXP2101_BROM_READ_DELAY_MS, &mismatch_at, &mismatch_val));
+    }
+    if ( mismatch_at != len )
+        pmu_interface_p->Log(
+            PWR_LOG_LEVEL_INFO, "i=%lu, buff=0x%02x, val=0x%02x", mismatch_at, data[mismatch_at], mismatch_val
+        );
+
+    *valid = (mismatch_at == len);
+    return true;
+}
+
+// The data buffers only survive while the pmu keeps power, the flash marker only while the table is unchanged.
+// Both have to match for the check to be skipped.
+static bool axp2101_brom_marked(const uint32_t table_hash)
+{
+    uint32_t marker_hash = 0;
+    uint8_t token[4];
+
+    if ( pmu_interface_p->BromMarker.Get == NULL || !pmu_interface_p->BromMarker.Get(&marker_hash) )
+        return false;
+    if ( marker_hash != table_hash )
+        return false;
+    if ( !axp2101_reg_read_burst(AXP2101_DATA_BUFFER0, sizeof(token), token) )
+        return false;
+
+    return (((uint32_t)token[0] << 24) | ((uint32_t)token[1] << 16) | ((uint32_t)token[2] << 8) | token[3]) ==
+           table_hash;
+}
+
+static bool axp2101_brom_mark(const uint32_t table_hash)
+{
+    uint32_t marker_hash = 0;
+
+    EC_E_BOOL_R_BOOL(axp2101_reg_write(AXP2101_DATA_BUFFER0, (uint8_t)(table_hash >> 24)));
+    EC_E_BOOL_R_BOOL(axp2101_reg_write(AXP2101_DATA_BUFFER1, (uint8_t)(table_hash >> 16)));
+    EC_E_BOOL_R_BOOL(axp2101_reg_write(AXP2101_DATA_BUFFER2, (uint8_t)(table_hash >> 8)));
+    EC_E_BOOL_R_BOOL(axp2101_reg_write(AXP2101_DATA_BUFFER3, (uint8_t)table_hash));
+
+    // flash only changes with the table, a pmu power loss just costs the next boot one full check
+    if ( pmu_interface_p->BromMarker.Get == NULL || pmu_interface_p->BromMarker.Set == NULL )
+        return true;
+    if ( pmu_interface_p->BromMarker.Get(&marker_hash) && marker_hash == table_hash )
+        return true;
+    if ( !pmu_interface_p->BromMarker.Set(table_hash) )
+        pmu_interface_p->Log(PWR_LOG_LEVEL_ERR, "BROM marker store failed");
+
+    return true;
+}
+
+// next boot checks the BROM again, best effort
+static void axp2101_brom_unmark(void)
+{
+    axp2101_reg_write(AXP2101_DATA_BUFFER0, 0x00);
+    axp2101_reg_write(AXP2101_DATA_BUFFER1, 0x00);
+    axp2101_reg_write(AXP2101_DATA_BUFFER2, 0x00);
+    axp2101_reg_write(AXP2101_DATA_BUFFER3, 0x00);
+}
+
 static bool axp2101_config_battery_param(void)
 {
     bool brom_valid = true;
-    uint8_t val_temp = 0xff;
+    uint32_t table_hash;
 
     // battery param -> BROM
     static const uint8_t batt_cal_data[128] = {
@@ -54,27 +189,17 @@ static bool axp2101_config_battery_param(void)
         0x00, 0xfb, 0x00, 0x00, 0xfb, 0x00, 0x00, 0xfb, 0x00, 0x00, 0xf6, 0x00, 0x00, 0xf6, 0x00, 0xf6, //
     };
 
+    table_hash = axp2101_brom_hash(batt_cal_data, sizeof(batt_cal_data));
+
+    if ( axp2101_brom_marked(table_hash) )
+    {
+        pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM verified for table 0x%08lX, check skipped", table_hash);
+    }
+    else
     {
         // check brom
         pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM validating...");
-
-        // enable BROM access
-        EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 0)));
-        // verify BROM
-        for ( uint8_t i = 0; i < sizeof(batt_cal_data); i++ )
-        {
-            val_temp = 0xff;
-            EC_E_BOOL_R_BOOL(axp2101_reg_read(AXP2101_BROM, &val_temp));
-            if ( batt_cal_data[i] != val_temp )
-            {
-                brom_valid = false;
-                break;
-            }
-            pmu_interface_p->Delay_ms(10);
-        }
-        // disable BROM access
-        EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
+        EC_E_BOOL_R_BOOL(axp2101_brom_check(batt_cal_data, sizeof(batt_cal_data), &brom_valid));
     }
 
     if ( !brom_valid )
@@ -108,53 +233,39 @@ static bool axp2101_config_battery_param(void)
                 }
                 pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM Prog 0x%02X: %s", (i - (bytes_wide - 1)), print_buffer);
             }
-            pmu_interface_p->Delay_ms(10);
+            pmu_interface_p->Delay_ms(AXP2101_BROM_WRITE_DELAY_MS);
         }
-
-        // enable BROM access
+        // disable BROM access
         EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 0)));
+
         // verify BROM
-        for ( uint8_t i = 0; i < sizeof(batt_cal_data); i++ )
+        EC_E_BOOL_R_BOOL(axp2101_brom_check(batt_cal_data, sizeof(batt_cal_data), &brom_valid));
+        if ( !brom_valid )
         {
-            val_temp = 0;
-            EC_E_BOOL_R_BOOL(axp2101_reg_read(AXP2101_BROM, &val_temp));
-            if ( batt_cal_data[i] != val_temp )
-            {
-                pmu_interface_p->Log(PWR_LOG_LEVEL_ERR, "BROM program verify failed!");
-                pmu_interface_p->Log(PWR_LOG_LEVEL_ERR, "i=%u, buff=0x%02x, val=0x%02x", i, batt_cal_data[i], val_temp);
-                // disable BROM access
-                EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
-                // set fuel gauge use SRAM
-                EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 4)));
-                // reset fuel gauge
-                EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_RESET_CFG, (1 << 2)));
-                EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_RESET_CFG, (1 << 2)));
-                return false;
-            }
-            pmu_interface_p->Delay_ms(10);
+            pmu_interface_p->Log(PWR_LOG_LEVEL_ERR, "BROM program verify failed!");
+            // set fuel gauge use SRAM
+            EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 4)));
+            // reset fuel gauge
+            EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_RESET_CFG, (1 << 2)));
+            EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_RESET_CFG, (1 << 2)));
+            return false;
         }
         pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM program verify success!");
-        // disable BROM access
-        EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_CONFIG, (1 << 0)));
-        // set fuel gauge use BROM
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 4)));
-        // reset fuel gauge
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_RESET_CFG, (1 << 2)));
-        EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_RESET_CFG, (1 << 2)));
     }
     else
     {
         // valid brom
         pmu_interface_p->Log(PWR_LOG_LEVEL_INFO, "BROM valid");
-
-        // set fuel gauge use BROM
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 4)));
-        // reset fuel gauge
-        EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_RESET_CFG, (1 << 2)));
-        EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_RESET_CFG, (1 << 2)));
     }
 
+    EC_E_BOOL_R_BOOL(axp2101_brom_mark(table_hash));
+
+    // set fuel gauge use BROM
+    EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_CONFIG, (1 << 4)));
+    // reset fuel gauge
+    EC_E_BOOL_R_BOOL(axp2101_set_bits(AXP2101_RESET_CFG, (1 << 2)));
+    EC_E_BOOL_R_BOOL(axp2101_clr_bits(AXP2101_RESET_CFG, (1 << 2)));
+
     return true;
 }
 
@@ -242,13 +353,26 @@ static bool axp2101_config_common(void)
 static bool axp2101_charge_current_sel(bool low_current_mode)
 {
     uint8_t reg_val = 0;
+    uint8_t reg_new;
     EC_E_BOOL_R_BOOL(axp2101_reg_read(AXP2101_ICC_CFG, &reg_val));
-    reg_val &= 0b11100000;                                   // clear current bits [4:0]
-    reg_val |= (low_current_mode ? 0b00001001 : 0b00001011); // set current 300ma or 500ma
-    EC_E_BOOL_R_BOOL(axp2101_reg_write(AXP2101_ICC_CFG, reg_val));
+    reg_new = reg_val & 0b11100000;                          // clear current bits [4:0]
+    reg_new |= (low_current_mode ? 0b00001001 : 0b00001011); // set current 300ma or 500ma
+    // runs on every status refresh, the value rarely changes
+    if ( reg_new != reg_val )
+        EC_E_BOOL_R_BOOL(axp2101_reg_post(AXP2101_ICC_CFG, reg_new));
     return true;
 }
 
+// 14 bit adc result, high byte first
+static uint16_t axp2101_adc_value(const uint8_t* p_hl)
+{
+    HL_Buff hlbuff;
+
+    hlbuff.u8_high = p_hl[0] & 0b00111111; // drop bit 7:6
+    hlbuff.u8_low = p_hl[1];
+    return hlbuff.u16;
+}
+
 // function public
 
 Power_Error_t axp2101_init(void)
@@ -288,6 +412,8 @@ Power_Error_t axp2101_deinit(void)
 
 Power_Error_t axp2101_reset(bool hard_reset)
 {
+    axp2101_brom_unmark();
+
     if ( !hard_reset )
     {
         EC_E_BOOL_R_PWR_ERR(axp2101_set_bits(AXP2101_COMM_CFG, (1 << 1)));
@@ -300,6 +426,8 @@ Power_Error_t axp2101_reset(bool hard_reset)
         pmu_interface_p->Delay_ms(100);
         pmu_interface_p->GPIO.Config(7, PWR_GPIO_Config_DEFAULT);
     }
+    // registers are back at their defaults
+    pmu_reg_cache_invalidate(&reg_cache);
 
     return PWR_ERROR_NONE;
 }
@@ -309,10 +437,8 @@ Power_Error_t axp2101_irq(void)
     uint8_t irqs[3];
     uint64_t irq_bits = 0;
 
-    // read irq
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_INTSTS1, &irqs[0]));
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_INTSTS2, &irqs[1]));
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_INTSTS3, &irqs[2]));
+    // read irq, INTSTS1..3 in one go
+    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read_burst(AXP2101_INTSTS1, sizeof(irqs), irqs));
 
     irq_bits |= ((((irqs[0] & (1 << 7))) != 0) << PWR_IRQ_BATT_LOW);
     irq_bits |= ((((irqs[0] & (1 << 6))) != 0) << PWR_IRQ_BATT_CRITICAL);
@@ -340,7 +466,7 @@ Power_Error_t axp2101_irq(void)
     // process irq
     pmu_interface_p->Irq(irq_bits);
 
-    // clear irq
+    // clear irq, blocking so a failed clear is reported and the line is not left asserted
     EC_E_BOOL_R_PWR_ERR(axp2101_reg_write(AXP2101_INTSTS1, 0xFF));
     EC_E_BOOL_R_PWR_ERR(axp2101_reg_write(AXP2101_INTSTS2, 0xFF));
     EC_E_BOOL_R_PWR_ERR(axp2101_reg_write(AXP2101_INTSTS3, 0xFF));
@@ -431,42 +557,43 @@ Power_Error_t axp2101_get_state(Power_State_t* state)
     return PWR_ERROR_NONE;
 }
 
+// status registers read as a few contiguous bursts and decoded from the buffers
+// COMM_STAT0..1, MODULE_EN, VBAT_H..TDIE_L (vbus included, cheaper than a second burst), SOC
+#define AXP2101_ADC_BURST_LEN (AXP2101_TDIE_L - AXP2101_VBAT_H + 1)
+#define AXP2101_ADC_AT(reg)   (adc + ((reg) - AXP2101_VBAT_H))
+
 Power_Error_t axp2101_pull_status(void)
 {
-    HL_Buff hlbuff;
+    uint8_t comm_stat[2];
+    uint8_t module_en;
+    uint8_t adc[AXP2101_ADC_BURST_LEN];
+    uint8_t soc = 0;
 
     Power_Status_t status_temp = {0};
 
+    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read_burst(AXP2101_COMM_STAT0, sizeof(comm_stat), comm_stat));
+    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_MODULE_EN, &module_en));
+    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read_burst(AXP2101_VBAT_H, sizeof(adc), adc));
+
     // sys voltage
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_VSYS_H, &(hlbuff.u8_high)));
-    hlbuff.u8_high &= 0b00111111; // drop bit 7:6
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_VSYS_L, &(hlbuff.u8_low)));
-    status_temp.sysVoltage = hlbuff.u16;
+    status_temp.sysVoltage = axp2101_adc_value(AXP2101_ADC_AT(AXP2101_VSYS_H));
 
     // battery present
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_COMM_STAT0, &(hlbuff.u8_low)));
-    status_temp.batteryPresent = ((hlbuff.u8_low & (1 << 3)) == (1 << 3));
+    status_temp.batteryPresent = ((comm_stat[0] & (1 << 3)) == (1 << 3));
 
     if ( status_temp.batteryPresent )
     {
         // battery percent
-        hlbuff.u8_high = 0;
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_SOC, &(hlbuff.u8_low)));
-        status_temp.batteryPercent = hlbuff.u8_low;
+        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_SOC, &soc));
+        status_temp.batteryPercent = soc;
 
         // battery voltage
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_VBAT_H, &(hlbuff.u8_high)));
-        hlbuff.u8_high &= 0b00111111; // drop bit 7:6
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_VBAT_L, &(hlbuff.u8_low)));
-        status_temp.batteryVoltage = hlbuff.u16;
+        status_temp.batteryVoltage = axp2101_adc_value(AXP2101_ADC_AT(AXP2101_VBAT_H));
 
         // battery temp
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_TS_H, &(hlbuff.u8_high)));
-        hlbuff.u8_high &= 0b00111111; // drop bit 7:6
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_TS_L, &(hlbuff.u8_low)));
-        status_temp.batteryTemp =
-            ntc_temp_cal_cv(NTC_Char_NCP15XH103F03RC_2585, 40, (hlbuff.u16 * 0.5) * 1000); // temp_c
+        status_temp.batteryTemp = ntc_temp_cal_cv(
+            NTC_Char_NCP15XH103F03RC_2585, 40, (axp2101_adc_value(AXP2101_ADC_AT(AXP2101_TS_H)) * 0.5) * 1000
+        ); // temp_c
     }
     else
     {
@@ -476,19 +603,11 @@ Power_Error_t axp2101_pull_status(void)
     }
 
     // pmu temp
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_TDIE_H, &(hlbuff.u8_high)));
-    hlbuff.u8_high &= 0b00111111; // drop bit 7:6
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_TDIE_L, &(hlbuff.u8_low)));
-    status_temp.pmuTemp = (7274 - hlbuff.u16) / 20 + 22;
+    status_temp.pmuTemp = (7274 - axp2101_adc_value(AXP2101_ADC_AT(AXP2101_TDIE_H))) / 20 + 22;
 
     // charging
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_MODULE_EN, &(hlbuff.u8_low)));
-    status_temp.chargeAllowed = ((hlbuff.u8_low & (1 << 1)) == (1 << 1));
-
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_COMM_STAT0, &(hlbuff.u8_low)));
-    status_temp.chargerAvailable = ((hlbuff.u8_low & (1 << 5)) == (1 << 5)); // vbus good
+    status_temp.chargeAllowed = ((module_en & (1 << 1)) == (1 << 1));
+    status_temp.chargerAvailable = ((comm_stat[0] & (1 << 5)) == (1 << 5)); // vbus good
 
     // Note: some redundant code here is to keep the logic clear
     if ( status_temp.chargerAvailable )
@@ -506,9 +625,7 @@ Power_Error_t axp2101_pull_status(void)
         // wireless charge current limit to 300ma
         EC_E_BOOL_R_PWR_ERR(axp2101_charge_current_sel(status_temp.wirelessCharge));
 
-        hlbuff.u8_high = 0;
-        EC_E_BOOL_R_PWR_ERR(axp2101_reg_read(AXP2101_COMM_STAT1, &(hlbuff.u8_low)));
-        status_temp.chargeFinished = ((hlbuff.u8_low & 0b00000111) == 0b00000100); // bit 2:0 = 100 charge done
+        status_temp.chargeFinished = ((comm_stat[1] & 0b00000111) == 0b00000100); // bit 2:0 = 100 charge done
 
         // if charging allowd, check charging status
         // Note: some redundant code for keep the logic clear
@@ -587,6 +704,7 @@ Power_Error_t axp2101_get_feature(Power_Featrue_t feature, bool* enable)
 void axp2101_setup_interface(PMU_Interface_t* pmu_if_p, PMU_t* pmu_p)
 {
     pmu_interface_p = pmu_if_p;
+    pmu_reg_cache_init(&reg_cache, pmu_if_p, AXP2101_I2C_ADDR, reg_cacheable, sizeof(reg_cacheable));
 
     pmu_p->isInitialized = &initialized;
     strncpy(pmu_p->InstanceName, "AXP2101", PMU_INSTANCE_NAME_MAX_LEN);
@@ -1,19 +1,34 @@
 #include "axp216.h"
 
 #include "ntc_util.h"
+#include "pmu_reg_cache.h"
 
 // macros
-#define axp216_reg_read(reg, val)  pmu_interface_p->Reg.Read(AXP216_I2C_ADDR, reg, val)
-#define axp216_reg_write(reg, val) pmu_interface_p->Reg.Write(AXP216_I2C_ADDR, reg, val)
-#define axp216_set_bits(reg, mask) pmu_interface_p->Reg.SetBits(AXP216_I2C_ADDR, reg, mask)
-#define axp216_clr_bits(reg, mask) pmu_interface_p->Reg.ClrBits(AXP216_I2C_ADDR, reg, mask)
+#define axp216_reg_read(reg, val)            pmu_reg_cache_read(&reg_cache, reg, val)
+#define axp216_reg_write(reg, val)           pmu_reg_cache_write(&reg_cache, reg, val)
+// burst reads are status and adc, always from the chip
+#define axp216_reg_read_burst(reg, len, buf) pmu_interface_p->Reg.ReadBurst(AXP216_I2C_ADDR, reg, len, buf)
+// queued behind earlier transactions without waiting, blocking write if the queue is full
+#define axp216_reg_post(reg, val)            pmu_reg_cache_post(&reg_cache, reg, val)
+#define axp216_set_bits(reg, mask)           pmu_reg_cache_update(&reg_cache, reg, mask, mask)
+#define axp216_clr_bits(reg, mask)           pmu_reg_cache_update(&reg_cache, reg, mask, 0)
 
 // vars private
 static bool initialized = false;
 static PMU_Interface_t* pmu_interface_p = NULL;
+static PMU_Reg_Cache_t reg_cache;
 static Power_State_t state_current = PWR_STATE_INVALID;
 static Power_Status_t status_current = {0};
 
+// control registers only, VOFF_SET wake and reset bits are set back by the chip
+static const uint8_t reg_cacheable[] = {
+    AXP216_LDO_DC_EN1, AXP216_LDO_DC_EN2, AXP216_DC1OUT_VOL, AXP216_ALDO1OUT_VOL, AXP216_ALDO2OUT_VOL,
+    AXP216_ALDO3OUT_VOL, AXP216_IPS_SET, AXP216_OFF_CTL, AXP216_CHARGE1, AXP216_CHARGE2, AXP216_POK_SET,
+    AXP216_VLTF_CHG, AXP216_VHTF_CHG, AXP216_VLTF_DISCHG, AXP216_VHTF_DISCHG, AXP216_INTEN1, AXP216_INTEN2,
+    AXP216_INTEN3, AXP216_INTEN4, AXP216_INTEN5, AXP216_ADC_EN, AXP216_ADC_CONTROL3, AXP216_HOTOVER_CTL,
+    AXP216_BAT_CAP0, AXP216_BAT_CAP1, AXP216_BAT_WARN,
+};
+
 // functions private
 
 static bool axp216_config_voltage(void)
@@ -125,10 +140,13 @@ static bool axp216_config_common(void)
 static bool axp216_charge_current_sel(bool low_current_mode)
 {
     uint8_t reg_val = 0;
+    uint8_t reg_new;
     EC_E_BOOL_R_BOOL(axp216_reg_read(AXP216_CHARGE1, &reg_val));
-    reg_val &= 0b11110000;                                   // clear current bits [3:0]
-    reg_val |= (low_current_mode ? 0b00000000 : 0b00000001); // set current 300ma or 450ma
-    EC_E_BOOL_R_BOOL(axp216_reg_write(AXP216_CHARGE1, reg_val));
+    reg_new = reg_val & 0b11110000;                          // clear current bits [3:0]
+    reg_new |= (low_current_mode ? 0b00000000 : 0b00000001); // set current 300ma or 450ma
+    // runs on every status refresh, the value rarely changes
+    if ( reg_new != reg_val )
+        EC_E_BOOL_R_BOOL(axp216_reg_post(AXP216_CHARGE1, reg_new));
     return true;
 }
 
@@ -183,6 +201,8 @@ Power_Error_t axp216_reset(bool hard_reset)
         pmu_interface_p->Delay_ms(100);
         pmu_interface_p->GPIO.Config(7, PWR_GPIO_Config_DEFAULT);
     }
+    // registers are back at their defaults
+    pmu_reg_cache_invalidate(&reg_cache);
 
     return PWR_ERROR_NONE;
 }
@@ -192,12 +212,8 @@ Power_Error_t axp216_irq(void)
     uint8_t irqs[5] = {0};
     uint64_t irq_bits = 0;
 
-    // read irq
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTSTS1, &irqs[0]));
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTSTS2, &irqs[1]));
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTSTS3, &irqs[2]));
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTSTS4, &irqs[3]));
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTSTS5, &irqs[4]));
+    // read irq, INTSTS1..5 in one go
+    EC_E_BOOL_R_PWR_ERR(axp216_reg_read_burst(AXP216_INTSTS1, sizeof(irqs), irqs));
 
     irq_bits |= ((((irqs[0] & (1 << 6))) != 0) << PWR_IRQ_PWR_CONNECTED);    // acin only, as vbus connected to acin
     irq_bits |= ((((irqs[0] & (1 << 5))) != 0) << PWR_IRQ_PWR_DISCONNECTED); // acin only, as vbus connected to acin
@@ -225,7 +241,7 @@ Power_Error_t axp216_irq(void)
     // process irq
     pmu_interface_p->Irq(irq_bits);
 
-    // clear irq
+    // clear irq, blocking so a failed clear is reported and the line is not left asserted
     EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_INTSTS1, 0xFF));
     EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_INTSTS2, 0xFF));
     EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_INTSTS3, 0xFF));
@@ -317,40 +333,60 @@ Power_Error_t axp216_get_state(Power_State_t* state)
     return PWR_ERROR_NONE;
 }
 
-Power_Error_t axp216_pull_status(void)
+// 12 bit adc result, high byte first
+static uint16_t axp216_adc_value(const uint8_t* p_hl)
 {
     HL_Buff hlbuff;
 
+    hlbuff.u8_high = p_hl[0];
+    hlbuff.u8_low = p_hl[1];
+    return hlbuff.u16 >> 4;
+}
+
+// status registers read as a few contiguous bursts and decoded from the buffers
+// STATUS..MODE_CHGSTATUS, CHARGE1, INTTEMPH..VTSL_RES, VBATH..DCBATL_RES, BAT_LEVEL
+#define AXP216_TEMP_BURST_LEN (AXP216_VTSL_RES - AXP216_INTTEMPH + 1)
+#define AXP216_TEMP_AT(reg)   (temp + ((reg) - AXP216_INTTEMPH))
+#define AXP216_BAT_BURST_LEN  (AXP216_DCBATL_RES - AXP216_VBATH_RES + 1)
+#define AXP216_BAT_AT(reg)    (bat + ((reg) - AXP216_VBATH_RES))
+
+Power_Error_t axp216_pull_status(void)
+{
+    uint8_t status[2];
+    uint8_t charge1;
+    uint8_t temp[AXP216_TEMP_BURST_LEN];
+    uint8_t bat[AXP216_BAT_BURST_LEN];
+    uint8_t bat_level = 0;
+
     Power_Status_t status_temp = {0};
 
+    EC_E_BOOL_R_PWR_ERR(axp216_reg_read_burst(AXP216_STATUS, sizeof(status), status));
+    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_CHARGE1, &charge1));
+    EC_E_BOOL_R_PWR_ERR(axp216_reg_read_burst(AXP216_INTTEMPH, sizeof(temp), temp));
+    EC_E_BOOL_R_PWR_ERR(axp216_reg_read_burst(AXP216_VBATH_RES, sizeof(bat), bat));
+
     // sys voltage (not supported by axp216, set to zero)
     status_temp.sysVoltage = 0;
 
     // battery present
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_MODE_CHGSTATUS, &(hlbuff.u8_low)));
-    status_temp.batteryPresent = ((hlbuff.u8_low & (1 << 5)) == (1 << 5)); // bit 5, not documented
+    status_temp.batteryPresent = ((status[1] & (1 << 5)) == (1 << 5)); // bit 5, not documented
 
     if ( status_temp.batteryPresent )
     {
         // battery percent
-        hlbuff.u8_high = 0;
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_BAT_LEVEL, &(hlbuff.u8_low)));
-        if ( (hlbuff.u8_low & 0x80) == 0x80 ) // is data valid
-            status_temp.batteryPercent = hlbuff.u8_low & 0x7f;
+        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_BAT_LEVEL, &bat_level));
+        if ( (bat_level & 0x80) == 0x80 ) // is data valid
+            status_temp.batteryPercent = bat_level & 0x7f;
         else
             status_temp.batteryPercent = 0;
 
         // battery voltage
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_VBATH_RES, &(hlbuff.u8_high)));
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_VBATL_RES, &(hlbuff.u8_low)));
-        status_temp.batteryVoltage = (hlbuff.u16 >> 4) * 1.1 + 0; // val * step - base
+        status_temp.batteryVoltage = axp216_adc_value(AXP216_BAT_AT(AXP216_VBATH_RES)) * 1.1 + 0; // val * step - base
 
         // battery temp
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_VTSH_RES, &(hlbuff.u8_high)));
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_VTSL_RES, &(hlbuff.u8_low)));
-        status_temp.batteryTemp =
-            ntc_temp_cal_cv(NTC_Char_NCP15XH103F03RC_2585, 40, ((hlbuff.u16 >> 4) * 0.8 + 0) * 1000); // temp_c
+        status_temp.batteryTemp = ntc_temp_cal_cv(
+            NTC_Char_NCP15XH103F03RC_2585, 40, (axp216_adc_value(AXP216_TEMP_AT(AXP216_VTSH_RES)) * 0.8 + 0) * 1000
+        ); // temp_c
     }
     else
     {
@@ -360,31 +396,26 @@ Power_Error_t axp216_pull_status(void)
     }
 
     // pmu temp
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTTEMPH, &(hlbuff.u8_high)));
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_INTTEMPL, &(hlbuff.u8_low)));
-    status_temp.pmuTemp = (uint16_t)((hlbuff.u16 >> 4) * 0.1 - 267.7); // val * step - base
+    status_temp.pmuTemp =
+        (uint16_t)(axp216_adc_value(AXP216_TEMP_AT(AXP216_INTTEMPH)) * 0.1 - 267.7); // val * step - base
 
     // charging
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_CHARGE1, &(hlbuff.u8_low)));
-    status_temp.chargeAllowed = ((hlbuff.u8_low & (1 << 7)) == (1 << 7));
+    status_temp.chargeAllowed = ((charge1 & (1 << 7)) == (1 << 7));
 
-    hlbuff.u8_high = 0;
-    EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_STATUS, &(hlbuff.u8_low)));
     status_temp.chargerAvailable =
-        (((hlbuff.u8_low & ((1 << 7) | (1 << 6))) == ((1 << 7) | (1 << 6))) && // acin
-         ((hlbuff.u8_low & ((1 << 5) | (1 << 4))) == ((1 << 5) | (1 << 4)))    // vbus
+        (((status[0] & ((1 << 7) | (1 << 6))) == ((1 << 7) | (1 << 6))) && // acin
+         ((status[0] & ((1 << 5) | (1 << 4))) == ((1 << 5) | (1 << 4)))    // vbus
         );
 
     if ( status_temp.chargerAvailable )
     {
         // read gpio
         bool gpio_high_low = true;
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_GPIO1_CTL, 0b00000010)); // gpio1 input
-        hlbuff.u8_high = 0;
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_GPIO01_SIGNAL, &(hlbuff.u8_low))); // gpio1 read
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_GPIO1_CTL, 0b00000111));          // gpio1 float
-        gpio_high_low = ((hlbuff.u8_low & (1 << 1)) == (1 << 1));
+        uint8_t gpio_signal = 0;
+        EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_GPIO1_CTL, 0b00000010));      // gpio1 input
+        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_GPIO01_SIGNAL, &gpio_signal)); // gpio1 read
+        EC_E_BOOL_R_PWR_ERR(axp216_reg_write(AXP216_GPIO1_CTL, 0b00000111));      // gpio1 float
+        gpio_high_low = ((gpio_signal & (1 << 1)) == (1 << 1));
 
         status_temp.wiredCharge = gpio_high_low;
         status_temp.wirelessCharge = !gpio_high_low; // low is wireless
@@ -392,25 +423,19 @@ Power_Error_t axp216_pull_status(void)
         // wireless charge current limit to 300ma
         EC_E_BOOL_R_PWR_ERR(axp216_charge_current_sel(status_temp.wirelessCharge));
 
-        hlbuff.u8_high = 0;
-        EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_MODE_CHGSTATUS, &(hlbuff.u8_low)));
-        status_temp.chargeFinished = ((hlbuff.u8_low & (1 << 6)) != (1 << 6));
+        status_temp.chargeFinished = ((status[1] & (1 << 6)) != (1 << 6));
 
         // if charging allowd, check charging status
         if ( status_temp.chargeAllowed && !status_temp.chargeFinished )
         {
             // charging current
-            EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_CCBATH_RES, &(hlbuff.u8_high)));
-            EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_CCBATL_RES, &(hlbuff.u8_low)));
-            status_temp.chargeCurrent = (hlbuff.u16 >> 4);
+            status_temp.chargeCurrent = axp216_adc_value(AXP216_BAT_AT(AXP216_CCBATH_RES));
             status_temp.dischargeCurrent = 0;
         }
         else
         {
             // discharging current
-            EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_DCBATH_RES, &(hlbuff.u8_high)));
-            EC_E_BOOL_R_PWR_ERR(axp216_reg_read(AXP216_DCBATL_RES, &(hlbuff.u8_low)));
-            status_temp.dischargeCurrent = (hlbuff.u16 >> 4);
+            status_temp.dischargeCurrent = axp216_adc_value(AXP216_BAT_AT(AXP216_DCBATH_RES));
             status_temp.chargeCurrent = 0;
         }
     }
@@ -474,6 +499,7 @@ Power_Error_t axp216_get_feature(Power_Featrue_t feature, bool* enable)
 void axp216_setup_interface(PMU_Interface_t* pmu_if_p, PMU_t* pmu_p)
 {
     pmu_interface_p = pmu_if_p;
+    pmu_reg_cache_init(&reg_cache, pmu_if_p, AXP216_I2C_ADDR, reg_cacheable, sizeof(reg_cacheable));
 
     pmu_p->isInitialized = &initialized;
     strncpy(pmu_p->InstanceName, "AXP216", PMU_INSTANCE_NAME_MAX_LEN);
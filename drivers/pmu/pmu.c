@@ -4,6 +4,44 @@
 #include "axp216.h"
 
 static PMU_t pmu = {0};
+static PMU_Interface_t* pmu_interface_p = NULL;
+static PMU_Refresh_Stats_t refresh_stats = {0};
+static Power_Error_t (*pull_status_p)(void) = NULL;
+
+// bus cost of every status refresh, whichever chip is behind it
+static Power_Error_t pmu_pull_status(void)
+{
+    uint32_t transfers, bus_us;
+    uint32_t transfers_end, bus_us_end;
+    Power_Error_t ret;
+
+    pmu_interface_p->BusStats(&transfers, &bus_us);
+    ret = pull_status_p();
+    pmu_interface_p->BusStats(&transfers_end, &bus_us_end);
+
+    transfers = transfers_end - transfers;
+    bus_us = bus_us_end - bus_us;
+
+    refresh_stats.refreshes++;
+    refresh_stats.transfers = (transfers > UINT16_MAX) ? UINT16_MAX : transfers;
+    refresh_stats.bus_us = (bus_us > UINT16_MAX) ? UINT16_MAX : bus_us;
+    if ( refresh_stats.transfers > refresh_stats.transfers_max )
+        refresh_stats.transfers_max = refresh_stats.transfers;
+    if ( refresh_stats.bus_us > refresh_stats.bus_us_max )
+        refresh_stats.bus_us_max = refresh_stats.bus_us;
+
+    return ret;
+}
+
+static PMU_t* pmu_attach(PMU_Interface_t* pmu_if)
+{
+    pmu_interface_p = pmu_if;
+    memset(&refresh_stats, 0x00, sizeof(refresh_stats));
+    pull_status_p = pmu.PullStatus;
+    pmu.PullStatus = pmu_pull_status;
+    pmu.RefreshStats = &refresh_stats;
+    return &pmu;
+}
 
 PMU_t* pmu_probe(PMU_Interface_t* pmu_if)
 {
@@ -11,12 +49,12 @@ PMU_t* pmu_probe(PMU_Interface_t* pmu_if)
     // axp216 probe
     axp216_setup_interface(pmu_if, &pmu);
     if ( pmu.Init() == PWR_ERROR_NONE )
-        return &pmu;
+        return pmu_attach(pmu_if);
 
     // axp2101 probe
     axp2101_setup_interface(pmu_if, &pmu);
     if ( pmu.Init() == PWR_ERROR_NONE )
-        return &pmu;
+        return pmu_attach(pmu_if);
 
     return NULL;
 }
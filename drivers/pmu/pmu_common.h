@@ -129,6 +129,9 @@ typedef struct
 
 } Power_Status_t;
 
+// async register access completion, runs in the bus interrupt
+typedef void (*PMU_I2C_Callback_t)(const bool success, void* const p_context);
+
 typedef struct
 {
     bool* isInitialized;
@@ -139,13 +142,20 @@ typedef struct
     bool (*Send)(const uint8_t device_addr, const uint32_t len, const uint8_t* const data); // iic host send
     bool (*Receive)(const uint8_t device_addr, const uint32_t len, uint8_t* const data);    // iic host receive
     void (*Irq)(const uint64_t irq);                                                        // passed irq out
+    void (*BusStats)(uint32_t* const transfers, uint32_t* const bus_us);                    // totals since init
 
     struct
     {
         bool (*Write)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t data);
         bool (*Read)(const uint8_t device_addr, const uint8_t reg_addr, uint8_t* const data);
+        bool (*ReadBurst)(const uint8_t device_addr, const uint8_t reg_addr, const uint32_t len, uint8_t* const data);
         bool (*SetBits)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t bit_mask);
         bool (*ClrBits)(const uint8_t device_addr, const uint8_t reg_addr, const uint8_t bit_mask);
+        // queued, false if nothing was queued, callback may be NULL
+        bool (*WriteAsync)(
+            const uint8_t device_addr, const uint8_t reg_addr, const uint8_t data, PMU_I2C_Callback_t callback,
+            void* const p_context
+        );
 
     } Reg;
 
@@ -156,16 +166,33 @@ typedef struct
         bool (*Read)(uint32_t pin_num, bool* const high_low);
     } GPIO;
 
+    // kept in flash by the application, hash of the battery table the fuel gauge BROM last passed with
+    struct
+    {
+        bool (*Get)(uint32_t* const table_hash); // false if nothing was verified yet
+        bool (*Set)(const uint32_t table_hash);
+    } BromMarker;
+
     void (*Delay_ms)(const uint32_t ms);
     void (*Log)(const Power_LogLevel_t level, const char* fmt, ...);
 
 } PMU_Interface_t;
 
+typedef struct
+{
+    uint32_t refreshes; // PullStatus calls
+    uint16_t transfers; // bus transactions of the last refresh
+    uint16_t bus_us;    // bus time of the last refresh
+    uint16_t transfers_max;
+    uint16_t bus_us_max;
+} PMU_Refresh_Stats_t;
+
 typedef struct
 {
     bool* isInitialized;
     char InstanceName[PMU_INSTANCE_NAME_MAX_LEN];
     Power_Status_t* PowerStatus;
+    PMU_Refresh_Stats_t* RefreshStats;
     Power_Error_t (*Init)(void);
     Power_Error_t (*Deinit)(void);
     Power_Error_t (*Reset)(bool hard_reset);
@@ -0,0 +1,140 @@
+#include "pmu_reg_cache.h"
+
+#define REG_BIT(index) (1ULL << (index))
+
+// position in the cacheable list, count if the register is not in it
+static uint8_t pmu_reg_cache_index(const PMU_Reg_Cache_t* cache, const uint8_t reg)
+{
+    uint8_t i;
+
+    for ( i = 0; i < cache->count; i++ )
+    {
+        if ( cache->regs[i] == reg )
+            break;
+    }
+    return i;
+}
+
+// a posted write failed, whichever it was the chip may not hold what the shadow says
+static void pmu_reg_cache_check_posted(PMU_Reg_Cache_t* cache)
+{
+    if ( !cache->post_failed )
+        return;
+
+    cache->post_failed = false;
+    cache->valid &= ~cache->posted;
+    cache->posted = 0;
+}
+
+static void pmu_reg_cache_store(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t val)
+{
+    uint8_t index = pmu_reg_cache_index(cache, reg);
+
+    if ( index == cache->count )
+        return;
+
+    cache->value[index] = val;
+    cache->valid |= REG_BIT(index);
+}
+
+// failed access, the chip may or may not have taken the value
+static void pmu_reg_cache_drop(PMU_Reg_Cache_t* cache, const uint8_t reg)
+{
+    uint8_t index = pmu_reg_cache_index(cache, reg);
+
+    if ( index == cache->count )
+        return;
+
+    cache->valid &= ~REG_BIT(index);
+}
+
+// runs in the i2c interrupt, only flags the failure for the next access
+static void pmu_reg_cache_post_done(const bool success, void* const p_context)
+{
+    if ( !success )
+        ((PMU_Reg_Cache_t*)p_context)->post_failed = true;
+}
+
+void pmu_reg_cache_init(
+    PMU_Reg_Cache_t* cache, PMU_Interface_t* pmu_if, const uint8_t device_addr, const uint8_t* cacheable_regs,
+    const uint8_t cacheable_count
+)
+{
+    memset(cache, 0x00, sizeof(PMU_Reg_Cache_t));
+    cache->pmu_if = pmu_if;
+    cache->device_addr = device_addr;
+    cache->regs = cacheable_regs;
+    // registers past the limit simply go to the chip every time
+    cache->count = (cacheable_count > PMU_REG_CACHE_MAX) ? PMU_REG_CACHE_MAX : cacheable_count;
+}
+
+void pmu_reg_cache_invalidate(PMU_Reg_Cache_t* cache)
+{
+    cache->valid = 0;
+    cache->posted = 0;
+    cache->post_failed = false;
+}
+
+bool pmu_reg_cache_read(PMU_Reg_Cache_t* cache, const uint8_t reg, uint8_t* const val)
+{
+    uint8_t index;
+
+    pmu_reg_cache_check_posted(cache);
+    index = pmu_reg_cache_index(cache, reg);
+    if ( index < cache->count && (cache->valid & REG_BIT(index)) != 0 )
+    {
+        *val = cache->value[index];
+        return true;
+    }
+
+    if ( !cache->pmu_if->Reg.Read(cache->device_addr, reg, val) )
+        return false;
+
+    pmu_reg_cache_store(cache, reg, *val);
+    return true;
+}
+
+bool pmu_reg_cache_write(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t val)
+{
+    pmu_reg_cache_check_posted(cache);
+    if ( !cache->pmu_if->Reg.Write(cache->device_addr, reg, val) )
+    {
+        pmu_reg_cache_drop(cache, reg);
+        return false;
+    }
+
+    pmu_reg_cache_store(cache, reg, val);
+    return true;
+}
+
+// reads queue behind the write, the shadow takes the value right away and the completion drops it
+// again on failure, before the next access trusts it
+bool pmu_reg_cache_post(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t val)
+{
+    uint8_t index;
+
+    pmu_reg_cache_check_posted(cache);
+    if ( !cache->pmu_if->Reg.WriteAsync(cache->device_addr, reg, val, pmu_reg_cache_post_done, cache) )
+        return pmu_reg_cache_write(cache, reg, val);
+
+    index = pmu_reg_cache_index(cache, reg);
+    if ( index < cache->count )
+        cache->posted |= REG_BIT(index);
+    pmu_reg_cache_store(cache, reg, val);
+    return true;
+}
+
+bool pmu_reg_cache_update(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t mask, const uint8_t bits)
+{
+    uint8_t val;
+    uint8_t val_new;
+
+    if ( !pmu_reg_cache_read(cache, reg, &val) )
+        return false;
+
+    val_new = (val & ~mask) | (bits & mask);
+    if ( val_new == val )
+        return true;
+
+    return pmu_reg_cache_write(cache, reg, val_new);
+}
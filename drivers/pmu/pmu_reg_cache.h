@@ -0,0 +1,43 @@
+#ifndef __PMU_REG_CACHE_H_
+#define __PMU_REG_CACHE_H_
+
+#include "pmu_common.h"
+
+// ================================
+// defines
+#define PMU_REG_CACHE_MAX 48 // cacheable registers per chip, bits of the masks below
+
+// ================================
+// types
+
+// Shadow copy of the registers only we change. Status, adc, irq flags, data ports and bits the chip
+// clears by itself must stay volatile, anything not listed as cacheable goes to the chip every time.
+// Entries follow the order of the cacheable list, which has to stay valid for the life of the cache.
+typedef struct
+{
+    PMU_Interface_t* pmu_if;
+    uint8_t device_addr;
+    const uint8_t* regs;
+    uint8_t count;
+    uint64_t valid;
+    uint64_t posted;             // written without waiting, dropped again if any of those writes fails
+    volatile bool post_failed;   // set from the i2c completion
+    uint8_t value[PMU_REG_CACHE_MAX];
+} PMU_Reg_Cache_t;
+
+// ================================
+// functions
+
+void pmu_reg_cache_init(
+    PMU_Reg_Cache_t* cache, PMU_Interface_t* pmu_if, const uint8_t device_addr, const uint8_t* cacheable_regs,
+    const uint8_t cacheable_count
+);
+void pmu_reg_cache_invalidate(PMU_Reg_Cache_t* cache); // chip reset, nothing in the shadow holds anymore
+
+bool pmu_reg_cache_read(PMU_Reg_Cache_t* cache, const uint8_t reg, uint8_t* const val);
+bool pmu_reg_cache_write(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t val);
+bool pmu_reg_cache_post(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t val); // queued, no wait
+// bits in mask take their value from bits, no write if nothing changes
+bool pmu_reg_cache_update(PMU_Reg_Cache_t* cache, const uint8_t reg, const uint8_t mask, const uint8_t bits);
+
+#endif //__PMU_REG_CACHE_H_